@@ -0,0 +1,1380 @@
+// Benchmarks for fjson.
+//
+// Usage: bench_json <mode> [arguments]
+//   groupby [size_mb] [threads]   group-by over a generated NDJSON log
+//   validate [size_mb]            IsValid() against full parsing
+//   incremental [records] [updates]
+//                                 Dump() against DumpCached() of a large state
+//                                 object after each small change
+//   transaction [records] [changes]
+//                                 rollback through a Transaction against
+//                                 restoring a deep copy taken beforehand
+//   mvcc [readers] [versions]     readers of a VersionedDocument while a writer
+//                                 publishes versions, against a shared_mutex
+//   reparse [size_mb] [edits]     Reparse() after single-digit edits against
+//                                 parsing the whole text again
+//   trace [size_mb] [out.json]    parse and dump without and with a
+//                                 TraceCollector, optionally writing the
+//                                 Chrome trace (bench_json_trace, built with
+//                                 FJSON_TRACE)
+//   perfgate <baseline> [--update]
+//                                 allocation counts of parse and dump
+//                                 workloads against a stored baseline; fails
+//                                 on regressions (registered with ctest)
+//   replay <file> [ndjson|length-prefixed] [passes] [pointer...]
+//                                 parse, read the given JSON pointers from
+//                                 and dump every captured message; reports
+//                                 throughput, allocations and peak memory
+//   latency [messages]            p50/p99/p99.9/max latency of parsing,
+//                                 mutating, dumping and destroying each
+//                                 message of a stream
+//   adversarial [scale]           parse time and memory on hostile inputs at
+//                                 two sizes; fails unless both grow linearly
+//                                 (registered with ctest)
+//   keys [members] [lookups]      member lookups in an object whose keys share
+//                                 a long prefix; compare bench_json_hashed
+//                                 (FJSON_HASHED_KEYS) with bench_json
+//   prefetch [size_mb] [passes]   Dump, Compare and Select over a document
+//                                 with shuffled records at several prefetch
+//                                 distances
+//   scaling [size_mb] [max_threads]
+//                                 Sort and GroupBy on thread pools of 1, 2,
+//                                 4, ... max_threads threads
+//   shared [size_mb] [processes]  forked readers of one SharedDocument against
+//                                 each process parsing its own copy
+//   pmr [size_mb]                 parsing with different memory resources
+//                                 (bench_json_pmr, built with FJSON_USE_PMR)
+//   traverse [size_mb] [passes]   traversal of documents on 4 KB pages against
+//                                 a HugePageArena (bench_json_pmr)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include "fjson.h"
+#ifdef FJSON_HAVE_POSIX_IO
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace fjson;
+
+// Heap usage of everything allocated through operator new. Byte counts need 
+// malloc_usable_size and stay zero elsewhere.
+std::atomic<size_t> g_allocations{0};
+std::atomic<size_t> g_allocated_bytes{0};
+std::atomic<size_t> g_heap_bytes{0};
+std::atomic<size_t> g_peak_heap_bytes{0};
+
+void* operator new(size_t size)
+{
+    void *p = std::malloc(size ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+#ifdef __GLIBC__
+    g_allocated_bytes.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+    size_t bytes = g_heap_bytes.fetch_add(malloc_usable_size(p), 
+                                          std::memory_order_relaxed) + 
+                   malloc_usable_size(p);
+    size_t peak = g_peak_heap_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !g_peak_heap_bytes.compare_exchange_weak(
+            peak, bytes, std::memory_order_relaxed)) {}
+#endif
+    return p;
+}
+
+// Kept out of line: once operator delete is inlined, GCC sees free() on a 
+// pointer from operator new and warns (-Wmismatched-new-delete).
+[[gnu::noinline]] void FreeCounted(void *p) noexcept
+{
+#ifdef __GLIBC__
+    g_heap_bytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+#endif
+    std::free(p);
+}
+
+void operator delete(void *p) noexcept
+{
+    if (p == nullptr) return;
+    FreeCounted(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+// A synthetic access log, one JSON object per line.
+std::string GenerateLog(size_t bytes)
+{
+    static const char *services[] = {"auth", "billing", "search", "checkout", 
+                                     "gateway", "profile", "inventory"};
+    std::string log;
+    log.reserve(bytes + 256);
+    unsigned long state = 12345;
+    for (size_t i = 0; log.size() < bytes; ++i) {
+        state = state * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned r = static_cast<unsigned>(state >> 33);
+        log += "{\"ts\": ";
+        log += std::to_string(1600000000 + i);
+        log += ", \"service\": \"";
+        log += services[r % 7];
+        log += "\", \"status\": ";
+        log += (r % 50) ? "200" : "500";
+        log += ", \"latency\": {\"p50\": ";
+        log += std::to_string(r % 100);
+        log += ", \"p99\": ";
+        log += std::to_string(r % 1000);
+        log += "}, \"user\": {\"id\": \"u";
+        log += std::to_string(r % 100000);
+        log += "\", \"roles\": [\"reader\", \"writer\"]}, \"message\": ";
+        log += "\"request completed without errors\"}\n";
+    }
+    return log;
+}
+
+
+int BenchGroupBy(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 64;
+    unsigned threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 0;
+
+    auto start = Clock::now();
+    std::string log = GenerateLog(size_mb << 20);
+    std::cout << "generated " << log.size() / double(1 << 20) << " MB in " 
+              << SecondsSince(start) << " s" << std::endl;
+
+    GroupByQuery query;
+    query.group_by = {L"service"};
+    query.fields = {{L"latency", L"p99"}, {L"status"}};
+    for (unsigned n: {1u, threads}) {
+        query.num_threads = n;
+        start = Clock::now();
+        Json result = GroupBy(log.data(), log.size(), query);
+        double seconds = SecondsSince(start);
+        std::cout << "groupby threads=" << (n ? n : _ResolveThreadCount(0)) 
+                  << ": " << seconds << " s, " 
+                  << log.size() / double(1 << 20) / seconds << " MB/s, " 
+                  << result.size() << " groups" << std::endl;
+    }
+    return 0;
+}
+
+
+// The generated log as a single JSON array.
+std::string GenerateArray(size_t bytes)
+{
+    std::string text = GenerateLog(bytes);
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\n') text[i] = ',';
+    }
+    text.back() = ']';
+    text.insert(text.begin(), '[');
+    return text;
+}
+
+
+int BenchValidate(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    std::string text = GenerateArray(size_mb << 20);
+    double mb = text.size() / double(1 << 20);
+
+    auto start = Clock::now();
+    bool valid = IsValid(text.data(), text.size());
+    double validate_seconds = SecondsSince(start);
+    std::cout << "IsValid:     " << validate_seconds << " s, " 
+              << mb / validate_seconds << " MB/s" << (valid ? "" : " (invalid!)") 
+              << std::endl;
+
+    start = Clock::now();
+    Json json = Json::Parse(text.data(), text.size());
+    double parse_seconds = SecondsSince(start);
+    std::cout << "Json::Parse: " << parse_seconds << " s, " 
+              << mb / parse_seconds << " MB/s, " << json.size() << " records" 
+              << std::endl;
+    std::cout << "speedup:     " << parse_seconds / validate_seconds << "x" 
+              << std::endl;
+    return valid ? 0 : 1;
+}
+
+
+string_type SessionKey(size_t i)
+{
+    string_type key = L"session";
+    key += std::to_wstring(i).c_str();
+    return key;
+}
+
+
+int BenchIncremental(int argc, char **argv)
+{
+    size_t records = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 100000;
+    unsigned updates = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+    // A state object of per-session records, keyed by id.
+    std::string text = GenerateArray(records * 180);
+    Json sessions = Json::Parse(text.data(), text.size());
+    Json state(JsonValueType::Object);
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        state[SessionKey(i)] = sessions[i];
+    }
+    size_t size = state.Dump().size();
+    std::cout << "state: " << state.size() << " records, " 
+              << size / double(1 << 20) << " MB" << std::endl;
+
+    double full = 0, cached = 0;
+    state.DumpCached();
+    for (unsigned i = 0; i < updates; ++i) {
+        Json &record = state[SessionKey(i * 7919 % state.size())];
+        record[L"status"] = static_cast<double>(i);
+
+        auto start = Clock::now();
+        std::string a = state.Dump();
+        full += SecondsSince(start);
+        start = Clock::now();
+        std::string b = state.DumpCached();
+        cached += SecondsSince(start);
+        if (a != b) {
+            std::cout << "mismatch!" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Dump:       " << full / updates * 1000 << " ms per update" 
+              << std::endl;
+    std::cout << "DumpCached: " << cached / updates * 1000 << " ms per update (" 
+              << full / cached << "x)" << std::endl;
+    return 0;
+}
+
+
+Json DeepCopy(const Json &json)
+{
+    if (json.IsArray()) {
+        Json copy(JsonValueType::Array);
+        for (const auto &element: json.GetArrayRef()) {
+            copy.GetArrayRef().push_back(DeepCopy(element));
+        }
+        return copy;
+    }
+    if (json.IsObject()) {
+        Json copy(JsonValueType::Object);
+        for (const auto &member: json.GetObjectRef()) {
+            copy.GetObjectRef().emplace(member.first, DeepCopy(member.second));
+        }
+        return copy;
+    }
+    return json;
+}
+
+
+int BenchTransaction(int argc, char **argv)
+{
+    size_t records = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 100000;
+    unsigned changes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10;
+    std::string text = GenerateArray(records * 180);
+    Json state = Json::Parse(text.data(), text.size());
+    std::string original = state.Dump();
+    std::cout << "state: " << state.size() << " records" << std::endl;
+
+    auto change = [&](unsigned i) -> Json& {
+        return state[static_cast<int>(i * 7919 % state.size())];
+    };
+    // The transaction runs first: freeing the replaced tree of the deep copy
+    // leaves work to the allocator that would be charged to later code.
+    auto start = Clock::now();
+    {
+        Transaction transaction;
+        for (unsigned i = 0; i < changes; ++i) {
+            transaction.Set(change(i), L"status", Json(0.));
+        }
+        transaction.Rollback();
+    }
+    double transaction_seconds = SecondsSince(start);
+
+    start = Clock::now();
+    Json snapshot = DeepCopy(state);
+    for (unsigned i = 0; i < changes; ++i) change(i)[L"status"] = 0.;
+    state = snapshot;
+    double copy_seconds = SecondsSince(start);
+    if (state.Dump() != original) {
+        std::cout << "mismatch!" << std::endl;
+        return 1;
+    }
+    std::cout << "deep copy:   " << copy_seconds * 1000 << " ms" << std::endl;
+    std::cout << "transaction: " << transaction_seconds * 1000 << " ms (" 
+              << copy_seconds / transaction_seconds << "x)" << std::endl;
+    return 0;
+}
+
+
+int BenchMvcc(int argc, char **argv)
+{
+    unsigned num_readers = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 4;
+    unsigned versions = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    std::string text = GenerateArray(8 << 20);
+    Json records = Json::Parse(text.data(), text.size());
+    Json state(JsonValueType::Object);
+    state[L"records"] = records;
+    state[L"counter"] = 0.;
+
+    // Readers look up a few values per snapshot, as request handlers would.
+    auto read = [](const Json &root) {
+        const Json &list = root[L"records"];
+        double sum = root[L"counter"].ToDouble();
+        for (int i = 0; i < 16; ++i) sum += list[i * 997][L"status"].ToDouble();
+        return sum;
+    };
+
+    auto run = [&](const char *label, std::function<double()> reader, 
+                   std::function<void(unsigned)> writer) {
+        std::atomic<bool> done{false};
+        std::atomic<size_t> reads{0};
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < num_readers; ++i) {
+            threads.emplace_back([&]() {
+                size_t n = 0;
+                double sink = 0;
+                while (!done.load(std::memory_order_relaxed)) {
+                    sink += reader();
+                    ++n;
+                }
+                reads += n + (sink < 0);
+            });
+        }
+        auto start = Clock::now();
+        for (unsigned v = 0; v < versions; ++v) writer(v);
+        double seconds = SecondsSince(start);
+        done = true;
+        for (auto &thread: threads) thread.join();
+        std::cout << label << ": " << versions / seconds << " versions/s, " 
+                  << reads / seconds << " reads/s" << std::endl;
+    };
+
+    VersionedDocument document(state);
+    run("mvcc        ", [&]() { return read(document.Read().Root()); }, 
+        [&](unsigned v) {
+            auto writer = document.Write();
+            writer.Set(L"/counter", Json(double(v)));
+            std::wstring index = std::to_wstring(v % 1000);
+            string_type pointer = L"/records/";
+            pointer.append(index.begin(), index.end());
+            writer.Set(pointer + L"/status", Json(double(v)));
+            writer.Publish();
+        });
+
+    std::shared_mutex mutex;
+    run("shared_mutex", [&]() {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return read(state);
+        }, 
+        [&](unsigned v) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            state[L"counter"] = double(v);
+            state[L"records"][static_cast<int>(v % 1000)][L"status"] = double(v);
+        });
+    return 0;
+}
+
+
+int BenchReparse(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 8;
+    unsigned edits = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20;
+    std::string utf8 = GenerateArray(size_mb << 20);
+    string_type text;
+    _AppendUtf8(text, utf8.data(), utf8.size());
+    SourceMap source_map;
+    auto start = Clock::now();
+    Json json = Json::Parse(text, source_map);
+    double full = SecondsSince(start);
+    std::cout << "full parse: " << full * 1000 << " ms, " << source_map.size() 
+              << " values" << std::endl;
+
+    // Change a digit of the "ts" of records spread over the document.
+    double incremental = 0;
+    size_t parsed = 0;
+    for (unsigned i = 0; i < edits; ++i) {
+        size_t offset = text.find(L"\"ts\": ", text.size() / edits * i);
+        if (offset == string_type::npos) break;
+        offset += 6;
+        start = Clock::now();
+        parsed += Reparse(json, text, source_map, TextEdit{offset, 1, L"7"});
+        incremental += SecondsSince(start);
+    }
+    std::cout << "Reparse:    " << incremental / edits * 1000 << " ms per edit, " 
+              << parsed / edits << " characters parsed per edit (" 
+              << full / (incremental / edits) << "x)" << std::endl;
+    return 0;
+}
+
+
+int BenchTrace(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    std::string text = GenerateArray(size_mb << 20);
+    if (!FJSON_TRACE_ENABLED) {
+        std::cout << "built without FJSON_TRACE: trace points are compiled out" 
+                  << std::endl;
+    }
+    auto run = [&]() {
+        auto start = Clock::now();
+        Json json = Json::Parse(text.data(), text.size());
+        double parse = SecondsSince(start);
+        start = Clock::now();
+        std::string out = json.Dump();
+        return std::make_pair(parse, SecondsSince(start));
+    };
+    auto plain = run();
+    TraceCollector collector;
+    SetTraceCollector(&collector);
+    auto traced = run();
+    SetTraceCollector(nullptr);
+    std::cout << "no collector: parse " << plain.first << " s, dump " 
+              << plain.second << " s" << std::endl;
+    std::cout << "collector:    parse " << traced.first << " s, dump " 
+              << traced.second << " s, " << collector.size() << " events" 
+              << std::endl;
+    if (argc > 1) {
+        std::string trace;
+        collector.Write(trace);
+        std::ofstream file(argv[1]);
+        file << trace;
+        if (!file) {
+            std::cerr << "trace: cannot write " << argv[1] << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Allocation counts of one run of `work`, after a warm-up run that absorbs 
+// one-time allocations such as locale setup.
+std::map<std::string, double> MeasureAllocations(const std::function<void()> &work)
+{
+    work();
+    size_t allocations = g_allocations, bytes = g_allocated_bytes;
+    g_peak_heap_bytes = g_heap_bytes.load();
+    size_t heap_base = g_heap_bytes;
+    work();
+    std::map<std::string, double> metrics;
+    metrics["allocations"] = g_allocations - allocations;
+    // Byte counts are zero where malloc_usable_size is unavailable.
+    if (g_allocated_bytes != bytes) {
+        metrics["allocated_bytes"] = g_allocated_bytes - bytes;
+        metrics["peak_heap_bytes"] = g_peak_heap_bytes - heap_base;
+    }
+    return metrics;
+}
+
+
+// Regression gate on allocation counts, which unlike timings are exact and 
+// do not depend on machine load. The baseline holds a relative "tolerance" 
+// and one number per metric; --update rewrites it from this build. Counts 
+// depend on the standard library, so the stored baseline is for libstdc++.
+int BenchPerfGate(int argc, char **argv)
+{
+    if (argc < 1) {
+        std::cerr << "perfgate: a baseline file is required" << std::endl;
+        return 2;
+    }
+    bool update = argc > 1 && std::strcmp(argv[1], "--update") == 0;
+
+    std::string text = GenerateArray(1 << 20);
+    string_type wide;
+    _AppendUtf8(wide, text.data(), text.size());
+    Json document = Json::Parse(text.data(), text.size());
+    std::string log = GenerateLog(256 << 10);
+    std::vector<std::string> lines;
+    for (size_t begin = 0, end; (end = log.find('\n', begin)) != std::string::npos; 
+         begin = end + 1) {
+        lines.push_back(log.substr(begin, end - begin));
+    }
+
+    std::vector<std::pair<std::string, std::function<void()> > > workloads = {
+        {"parse_utf8", [&]() { Json::Parse(text.data(), text.size()); }},
+        {"parse_wide", [&]() { Json::Parse(wide); }},
+        {"parse_source_map", [&]() {
+            SourceMap source_map;
+            Json::Parse(wide, source_map);
+        }},
+        {"dump", [&]() { document.Dump(); }},
+        {"dump_pretty", [&]() { document.Dump(2); }},
+        {"dump_cached_after_edit", [&]() {
+            document.DumpCached();
+            document[0][L"status"] = 503.;
+            document.DumpCached();
+        }},
+        {"message_roundtrip", [&]() {
+            std::string out;
+            for (const auto &line: lines) {
+                out.clear();
+                Json::Parse(line.data(), line.size()).Dump(out);
+            }
+        }},
+    };
+
+    Json measured(JsonValueType::Object);
+    for (const auto &workload: workloads) {
+        for (const auto &metric: MeasureAllocations(workload.second)) {
+            string_type name;
+            std::string key = workload.first + "." + metric.first;
+            _AppendUtf8(name, key.data(), key.size());
+            measured[name] = metric.second;
+        }
+    }
+
+    if (update) {
+        Json baseline(JsonValueType::Object);
+        baseline[L"tolerance"] = 0.01;
+        baseline[L"metrics"] = measured;
+        std::ofstream file(argv[0]);
+        file << baseline.Dump(2) << "\n";
+        if (!file) {
+            std::cerr << "perfgate: cannot write " << argv[0] << std::endl;
+            return 1;
+        }
+        std::cout << "baseline written to " << argv[0] << std::endl;
+        return 0;
+    }
+
+    std::ifstream file(argv[0]);
+    if (!file) {
+        std::cerr << "perfgate: cannot open " << argv[0] << std::endl;
+        return 1;
+    }
+    Json baseline = Json::Parse(file);
+    double tolerance = baseline[L"tolerance"].ToDouble();
+    const Json &expected = baseline[L"metrics"];
+    bool ok = true;
+    std::wstring_convert<std::codecvt_utf8_utf16<charT> > converter;
+    std::cout << std::fixed << std::setprecision(0);
+    for (const auto &metric: measured.GetObjectRef()) {
+        double value = metric.second.ToDouble();
+        std::cout << std::left << std::setw(44) 
+                  << converter.to_bytes(_ToStdString(metric.first)) << std::right 
+                  << std::setw(12) << value;
+        const Json *stored = expected.Find(metric.first);
+        if (stored == nullptr) {
+            std::cout << "  new metric" << std::endl;
+            continue;
+        }
+        double limit = stored->ToDouble() * (1 + tolerance);
+        std::cout << "  baseline " << std::setw(12) << stored->ToDouble();
+        if (value > limit) {
+            ok = false;
+            std::cout << "  REGRESSED";
+        } else if (value < stored->ToDouble() * (1 - tolerance)) {
+            std::cout << "  improved, consider --update";
+        }
+        std::cout << std::endl;
+    }
+    return ok ? 0 : 1;
+}
+
+
+// Split a capture into messages. NDJSON has one message per non-empty line; 
+// length-prefixed captures store each message after its size as a 4-byte 
+// little-endian integer. Returns false if the capture is truncated.
+bool SplitCapture(const std::string &capture, bool length_prefixed, 
+                  std::vector<std::pair<const char*, size_t> > &messages)
+{
+    const char *p = capture.data(), *end = p + capture.size();
+    while (p < end) {
+        if (length_prefixed) {
+            if (end - p < 4) return false;
+            const auto *bytes = reinterpret_cast<const unsigned char*>(p);
+            size_t size = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | 
+                          static_cast<size_t>(bytes[3]) << 24;
+            p += 4;
+            if (static_cast<size_t>(end - p) < size) return false;
+            messages.emplace_back(p, size);
+            p += size;
+        } else {
+            const char *line_end = static_cast<const char*>(
+                    std::memchr(p, '\n', end - p));
+            if (line_end == nullptr) line_end = end;
+            const char *q = p;
+            while (q < line_end && IsWhitespace(*q)) ++q;
+            if (q < line_end) messages.emplace_back(p, line_end - p);
+            p = line_end + 1;
+        }
+    }
+    return true;
+}
+
+
+double PeakResidentMb()
+{
+#ifdef FJSON_HAVE_POSIX_IO
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.;
+#else
+    return 0;
+#endif
+}
+
+
+int BenchReplay(int argc, char **argv)
+{
+    if (argc < 1) {
+        std::cerr << "replay: a capture file is required" << std::endl;
+        return 2;
+    }
+    std::ifstream file(argv[0], std::ios::binary);
+    if (!file) {
+        std::cerr << "replay: cannot open " << argv[0] << std::endl;
+        return 1;
+    }
+    std::string capture((std::istreambuf_iterator<char>(file)), 
+                        std::istreambuf_iterator<char>());
+    bool length_prefixed = argc > 1 && std::strcmp(argv[1], "length-prefixed") == 0;
+    if (argc > 1 && !length_prefixed && std::strcmp(argv[1], "ndjson") != 0) {
+        std::cerr << "replay: unknown format " << argv[1] << std::endl;
+        return 2;
+    }
+    unsigned passes = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 3;
+    std::vector<string_type> pointers;
+    for (int i = 3; i < argc; ++i) {
+        pointers.emplace_back();
+        _AppendUtf8(pointers.back(), argv[i], std::strlen(argv[i]));
+    }
+
+    std::vector<std::pair<const char*, size_t> > messages;
+    if (!SplitCapture(capture, length_prefixed, messages)) {
+        std::cerr << "replay: truncated capture" << std::endl;
+        return 1;
+    }
+    size_t bytes = 0;
+    for (const auto &message: messages) bytes += message.second;
+
+    double parse = 0, access = 0, dump = 0;
+    size_t found = 0, out_bytes = 0, errors = 0;
+    size_t allocations = g_allocations;
+    g_peak_heap_bytes = g_heap_bytes.load();
+    size_t heap_base = g_heap_bytes;
+    std::string out;
+    for (unsigned pass = 0; pass < passes; ++pass) {
+        for (const auto &message: messages) {
+            Json json;
+            auto start = Clock::now();
+            try {
+                json = Json::Parse(message.first, message.second);
+            } catch (ParseError &) {
+                ++errors;
+                continue;
+            }
+            auto parsed = Clock::now();
+            for (const auto &pointer: pointers) {
+                const Json *value = json.FindPointer(pointer);
+                if (value == nullptr) continue;
+                ++found;
+                if (value->IsString()) out_bytes += value->GetStringRef().size();
+                else if (value->IsNumber()) out_bytes += value->ToDouble() != 0;
+            }
+            auto accessed = Clock::now();
+            out.clear();
+            json.Dump(out);
+            out_bytes += out.size();
+            auto dumped = Clock::now();
+            parse += std::chrono::duration<double>(parsed - start).count();
+            access += std::chrono::duration<double>(accessed - parsed).count();
+            dump += std::chrono::duration<double>(dumped - accessed).count();
+        }
+    }
+    allocations = g_allocations - allocations;
+
+    double seconds = parse + access + dump;
+    double replayed = double(messages.size()) * passes;
+    std::cout << messages.size() << " messages, " << bytes / 1e6 << " MB, " 
+              << passes << " passes, " << errors / std::max(passes, 1u) 
+              << " invalid" << std::endl;
+    std::cout << "throughput: " << replayed / seconds << " messages/s, " 
+              << bytes * double(passes) / seconds / 1e6 << " MB/s" << std::endl;
+    std::cout << "time: parse " << parse << " s, access " << access 
+              << " s, dump " << dump << " s" << std::endl;
+    std::cout << "pointers found: " << found / std::max(replayed, 1.) 
+              << " per message" << (out_bytes ? "" : " ") << std::endl;
+    std::cout << "allocations: " << allocations / std::max(replayed, 1.) 
+              << " per message, peak heap " 
+              << (g_peak_heap_bytes - heap_base) / 1e6 << " MB, peak RSS " 
+              << PeakResidentMb() << " MB" << std::endl;
+    return 0;
+}
+
+
+// Log-linear latency histogram in the style of HdrHistogram: values are 
+// grouped by power of two and each group is split into 2^kSubBits linear 
+// buckets, so a value is kept to within 1/2^kSubBits of its magnitude.
+class LatencyHistogram
+{
+public:
+    void Record(uint64_t ns)
+    {
+        size_t index = Index(ns);
+        if (index >= counts_.size()) counts_.resize(index + 1);
+        ++counts_[index];
+        ++count_;
+        max_ = std::max(max_, ns);
+    }
+
+    // The value below which `percent` of the recorded values fall.
+    uint64_t Percentile(double percent) const
+    {
+        uint64_t rank = std::max<uint64_t>(1, std::ceil(percent / 100 * count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(UpperBound(i), max_);
+        }
+        return max_;
+    }
+
+    uint64_t Count() const { return count_; }
+    uint64_t Max() const { return max_; }
+private:
+    static constexpr int kSubBits = 7;
+
+    static size_t Index(uint64_t value)
+    {
+        if (value < (1u << kSubBits)) return value;
+        int shift = 63 - __builtin_clzll(value) - kSubBits;
+        return (static_cast<size_t>(shift + 1) << kSubBits) + 
+               (value >> shift) - (1u << kSubBits);
+    }
+
+    static uint64_t UpperBound(size_t index)
+    {
+        if (index < (1u << kSubBits)) return index;
+        int shift = static_cast<int>(index >> kSubBits) - 1;
+        uint64_t sub = index & ((1u << kSubBits) - 1);
+        return (((1u << kSubBits) + sub) << shift) + (uint64_t(1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t max_ = 0;
+};
+
+
+// Feeds a stream of messages through parse, mutate, dump and destroy, 
+// timing each operation on its own. One message in 64 is a batch of 256 
+// records. Mutation stores the message in a session table of bounded size, 
+// so old sessions are destroyed as new ones arrive.
+int BenchLatency(int argc, char **argv)
+{
+    size_t messages = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 200000;
+    std::string log = GenerateLog(4 << 20);
+    std::vector<std::string> records;
+    for (size_t begin = 0, end; (end = log.find('\n', begin)) != std::string::npos; 
+         begin = end + 1) {
+        records.push_back(log.substr(begin, end - begin));
+    }
+    std::vector<std::string> batches;
+    for (size_t i = 0; i + 256 <= records.size(); i += 256) {
+        std::string batch = "[";
+        for (size_t j = i; j < i + 256; ++j) batch += (j > i ? "," : "") + records[j];
+        batches.push_back(batch + "]");
+    }
+
+    const char *names[] = {"parse", "mutate", "dump", "destroy"};
+    LatencyHistogram histograms[4];
+    auto timed = [&](int operation, const std::function<void()> &work) {
+        auto start = Clock::now();
+        work();
+        histograms[operation].Record(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(Clock::now() - start).count());
+    };
+
+    Json sessions(JsonValueType::Object);
+    const size_t max_sessions = 10000;
+    std::string out;
+    for (size_t i = 0; i < messages; ++i) {
+        const std::string &text = i % 64 == 63 ? batches[i / 64 % batches.size()] : 
+                                                 records[i % records.size()];
+        Json message;
+        timed(0, [&]() { message = Json::Parse(text.data(), text.size()); });
+        timed(1, [&]() {
+            Json &record = message.IsArray() ? message[0] : message;
+            record[L"status"] = 200.;
+            record[L"user"][L"roles"].GetArrayRef().push_back(Json(L"admin"));
+            record.GetObjectRef().erase(L"message");
+            sessions[SessionKey(i % (2 * max_sessions))] = message;
+            if (sessions.size() > max_sessions) {
+                sessions.GetObjectRef().erase(sessions.GetObjectRef().begin());
+            }
+        });
+        timed(2, [&]() {
+            out.clear();
+            message.Dump(out);
+        });
+        // Sessions may still share the message; destroy one that is unshared.
+        Json copy = Json::Parse(text.data(), text.size());
+        timed(3, [&]() { copy = Json(); });
+    }
+
+    std::cout << std::fixed << std::setprecision(2) 
+              << "operation      p50 us     p99 us   p99.9 us     max us" 
+              << std::endl;
+    for (int i = 0; i < 4; ++i) {
+        const auto &h = histograms[i];
+        std::cout << std::left << std::setw(8) << names[i] << std::right;
+        for (double percent: {50., 99., 99.9}) {
+            std::cout << std::setw(11) << h.Percentile(percent) / 1e3;
+        }
+        std::cout << std::setw(11) << h.Max() / 1e3 << std::endl;
+    }
+    return 0;
+}
+
+
+struct AdversarialCase
+{
+    const char *name;
+    // Generates the input at a given scale; inputs grow linearly with it.
+    std::function<string_type(size_t)> generate;
+    size_t scale;
+};
+
+
+string_type Repeat(const string_type &text, size_t count)
+{
+    string_type out;
+    out.reserve(text.size() * count);
+    for (size_t i = 0; i < count; ++i) out += text;
+    return out;
+}
+
+
+// Parse `text` (and read every string, so escapes are decoded) until 20 ms 
+// have passed. Returns the best time per parse and the peak heap growth.
+std::pair<double, size_t> MeasureParse(const string_type &text)
+{
+    auto parse = [&]() {
+        try {
+            Json json = Json::Parse(text);
+            for (const Json *value: Select(json, L"$..*")) {
+                if (value->IsString()) value->GetStringRef();
+            }
+        } catch (ParseError &) {
+        }
+    };
+    g_peak_heap_bytes = g_heap_bytes.load();
+    size_t base = g_heap_bytes;
+    parse();
+    size_t peak = g_peak_heap_bytes - base;
+    double best = 1e9;
+    for (int trial = 0; trial < 3; ++trial) {
+        size_t runs = 0;
+        auto start = Clock::now();
+        do {
+            parse();
+            ++runs;
+        } while (SecondsSince(start) < 0.02);
+        best = std::min(best, SecondsSince(start) / runs);
+    }
+    return {best, peak};
+}
+
+
+// Inputs that trigger superlinear behaviour in naive parsers. Each one is 
+// parsed at `scale` and at 4 * `scale` (times the given factor); quadratic 
+// work would grow 16 times, linear work 4 times.
+int BenchAdversarial(int argc, char **argv)
+{
+    size_t factor = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1;
+#ifdef __GLIBC__
+    // glibc raises its mmap and trim thresholds as large blocks are freed, 
+    // so the input parsed first decides whether the other one gets its 
+    // memory from the OS again, page faults included, on every parse. That 
+    // alone made "escape runs" grow x8 instead of x4. Fixed thresholds keep 
+    // freed blocks in the heap for both sizes.
+    mallopt(M_MMAP_THRESHOLD, 32 << 20);
+    mallopt(M_TRIM_THRESHOLD, 1 << 30);
+#endif
+    std::vector<AdversarialCase> cases = {
+        // Nesting is capped by kMaxParseDepth, so these stay at or below it.
+        {"deep nesting", [](size_t n) {
+            return string_type(n, L'[') + string_type(n, L']');
+        }, kMaxParseDepth / 4},
+        {"error at depth", [](size_t n) {
+            // Text after the error is never parsed, only copied into errors.
+            return string_type(n, L'[') + L"tru" + string_type(64 * n, L' ');
+        }, kMaxParseDepth / 4},
+        {"too deep", [](size_t n) { return string_type(n, L'['); }, 20000},
+        {"escape runs", [](size_t n) {
+            return L"[\"" + Repeat(L"\\n\\u00e9\\\"", n) + L"\"]";
+        }, 5000},
+        {"long numbers", [](size_t n) {
+            return L"[" + Repeat(L"9", n) + L".5e1, -" + Repeat(L"1", n) + L"]";
+        }, 20000},
+        {"tiny keys", [](size_t n) {
+            string_type text = L"{";
+            for (size_t i = 0; i < n; ++i) {
+                std::wstring key = std::to_wstring(i);
+                text += i ? L",\"" : L"\"";
+                text.append(key.begin(), key.end());
+                text += L"\":0";
+            }
+            return text + L"}";
+        }, 10000},
+        {"literals", [](size_t n) {
+            return L"[" + Repeat(L"false,true,null,", n) + L"fals]";
+        }, 10000},
+        {"unterminated string", [](size_t n) {
+            return L"[[{\"a\": \"" + Repeat(L"x", n);
+        }, 100000},
+        {"malformed tail", [](size_t n) {
+            return L"[[" + Repeat(L"{\"a\": [1, \"b\", {\"c\": null}]}, ", n) + 
+                   L"{\"a\": [1, }]]";
+        }, 5000},
+    };
+
+    bool ok = true;
+    for (const auto &c: cases) {
+        size_t n = c.scale * factor;
+        string_type small = c.generate(n), large = c.generate(4 * n);
+        auto a = MeasureParse(small), b = MeasureParse(large);
+        double time_ratio = b.first / a.first;
+        double memory_ratio = a.second ? double(b.second) / a.second : 1;
+        // Quadratic work would grow 16 times; the bound leaves room for the 
+        // slowdown of inputs that outgrow the caches.
+        bool linear = time_ratio < 10 && memory_ratio < 10;
+        ok = ok && linear;
+        std::cout << c.name << ": " << small.size() << " -> " << large.size() 
+                  << " chars, time " << a.first * 1e3 << " -> " 
+                  << b.first * 1e3 << " ms (x" << time_ratio << "), heap " 
+                  << a.second / 1024 << " -> " << b.second / 1024 << " KB (x" 
+                  << memory_ratio << ")" << (linear ? "" : "  NOT LINEAR") 
+                  << std::endl;
+    }
+    return ok ? 0 : 1;
+}
+
+
+int BenchKeys(int argc, char **argv)
+{
+    size_t members = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 10000;
+    size_t lookups = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+    std::vector<string_type> keys;
+    for (size_t i = 0; i < members; ++i) {
+        std::wstring suffix = std::to_wstring(i * 7919 % members);
+        string_type key = L"metrics.service.frontend.latency.histogram.p99.";
+        key.append(suffix.begin(), suffix.end());
+        keys.push_back(std::move(key));
+    }
+    Json json(JsonValueType::Object);
+    auto start = Clock::now();
+    for (const auto &key: keys) json[key] = 1.;
+    double insert = SecondsSince(start);
+
+    std::mt19937 random(1);
+    std::vector<size_t> order(lookups);
+    for (auto &i: order) i = random() % members;
+    double sum = 0;
+    start = Clock::now();
+    for (size_t i: order) sum += json.Find(keys[i])->ToDouble();
+    double find = SecondsSince(start);
+    start = Clock::now();
+    for (size_t i: order) sum += json[keys[i]].ToDouble();
+    double index = SecondsSince(start);
+    std::cout << "insert " << insert * 1e9 / members << " ns/key, Find " 
+              << find * 1e9 / lookups << " ns, operator[] " 
+              << index * 1e9 / lookups << " ns" << (sum ? "" : " ") << std::endl;
+    return 0;
+}
+
+
+// Shuffle the records of `json` so that walking them in order visits nodes 
+// scattered over the heap, as after sorting or editing a large document.
+void ShuffleRecords(Json &json, unsigned seed)
+{
+    auto &elements = json.GetArrayRef();
+    std::shuffle(elements.begin(), elements.end(), std::mt19937(seed));
+}
+
+
+int BenchPrefetch(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 64;
+    unsigned passes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 3;
+    std::string text = GenerateArray(size_mb << 20);
+    Json json = Json::Parse(text.data(), text.size());
+    Json other = Json::Parse(text.data(), text.size());
+    ShuffleRecords(json, 1);
+    ShuffleRecords(other, 1);
+
+    for (size_t distance: {0, 1, 2, 4, 8, 16}) {
+        SetPrefetchDistance(distance);
+        double dump = 0, compare = 0, select = 0;
+        size_t sink = 0;
+        for (unsigned pass = 0; pass < passes; ++pass) {
+            auto start = Clock::now();
+            sink += json.Dump().size();
+            dump += SecondsSince(start);
+            start = Clock::now();
+            sink += json == other;
+            compare += SecondsSince(start);
+            start = Clock::now();
+            sink += Select(json, L"$..status").size();
+            select += SecondsSince(start);
+        }
+        std::cout << "distance=" << distance << ": dump " << dump / passes 
+                  << " s, compare " << compare / passes << " s, select " 
+                  << select / passes << " s" << (sink ? "" : " ") << std::endl;
+    }
+    return 0;
+}
+
+
+int BenchScaling(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    unsigned max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    std::string log = GenerateLog(size_mb << 20);
+    std::string text = GenerateArray(size_mb << 20);
+    Json records = Json::Parse(text.data(), text.size());
+    GroupByQuery query;
+    query.group_by = {L"service"};
+    query.fields = {{L"latency", L"p99"}, {L"status"}};
+
+    std::cout << "hardware threads: " << std::thread::hardware_concurrency() 
+              << std::endl;
+    double sort_base = 0, groupby_base = 0;
+    for (unsigned n = 1; n <= max_threads; n *= 2) {
+        ThreadPool pool(n);
+        Executor *previous = SetExecutor(&pool);
+
+        // A new array of the same elements, so every run sorts the original order.
+        Json copy(JsonValueType::Array);
+        copy.GetArrayRef() = records.GetArrayRef();
+        auto start = Clock::now();
+        copy.SortBy({L"latency", L"p99"});
+        double sort_seconds = SecondsSince(start);
+
+        start = Clock::now();
+        GroupBy(log.data(), log.size(), query);
+        double groupby_seconds = SecondsSince(start);
+        SetExecutor(previous);
+
+        if (n == 1) {
+            sort_base = sort_seconds;
+            groupby_base = groupby_seconds;
+        }
+        std::cout << "threads=" << n << ": sort " << sort_seconds << " s (" 
+                  << sort_base / sort_seconds << "x), groupby " 
+                  << groupby_seconds << " s (" << groupby_base / groupby_seconds 
+                  << "x)" << std::endl;
+    }
+    return 0;
+}
+
+
+#ifdef FJSON_HAVE_POSIX_IO
+// Sum of every record's "latency.p99" read through the frozen view.
+double SumFrozen(FrozenValue records)
+{
+    double sum = 0;
+    FrozenValue latency = records, p99 = records;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (records[i].Find(L"latency", latency) && latency.Find(L"p99", p99)) {
+            sum += p99.ToDouble();
+        }
+    }
+    return sum;
+}
+
+
+double SumParsed(const Json &records)
+{
+    double sum = 0;
+    for (const auto &record: records.GetArrayRef()) {
+        const Json *p99 = record.Find(key_path_type{L"latency", L"p99"});
+        if (p99 && p99->IsNumber()) sum += p99->ToDouble();
+    }
+    return sum;
+}
+
+
+// Private (non-shared) resident memory of this process in MB, or 0 where
+// /proc is not available.
+double PrivateResidentMb()
+{
+    unsigned long size = 0, resident = 0, shared = 0;
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    if (std::fscanf(statm, "%lu %lu %lu", &size, &resident, &shared) != 3) {
+        resident = shared = 0;
+    }
+    std::fclose(statm);
+    return (resident - shared) * double(sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+
+// Fork `processes` children running `work`, which returns whether it got the
+// right answer; report wall time and the most private memory a child added.
+template <typename Work>
+void RunForked(const char *label, unsigned processes, Work work)
+{
+    int fds[2];
+    if (pipe(fds) != 0) return;
+    auto start = Clock::now();
+    for (unsigned i = 0; i < processes; ++i) {
+        if (fork() == 0) {
+            close(fds[0]);
+            double before = PrivateResidentMb();
+            double added = work() ? PrivateResidentMb() - before : -1;
+            ssize_t n = write(fds[1], &added, sizeof(added));
+            _exit(n == sizeof(added) ? 0 : 1);
+        }
+    }
+    close(fds[1]);
+    double most = 0;
+    bool failed = false;
+    for (unsigned i = 0; i < processes; ++i) {
+        double added = -1;
+        if (read(fds[0], &added, sizeof(added)) != sizeof(added) || added < 0) {
+            failed = true;
+        }
+        most = std::max(most, added);
+    }
+    close(fds[0]);
+    while (wait(nullptr) > 0) {}
+    std::cout << label << ": " << SecondsSince(start) << " s, " 
+              << most << " MB private per process" 
+              << (failed ? " (child failed!)" : "") << std::endl;
+}
+
+
+int BenchShared(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    unsigned processes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    std::string text = GenerateArray(size_mb << 20);
+    Json json = Json::Parse(text.data(), text.size());
+    double expected = SumParsed(json);
+
+    std::string name = "/fjson-bench-" + std::to_string(getpid());
+    auto start = Clock::now();
+    SharedDocument document = SharedDocument::Create(name, json);
+    std::cout << "frozen image: " << document.size() / double(1 << 20) 
+              << " MB, built in " << SecondsSince(start) << " s" << std::endl;
+    json = Json();
+
+    // Every child parses the text itself, as independent processes would.
+    RunForked("parse per process", processes, [&]() {
+        Json records = Json::Parse(text.data(), text.size());
+        return SumParsed(records) == expected;
+    });
+    RunForked("shared document ", processes, [&]() {
+        SharedDocument opened = SharedDocument::Open(name);
+        return SumFrozen(opened.Root()) == expected;
+    });
+    SharedDocument::Unlink(name);
+    return 0;
+}
+#endif
+
+
+#ifdef FJSON_USE_PMR
+// Parse and destroy the document with nodes allocated from `resource`.
+void ParseWith(const char *label, const std::string &text, 
+               std::pmr::memory_resource *resource)
+{
+    double mb = text.size() / double(1 << 20);
+    auto start = Clock::now();
+    Json json;
+    {
+        MemoryResourceScope scope(resource);
+        json = Json::Parse(text.data(), text.size());
+    }
+    double parse_seconds = SecondsSince(start);
+    size_t records = json.size();
+    start = Clock::now();
+    json = Json();
+    std::cout << label << ": parse " << parse_seconds << " s (" 
+              << mb / parse_seconds << " MB/s), destroy " << SecondsSince(start) 
+              << " s, " << records << " records" << std::endl;
+}
+
+
+int BenchPmr(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    std::string text = GenerateArray(size_mb << 20);
+    ParseWith("new_delete          ", text, std::pmr::new_delete_resource());
+    {
+        std::pmr::unsynchronized_pool_resource pool;
+        ParseWith("unsynchronized_pool ", text, &pool);
+    }
+    {
+        std::pmr::synchronized_pool_resource pool;
+        ParseWith("synchronized_pool   ", text, &pool);
+    }
+    auto start = Clock::now();
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        ParseWith("monotonic_buffer    ", text, &arena);
+    }
+    std::cout << "  (monotonic release with destroy: " << SecondsSince(start) 
+              << " s total)" << std::endl;
+    return 0;
+}
+
+
+// Visit every value, touching numbers and string lengths.
+double Traverse(const Json &json)
+{
+    switch (json.GetType()) {
+    case JsonValueType::Number:
+        return json.ToDouble();
+    case JsonValueType::String:
+        return json.GetStringRef().size();
+    case JsonValueType::Array: {
+        double sum = 0;
+        for (const auto &element: json.GetArrayRef()) sum += Traverse(element);
+        return sum;
+    }
+    case JsonValueType::Object: {
+        double sum = 0;
+        for (const auto &member: json.GetObjectRef()) {
+            sum += member.first.size() + Traverse(member.second);
+        }
+        return sum;
+    }
+    default:
+        return 1;
+    }
+}
+
+
+// AnonHugePages of this process in MB, or -1 where it cannot be read.
+double AnonHugePagesMb()
+{
+    FILE *rollup = std::fopen("/proc/self/smaps_rollup", "r");
+    if (!rollup) return -1;
+    char line[256];
+    double mb = -1;
+    while (std::fgets(line, sizeof(line), rollup)) {
+        unsigned long kb;
+        if (std::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) mb = kb / 1024.;
+    }
+    std::fclose(rollup);
+    return mb;
+}
+
+
+void TraverseWith(const char *label, const std::string &text, unsigned passes, 
+                  std::pmr::memory_resource *resource)
+{
+    Json json;
+    {
+        MemoryResourceScope scope(resource);
+        json = Json::Parse(text.data(), text.size());
+    }
+    // Decode lazily decoded strings before timing.
+    double expected = Traverse(json);
+    auto start = Clock::now();
+    for (unsigned i = 0; i < passes; ++i) {
+        if (Traverse(json) != expected) std::cout << "mismatch!" << std::endl;
+    }
+    double seconds = SecondsSince(start) / passes;
+    std::cout << label << ": " << seconds * 1000 << " ms per pass, " 
+              << "AnonHugePages " << AnonHugePagesMb() << " MB" << std::endl;
+}
+
+
+int BenchTraverse(int argc, char **argv)
+{
+    size_t size_mb = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 64;
+    unsigned passes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 5;
+    std::string text = GenerateArray(size_mb << 20);
+    TraverseWith("new_delete     ", text, passes, std::pmr::new_delete_resource());
+    {
+        HugePageArena arena(16 * kHugePageSize, false);
+        TraverseWith("arena 4K pages ", text, passes, &arena);
+    }
+    {
+        HugePageArena arena(16 * kHugePageSize, true);
+        TraverseWith("arena 2M pages ", text, passes, &arena);
+    }
+    return 0;
+}
+#endif
+
+
+int Usage()
+{
+    std::cerr << "usage: bench_json <mode> [arguments]\n"
+              << "  groupby [size_mb] [threads]\n"
+              << "  validate [size_mb]\n"
+              << "  incremental [records] [updates]\n"
+              << "  transaction [records] [changes]\n"
+              << "  mvcc [readers] [versions]\n"
+              << "  reparse [size_mb] [edits]\n"
+              << "  trace [size_mb] [out.json]\n"
+              << "  perfgate <baseline> [--update]\n"
+              << "  replay <file> [ndjson|length-prefixed] [passes] [pointer...]\n"
+              << "  latency [messages]\n"
+              << "  adversarial [scale]\n"
+              << "  keys [members] [lookups]\n"
+              << "  prefetch [size_mb] [passes]\n"
+              << "  scaling [size_mb] [max_threads]\n"
+              << "  shared [size_mb] [processes]\n"
+              << "  pmr [size_mb]\n"
+              << "  traverse [size_mb] [passes]\n";
+    return 2;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) return Usage();
+    std::string mode = argv[1];
+    if (mode == "groupby") return BenchGroupBy(argc - 2, argv + 2);
+    if (mode == "validate") return BenchValidate(argc - 2, argv + 2);
+    if (mode == "incremental") return BenchIncremental(argc - 2, argv + 2);
+    if (mode == "transaction") return BenchTransaction(argc - 2, argv + 2);
+    if (mode == "mvcc") return BenchMvcc(argc - 2, argv + 2);
+    if (mode == "reparse") return BenchReparse(argc - 2, argv + 2);
+    if (mode == "trace") return BenchTrace(argc - 2, argv + 2);
+    if (mode == "perfgate") return BenchPerfGate(argc - 2, argv + 2);
+    if (mode == "replay") return BenchReplay(argc - 2, argv + 2);
+    if (mode == "latency") return BenchLatency(argc - 2, argv + 2);
+    if (mode == "adversarial") return BenchAdversarial(argc - 2, argv + 2);
+    if (mode == "keys") return BenchKeys(argc - 2, argv + 2);
+    if (mode == "prefetch") return BenchPrefetch(argc - 2, argv + 2);
+    if (mode == "scaling") return BenchScaling(argc - 2, argv + 2);
+#ifdef FJSON_HAVE_POSIX_IO
+    if (mode == "shared") return BenchShared(argc - 2, argv + 2);
+#endif
+#ifdef FJSON_USE_PMR
+    if (mode == "pmr") return BenchPmr(argc - 2, argv + 2);
+    if (mode == "traverse") return BenchTraverse(argc - 2, argv + 2);
+#endif
+    return Usage();
+}
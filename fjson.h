@@ -8,11 +8,77 @@
 #include <locale>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
 #include <exception>
 #include <initializer_list>
 #include <memory>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <sstream>
+#include <cstring>
+#include <cwchar>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#ifdef FJSON_USE_PMR
+#include <memory_resource>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef FJSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FJSON_HAVE_POSIX_IO 1
+#endif
+
+// Hint that `address` will be read soon. Traversals use it to fetch the 
+// nodes of upcoming children while the current one is processed. 
+#if defined(__GNUC__) || defined(__clang__)
+#define FJSON_PREFETCH(address) __builtin_prefetch((address), 0, 3)
+#else
+#define FJSON_PREFETCH(address) ((void)(address))
+#endif
+
+// Trace points around parse phases, array growth, number conversion and 
+// serialization. They compile to nothing unless FJSON_TRACE is defined, and 
+// then record into the collector installed with SetTraceCollector(), if any. 
+#ifdef FJSON_TRACE
+#define FJSON_TRACE_ENABLED 1
+#define FJSON_TRACE_CONCAT_(a, b) a##b
+#define FJSON_TRACE_CONCAT(a, b) FJSON_TRACE_CONCAT_(a, b)
+// Time the rest of the enclosing block as one event.
+#define FJSON_TRACE_SCOPE(name) \
+        ::fjson::_TraceScope FJSON_TRACE_CONCAT(_fjson_trace_, __LINE__)(name)
+// A point event carrying one value.
+#define FJSON_TRACE_INSTANT(name, value) ::fjson::_TraceInstant((name), (value))
+#else
+#define FJSON_TRACE_ENABLED 0
+#define FJSON_TRACE_SCOPE(name) ((void)0)
+#define FJSON_TRACE_INSTANT(name, value) ((void)0)
+#endif
 
 namespace fjson {
 
@@ -38,8 +104,31 @@ const char *ValueTypeStrs[] = {
     "InvalidValue"
 };
 
+#ifdef FJSON_USE_PMR
+// Strings, arrays and objects allocate through std::pmr memory resources; 
+// see MemoryResourceScope.
+using string_type = std::pmr::wstring;
+#else
 using string_type = std::wstring;
+#endif
 using charT = string_type::value_type;
+using key_path_type = std::vector<string_type>;
+
+// Conversions for standard functions that only take std::wstring (stod, 
+// wostringstream); free when string_type is std::wstring.
+#ifdef FJSON_USE_PMR
+inline std::wstring _ToStdString(const string_type &str)
+{
+    return std::wstring(str.begin(), str.end());
+}
+inline string_type _FromStdString(const std::wstring &str)
+{
+    return string_type(str.begin(), str.end());
+}
+#else
+inline const std::wstring& _ToStdString(const string_type &str) { return str; }
+inline std::wstring _FromStdString(std::wstring &&str) { return std::move(str); }
+#endif
 
 inline const char* ValueTypeToStr(JsonValueType type)
 {
@@ -98,1025 +187,5536 @@ public:
     {}
     string_type::difference_type GetOffset() const { return offset_; }
     const string_type& GetProcessedString() const { return processed_string_; }
+    // 1-based location in the document; 0 when not known (errors thrown by 
+    // the internal parse functions carry only an offset).
+    size_t GetLine() const { return line_; }
+    size_t GetColumn() const { return column_; }
+    void SetLocation(size_t line, size_t column)
+    {
+        line_ = line;
+        column_ = column;
+    }
 private:
     string_type::difference_type offset_;
     string_type processed_string_;
+    size_t line_ = 0;
+    size_t column_ = 0;
 };
 
 
 class Json;
+class SourceMap;
 
-class JsonValue
+
+// Collects the events of the FJSON_TRACE_* trace points and writes them in 
+// the Chrome trace-event format, which chrome://tracing and Perfetto load. 
+// Times are relative to the construction of the collector.
+class TraceCollector
 {
 public:
-    using array_container_type = std::vector<Json>;
-    using object_container_type = std::map<string_type, Json>;
-    using size_type = array_container_type::size_type;
+    using Clock = std::chrono::steady_clock;
 
-    // static JsonValue* parseFile(std::string filename);
-    JsonValue(JsonValueType type): type_(type) {}
+    TraceCollector(): start_(Clock::now()) {}
 
-    virtual ~JsonValue() {}
-    JsonValueType GetType() const { return type_; }
-    bool IsNumber() const { return type_ == JsonValueType::Number; }
-    bool IsNull() const { return type_ == JsonValueType::Null; }
-    bool IsTrue() const { return type_ == JsonValueType::True; }
-    bool IsFalse() const { return type_ == JsonValueType::False; }
-    bool IsString() const { return type_ == JsonValueType::String; }
-    bool IsArray() const { return type_ == JsonValueType::Array; }
-    bool IsObject() const { return type_ == JsonValueType::Object; }
-    bool IsValid() const { return type_ != JsonValueType::InvalidValue; }
-    
+    void Complete(const char *name, Clock::time_point begin, Clock::time_point end)
+    {
+        Add(Event{name, 'X', Nanoseconds(begin), (end - begin).count(), 0});
+    }
+
+    void Instant(const char *name, double value)
+    {
+        Add(Event{name, 'i', Nanoseconds(Clock::now()), 0, value});
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return events_.size();
+    }
+
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.clear();
+    }
+
+    // Event names are trace point literals and need no escaping.
+    void Write(std::string &out) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char buffer[64];
+        out += "{\"traceEvents\":[";
+        for (size_t i = 0; i < events_.size(); ++i) {
+            const Event &event = events_[i];
+            if (i) out += ",\n";
+            out += "{\"name\":\"";
+            out += event.name;
+            out += "\",\"ph\":\"";
+            out.push_back(event.phase);
+            std::snprintf(buffer, sizeof(buffer), "\",\"ts\":%.3f", event.ts / 1e3);
+            out += buffer;
+            if (event.phase == 'X') {
+                std::snprintf(buffer, sizeof(buffer), ",\"dur\":%.3f", 
+                              event.duration / 1e3);
+            } else {
+                std::snprintf(buffer, sizeof(buffer), 
+                              ",\"s\":\"t\",\"args\":{\"value\":%.17g}", 
+                              event.value);
+            }
+            out += buffer;
+            std::snprintf(buffer, sizeof(buffer), ",\"pid\":1,\"tid\":%d}", 
+                          event.thread);
+            out += buffer;
+        }
+        out += "]}\n";
+    }
 private:
-    JsonValueType type_;
+    struct Event
+    {
+        const char *name;
+        char phase;
+        int64_t ts;
+        int64_t duration;
+        double value;
+        int thread = ThreadNumber();
+    };
+
+    // Small per-thread numbers read better in trace viewers than thread ids.
+    static int ThreadNumber()
+    {
+        static std::atomic<int> next{0};
+        thread_local int number = ++next;
+        return number;
+    }
+
+    int64_t Nanoseconds(Clock::time_point time) const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                time - start_).count();
+    }
+
+    void Add(const Event &event)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.push_back(event);
+    }
+
+    Clock::time_point start_;
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
 };
 
-class JsonNull: public JsonValue
+
+inline std::atomic<TraceCollector*>& _InstalledTraceCollector()
+{
+    static std::atomic<TraceCollector*> collector{nullptr};
+    return collector;
+}
+
+
+inline TraceCollector* GetTraceCollector()
+{
+    return _InstalledTraceCollector().load(std::memory_order_acquire);
+}
+
+
+// Install the collector for trace points (nullptr stops collecting) and 
+// return the previous one. Only builds with FJSON_TRACE have trace points. 
+// A scope records into the collector installed when it was entered, so a 
+// collector must outlive every trace scope in flight, not just its 
+// installation: after replacing it, let operations running on other 
+// threads finish before destroying it.
+inline TraceCollector* SetTraceCollector(TraceCollector *collector)
+{
+    return _InstalledTraceCollector().exchange(collector);
+}
+
+
+class _TraceScope
 {
 public:
-    JsonNull(): JsonValue(JsonValueType::Null) {}
-    ~JsonNull() {}
+    explicit _TraceScope(const char *name): 
+            name_(name), collector_(GetTraceCollector())
+    {
+        if (collector_) begin_ = TraceCollector::Clock::now();
+    }
+    ~_TraceScope()
+    {
+        if (collector_) collector_->Complete(name_, begin_, TraceCollector::Clock::now());
+    }
+    _TraceScope(const _TraceScope&) = delete;
+    _TraceScope& operator= (const _TraceScope&) = delete;
+private:
+    const char *name_;
+    TraceCollector *collector_;
+    TraceCollector::Clock::time_point begin_;
 };
 
-class JsonNumber: public JsonValue
+
+inline void _TraceInstant(const char *name, double value)
+{
+    if (TraceCollector *collector = GetTraceCollector()) {
+        collector->Instant(name, value);
+    }
+}
+
+
+// Size of the chunks read from an InputSource.
+constexpr size_t kInputChunkSize = 1 << 16;
+
+
+// A source of UTF-8 input bytes for the streaming parse functions.
+class InputSource
 {
 public:
-    JsonNumber(): JsonValue(JsonValueType::Number), value_(0.) {}
-    JsonNumber(double value): JsonValue(JsonValueType::Number), value_(value) {}
-    double ToDouble() const
+    virtual ~InputSource() {}
+    // Read up to `size` bytes into `buffer`. Returns 0 only at end of input.
+    virtual size_t Read(char *buffer, size_t size) = 0;
+};
+
+
+class IstreamSource: public InputSource
+{
+public:
+    IstreamSource(std::istream &stream): stream_(stream) {}
+    size_t Read(char *buffer, size_t size) override
     {
-        return value_;
+        stream_.read(buffer, size);
+        if (stream_.bad()) throw JsonError("error reading input stream");
+        return static_cast<size_t>(stream_.gcount());
     }
 private:
-    double value_;
+    std::istream &stream_;
 };
 
-class JsonTrue: public JsonValue
+
+// Reads from a buffer in memory, e.g. a mapped file. The buffer must 
+// outlive the source.
+class MemorySource: public InputSource
 {
 public:
-    JsonTrue(): JsonValue(JsonValueType::True) {}
-    ~JsonTrue() {}
-    operator bool() const { return true; }
+    MemorySource(const char *data, size_t size): data_(data), size_(size) {}
+    size_t Read(char *buffer, size_t size) override
+    {
+        size_t n = std::min(size, size_ - offset_);
+        std::memcpy(buffer, data_ + offset_, n);
+        offset_ += n;
+        return n;
+    }
+private:
+    const char *data_;
+    size_t size_;
+    size_t offset_ = 0;
 };
 
-class JsonFalse: public JsonValue
+
+#ifdef FJSON_HAVE_POSIX_IO
+// Reads from a file descriptor (file, pipe, socket). The descriptor is not 
+// closed.
+class FdSource: public InputSource
 {
 public:
-    JsonFalse(): JsonValue(JsonValueType::False) {}
-    ~JsonFalse() {}
-    operator bool() const { return false; }
+    FdSource(int fd): fd_(fd) {}
+    size_t Read(char *buffer, size_t size) override
+    {
+        while (true) {
+            ssize_t n = ::read(fd_, buffer, size);
+            if (n >= 0) return static_cast<size_t>(n);
+            if (errno != EINTR) {
+                throw JsonError(std::string("error reading file descriptor: ") + 
+                                std::strerror(errno));
+            }
+        }
+    }
+private:
+    int fd_;
 };
+#endif
 
-class JsonString: public JsonValue, public string_type
+
+#ifdef FJSON_HAVE_ZLIB
+// True if the data starts with the gzip magic bytes.
+inline bool IsGzip(const char *data, size_t size)
+{
+    return size >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && 
+           static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+
+// Decompresses gzip or zlib data read from another source. Concatenated 
+// gzip members (as produced by appending to a .gz log) are read in turn.
+//
+// By default decompression runs on a background thread that fills a small 
+// queue of blocks, so inflating the next block overlaps with parsing the 
+// current one; the queue bounds the memory in flight. With `background` 
+// false, data is inflated on the calling thread directly into the buffer 
+// passed to Read().
+//
+// The background thread reads the wrapped source ahead of the consumer, 
+// and the destructor waits for it. A Read() that blocks on the wrapped 
+// source (e.g. an FdSource on an idle pipe or socket) therefore blocks 
+// the destructor too: before destroying a background GzipSource whose 
+// input has not reached its end, make the wrapped source return, e.g. by 
+// closing the write end of the pipe or shutting down the socket. Without 
+// a background thread, nothing is read after the last Read() call.
+class GzipSource: public InputSource
 {
 public:
-    JsonString(const string_type &str):
-            JsonValue(JsonValueType::String), string_type(str) {}
-    JsonString(string_type &&str): 
-            JsonValue(JsonValueType::String), string_type(std::move(str)) {}
-    string_type ToString() const
+    GzipSource(const GzipSource&) = delete;
+    GzipSource& operator= (const GzipSource&) = delete;
+    explicit GzipSource(InputSource &compressed, bool background = true, 
+                        size_t block_size = 1 << 18, size_t max_blocks = 4):
+            compressed_(compressed), input_(kInputChunkSize), 
+            block_size_(block_size), max_blocks_(max_blocks)
+    {
+        std::memset(&stream_, 0, sizeof(stream_));
+        // 15 window bits, +32 to detect gzip or zlib headers automatically.
+        if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+            throw JsonError("cannot initialize zlib");
+        }
+        if (background) {
+            thread_ = std::thread([this]() { DecompressBlocks(); });
+        }
+    }
+
+    // Stops the background thread, waiting for a Read() of the wrapped 
+    // source in progress to return (see above).
+    ~GzipSource()
     {
-        return string_type(this->c_str());
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopped_ = true;
+            }
+            not_full_.notify_all();
+            thread_.join();
+        }
+        inflateEnd(&stream_);
     }
-    const string_type& GetStringRef() const
+
+    size_t Read(char *buffer, size_t size) override
     {
-        return *this;
+        if (!thread_.joinable()) return Inflate(buffer, size);
+        if (block_offset_ == block_.size()) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [this]() { return !blocks_.empty() || done_; });
+            if (blocks_.empty()) {
+                if (error_) std::rethrow_exception(error_);
+                return 0;
+            }
+            block_.swap(blocks_.front());
+            blocks_.pop_front();
+            block_offset_ = 0;
+            not_full_.notify_one();
+        }
+        size_t n = std::min(size, block_.size() - block_offset_);
+        std::memcpy(buffer, block_.data() + block_offset_, n);
+        block_offset_ += n;
+        return n;
     }
-    string_type& GetStringRef()
+
+private:
+    // Inflate up to `size` bytes into `buffer`. Returns 0 at end of input.
+    size_t Inflate(char *buffer, size_t size)
     {
-        return *this;
+        stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream_.avail_out = static_cast<uInt>(size);
+        while (stream_.avail_out > 0) {
+            if (stream_.avail_in == 0) {
+                size_t n = compressed_.Read(input_.data(), input_.size());
+                if (n == 0) {
+                    if (!finished_member_) {
+                        throw JsonError("truncated compressed input");
+                    }
+                    break;
+                }
+                stream_.next_in = reinterpret_cast<Bytef*>(input_.data());
+                stream_.avail_in = static_cast<uInt>(n);
+            }
+            finished_member_ = false;
+            int status = inflate(&stream_, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                // Another member may follow.
+                finished_member_ = true;
+                inflateReset(&stream_);
+            } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                throw JsonError(std::string("invalid compressed input: ") + 
+                                (stream_.msg ? stream_.msg : "zlib error"));
+            }
+        }
+        return size - stream_.avail_out;
+    }
+
+    void DecompressBlocks()
+    {
+        try {
+            while (true) {
+                std::string block(block_size_, '\0');
+                size_t n = Inflate(&block[0], block.size());
+                if (n == 0) break;
+                block.resize(n);
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_full_.wait(lock, [this]() {
+                    return blocks_.size() < max_blocks_ || stopped_;
+                });
+                if (stopped_) return;
+                blocks_.push_back(std::move(block));
+                not_empty_.notify_one();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        not_empty_.notify_one();
     }
+
+    InputSource &compressed_;
+    std::vector<char> input_;
+    z_stream stream_;
+    bool finished_member_ = false;
+    size_t block_size_;
+    size_t max_blocks_;
+
+    // Shared with the background thread.
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<std::string> blocks_;
+    std::exception_ptr error_;
+    bool done_ = false;
+    bool stopped_ = false;
+    std::thread thread_;
+
+    // The block being consumed by Read().
+    std::string block_;
+    size_t block_offset_ = 0;
 };
+#endif
+
 
+inline size_t _HashKey(const charT *data, size_t size)
+{
+    return std::hash<std::basic_string_view<charT> >()(
+            std::basic_string_view<charT>(data, size));
+}
 
-class JsonArray: public JsonValue, public std::vector<Json>
+
+// An object key that carries its hash, computed once when the key is 
+// stored. It converts to string_type, so members still read as strings.
+class ObjectKey: public string_type
 {
 public:
-    using container_type = std::vector<Json>;
-    using iterator = container_type::iterator;
-    using const_iterator = container_type::const_iterator;
-    using size_type = container_type::size_type;
-    using difference_type = container_type::difference_type;
+    ObjectKey(const string_type &key): 
+            string_type(key), hash_(_HashKey(data(), size())) {}
+    ObjectKey(string_type &&key): 
+            string_type(std::move(key)), hash_(_HashKey(data(), size())) {}
+    ObjectKey(const charT *key): ObjectKey(string_type(key)) {}
+    ObjectKey(const ObjectKey &) = default;
+    ObjectKey(ObjectKey &&) = default;
+#ifdef FJSON_USE_PMR
+    // Allocator-extended forms, used when a pmr::map constructs its keys.
+    ObjectKey(const ObjectKey &key, const allocator_type &allocator): 
+            string_type(key, allocator), hash_(key.hash_) {}
+    ObjectKey(ObjectKey &&key, const allocator_type &allocator): 
+            string_type(std::move(key), allocator), hash_(key.hash_) {}
+    ObjectKey(const string_type &key, const allocator_type &allocator): 
+            string_type(key, allocator), hash_(_HashKey(data(), size())) {}
+    ObjectKey(string_type &&key, const allocator_type &allocator): 
+            string_type(std::move(key), allocator), 
+            hash_(_HashKey(data(), size())) {}
+#endif
 
-    JsonArray(): JsonValue(JsonValueType::Array) {}
-    JsonArray(const std::initializer_list<Json> &init_list): 
-        JsonValue(JsonValueType::Array), std::vector<Json>(init_list) {}
+    size_t hash() const { return hash_; }
+private:
+    size_t hash_;
 };
 
 
-class JsonObject: public JsonValue, public std::map<string_type, Json>
+// A key to look up, hashed once for the whole search.
+struct _KeyProbe
 {
-public:
-    using container_type = std::map<string_type, Json>;
-    using iterator = container_type::iterator;
-    using const_iterator = container_type::const_iterator;
-    using size_type = container_type::size_type;
-    using difference_type = container_type::difference_type;
+    explicit _KeyProbe(const string_type &key): 
+            data(key.data()), size(key.size()), hash(_HashKey(data, size)) {}
+    explicit _KeyProbe(const ObjectKey &key): 
+            data(key.data()), size(key.size()), hash(key.hash()) {}
 
-    JsonObject(): JsonValue(JsonValueType::Object) {}
+    const charT *data;
+    size_t size;
+    size_t hash;
 };
 
 
-class JsonInvalidValue: public JsonValue
+// Orders keys by (length, hash), and only keys that agree on both are 
+// compared by content with char_traits::compare (wmemcmp). Long keys that 
+// share a prefix are then rarely scanned, but the order is not 
+// lexicographic.
+struct _KeyLess
+{
+    using is_transparent = void;
+
+    template <typename A, typename B>
+    bool operator() (const A &a, const B &b) const
+    {
+        return Less(_KeyProbe(a), _KeyProbe(b));
+    }
+
+    static bool Less(const _KeyProbe &a, const _KeyProbe &b)
+    {
+        if (a.size != b.size) return a.size < b.size;
+        if (a.hash != b.hash) return a.hash < b.hash;
+        return std::char_traits<charT>::compare(a.data, b.data, a.size) < 0;
+    }
+};
+
+
+// With FJSON_HASHED_KEYS objects store ObjectKey ordered by _KeyLess, which 
+// makes lookups cheaper for long keys but iterates (and dumps) members in 
+// an order that is deterministic and not alphabetical. 
+#ifdef FJSON_HASHED_KEYS
+using _ObjectKey = ObjectKey;
+using _ObjectKeyLess = _KeyLess;
+
+inline _KeyProbe _MemberKey(const string_type &key) { return _KeyProbe(key); }
+#else
+using _ObjectKey = string_type;
+using _ObjectKeyLess = std::less<string_type>;
+
+inline const string_type& _MemberKey(const string_type &key) { return key; }
+#endif
+
+
+#ifdef FJSON_USE_PMR
+using _ArrayContainer = std::pmr::vector<Json>;
+using _ObjectContainer = std::pmr::map<_ObjectKey, Json, _ObjectKeyLess>;
+
+
+inline std::pmr::memory_resource*& _CurrentMemoryResource()
+{
+    thread_local std::pmr::memory_resource *resource = 
+            std::pmr::get_default_resource();
+    return resource;
+}
+
+
+// The memory resource that nodes created on this thread allocate from: the 
+// node itself, its container or string, and object keys. Defaults to 
+// std::pmr::get_default_resource().
+inline std::pmr::memory_resource* GetMemoryResource()
+{
+    return _CurrentMemoryResource();
+}
+
+
+// Makes `resource` the memory resource for nodes created on this thread 
+// until the scope ends, e.g. a monotonic_buffer_resource per document:
+//
+//     std::pmr::monotonic_buffer_resource arena;
+//     Json json;
+//     {
+//         MemoryResourceScope scope(&arena);
+//         json = Json::Parse(text);
+//     }
+//
+// The resource must outlive every node allocated from it. Threads started 
+// by the library (parallel sort, GroupBy) use their own default.
+class MemoryResourceScope
 {
 public:
-    JsonInvalidValue(): JsonValue(JsonValueType::InvalidValue) {}
-    ~JsonInvalidValue() {}
+    explicit MemoryResourceScope(std::pmr::memory_resource *resource): 
+            previous_(_CurrentMemoryResource())
+    {
+        _CurrentMemoryResource() = resource;
+    }
+    ~MemoryResourceScope()
+    {
+        _CurrentMemoryResource() = previous_;
+    }
+    MemoryResourceScope(const MemoryResourceScope&) = delete;
+    MemoryResourceScope& operator= (const MemoryResourceScope&) = delete;
+
+private:
+    std::pmr::memory_resource *previous_;
 };
 
 
-class Json
+// Allocator for the shared_ptr control block and node of allocate_shared. 
+// Unlike polymorphic_allocator it does not apply uses-allocator 
+// construction, so node constructors choose their container's allocator.
+template <typename T>
+class _NodeAllocator
 {
 public:
-    using object_container_type = JsonObject::container_type;
-    using array_container_type = JsonArray::container_type;
-    using size_type = array_container_type::size_type;
-    Json()
+    using value_type = T;
+
+    explicit _NodeAllocator(std::pmr::memory_resource *resource): 
+            resource_(resource) {}
+    template <typename U>
+    _NodeAllocator(const _NodeAllocator<U> &other): 
+            resource_(other.resource()) {}
+
+    T* allocate(size_t n)
     {
-        json_value_ = std::make_shared<JsonInvalidValue>();
+        return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
     }
-    Json(JsonValueType type)
+    void deallocate(T *p, size_t n)
     {
-        switch(type) {
-        case JsonValueType::Number: {
-            json_value_ = std::make_shared<JsonNumber>();
-            break;
-        }
-        case JsonValueType::False: {
-            json_value_ = std::make_shared<JsonFalse>();
-            break;
-        }
-        case JsonValueType::True: {
-            json_value_ = std::make_shared<JsonTrue>();
-            break;
-        }
-        case JsonValueType::Null: {
-            json_value_ = std::make_shared<JsonNull>();
-            break;
-        }
-        case JsonValueType::Array: {
-            json_value_ = std::make_shared<JsonArray>();
-            break;
-        }
-        case JsonValueType::Object: {
-            json_value_ = std::make_shared<JsonObject>();
-            break;
-        }
-        default:
-            json_value_ = std::make_shared<JsonInvalidValue>();
-        }
+        resource_->deallocate(p, n * sizeof(T), alignof(T));
     }
-    Json(double value)
+    std::pmr::memory_resource* resource() const { return resource_; }
+
+    template <typename U>
+    bool operator== (const _NodeAllocator<U> &other) const
     {
-        json_value_ = std::make_shared<JsonNumber>(value);
+        return resource_->is_equal(*other.resource());
     }
-    Json(const string_type &str)
+    template <typename U>
+    bool operator!= (const _NodeAllocator<U> &other) const
     {
-        json_value_ = std::make_shared<JsonString>(str);
+        return !(*this == other);
     }
-    Json(string_type &&str)
+
+private:
+    std::pmr::memory_resource *resource_;
+};
+
+
+constexpr size_t kHugePageSize = 2 << 20;
+
+
+// A monotonic memory resource carved out of large chunks aligned to 2 MB 
+// huge pages. With `huge_pages` the chunks are marked MADV_HUGEPAGE so the 
+// kernel can back them with transparent huge pages: a document spread over 
+// a few large pages takes far fewer TLB entries to traverse than one spread 
+// over 4 KB pages. Deallocation is a no-op; Reset() reuses the chunks and 
+// destruction returns them.
+//
+// Pages land on the NUMA node of the thread that first writes them. An 
+// arena created and used by one worker stays local to it; with `prefault` 
+// each chunk is touched when it is mapped, so placement follows the thread 
+// that grows the arena even if another thread fills it.
+class HugePageArena: public std::pmr::memory_resource
+{
+public:
+    explicit HugePageArena(size_t chunk_size = 16 * kHugePageSize, 
+                           bool huge_pages = true, bool prefault = false): 
+            chunk_size_(_RoundUp(chunk_size)), huge_pages_(huge_pages), 
+            prefault_(prefault) {}
+    ~HugePageArena()
     {
-        json_value_ = std::make_shared<JsonString>(std::move(str));
+        for (auto &chunk: chunks_) Unmap(chunk.first, chunk.second);
     }
-    Json(const char *src)
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator= (const HugePageArena&) = delete;
+
+    // Forget every allocation and start again from the first chunk. Nodes 
+    // allocated before must be gone.
+    void Reset()
     {
-        std::wstring_convert<std::codecvt_utf8_utf16<charT> > converter;
-        string_type ws = converter.from_bytes(src);
-        json_value_ = std::make_shared<JsonString>(ws);
+        current_ = 0;
+        SetChunk();
     }
-    Json(const string_type::value_type *src): Json(string_type(src)) {}
-    Json(bool value)
+
+    // Bytes mapped.
+    size_t Capacity() const
     {
-        if (value) json_value_ = std::make_shared<JsonTrue>();
-        else json_value_ = std::make_shared<JsonFalse>();
+        size_t capacity = 0;
+        for (auto &chunk: chunks_) capacity += chunk.second;
+        return capacity;
     }
-    Json(const std::initializer_list<Json> &init_list)
+
+private:
+    static size_t _RoundUp(size_t n)
     {
-        bool is_object = true;
-        for (auto iter = init_list.begin(); iter < init_list.end(); ++iter) {
-            if (!iter->IsArray() || iter->size() != 2 ||
-                    !(*iter)[0].IsString()) {
-                is_object = false;
-                break;
+        return (n + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        while (true) {
+            char *p = reinterpret_cast<char*>(
+                    (reinterpret_cast<uintptr_t>(next_) + alignment - 1) & 
+                    ~(static_cast<uintptr_t>(alignment) - 1));
+            if (next_ != nullptr && p + bytes <= end_) {
+                next_ = p + bytes;
+                return p;
             }
-        }
-        if (is_object) {
-            json_value_ = std::make_shared<JsonObject>();
-            for (auto iter = init_list.begin(); iter < init_list.end(); ++iter) {
-                (*this)[(*iter)[0]] = (*iter)[1];
+            // Move on to the next chunk, mapping one if none is left.
+            if (next_ != nullptr) ++current_;
+            if (current_ == chunks_.size()) {
+                // Chunks start on a huge page boundary, which satisfies
+                // any smaller alignment.
+                size_t size = std::max(chunk_size_, _RoundUp(
+                        bytes + (alignment > kHugePageSize ? alignment : 0)));
+                chunks_.emplace_back(Map(size), size);
             }
-        } else {
-            json_value_ = std::make_shared<JsonArray>(init_list);
+            SetChunk();
         }
     }
-    size_type size() const
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
     {
-        if (this->IsArray())
-        {
-            auto p = std::static_pointer_cast<JsonArray>(json_value_);
-            return p->size();
-        } else if (this->IsObject())
-        {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return p->size();
-        }
-        std::string message = std::string("calling size() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
+        return this == &other;
     }
-    JsonValueType GetType() const { return json_value_->GetType(); } 
-    double ToDouble() const
+
+    void SetChunk()
     {
-        if (this->IsNumber()) {
-            auto p = std::static_pointer_cast<JsonNumber>(json_value_);
-            return p->ToDouble();
+        if (current_ < chunks_.size()) {
+            next_ = chunks_[current_].first;
+            end_ = next_ + chunks_[current_].second;
+        } else {
+            next_ = end_ = nullptr;
         }
-        std::string message = std::string("calling ToDouble() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
-    }
-    bool ToBool() const {
-        if (this->IsTrue()) return true;
-        if (this->IsFalse()) return false;
-        std::string message = std::string("calling ToBool() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
     }
-    void resize(size_type n)
+
+    char* Map(size_t size)
     {
-        if (this->IsArray()) {
-            auto p = std::static_pointer_cast<JsonArray>(json_value_);
-            return p->resize(n);
-        } else if (this->IsString()) {
-            auto p = std::static_pointer_cast<JsonString>(json_value_);
-            return p->resize(n);
+        char *p;
+#ifdef FJSON_HAVE_POSIX_IO
+        // Over-allocate by one huge page and trim to 2 MB alignment.
+        void *mapped = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE, 
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) throw std::bad_alloc();
+        char *base = static_cast<char*>(mapped);
+        p = reinterpret_cast<char*>(_RoundUp(reinterpret_cast<uintptr_t>(base)));
+        if (p > base) munmap(base, p - base);
+        munmap(p + size, base + kHugePageSize - p);
+#ifdef MADV_HUGEPAGE
+        if (huge_pages_) madvise(p, size, MADV_HUGEPAGE);
+#endif
+#else
+        p = static_cast<char*>(::operator new(size, std::align_val_t(kHugePageSize)));
+#endif
+        if (prefault_) {
+            for (size_t i = 0; i < size; i += 4096) p[i] = 0;
         }
-        std::string message = std::string("calling resize() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
+        return p;
     }
-    // For string
-    string_type ToString() const
+
+    void Unmap(char *p, size_t size)
     {
-        if (this->IsString()) {
-            auto p = std::static_pointer_cast<JsonString>(json_value_);
-            return p->ToString();
-        }
-        std::string message = std::string("calling ToString() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
+#ifdef FJSON_HAVE_POSIX_IO
+        munmap(p, size);
+#else
+        ::operator delete(p, std::align_val_t(kHugePageSize));
+#endif
     }
 
-    string_type& GetStringRef()
+    size_t chunk_size_;
+    bool huge_pages_;
+    bool prefault_;
+    std::vector<std::pair<char*, size_t> > chunks_;
+    size_t current_ = 0;
+    char *next_ = nullptr;
+    char *end_ = nullptr;
+};
+#else
+using _ArrayContainer = std::vector<Json>;
+using _ObjectContainer = std::map<_ObjectKey, Json, _ObjectKeyLess>;
+#endif
+
+
+// Allocator for the container or string of a node created now.
+template <typename Container>
+typename Container::allocator_type _NodeContainerAllocator()
+{
+#ifdef FJSON_USE_PMR
+    return typename Container::allocator_type(GetMemoryResource());
+#else
+    return typename Container::allocator_type();
+#endif
+}
+
+
+template <typename T, typename... Args>
+std::shared_ptr<T> _MakeNode(Args&&... args)
+{
+#ifdef FJSON_USE_PMR
+    return std::allocate_shared<T>(_NodeAllocator<T>(GetMemoryResource()), 
+                                   std::forward<Args>(args)...);
+#else
+    return std::make_shared<T>(std::forward<Args>(args)...);
+#endif
+}
+
+
+class JsonValue
+{
+public:
+    using array_container_type = _ArrayContainer;
+    using object_container_type = _ObjectContainer;
+    using size_type = array_container_type::size_type;
+
+    // static JsonValue* parseFile(std::string filename);
+    JsonValue(JsonValueType type): type_(type) {}
+
+    virtual ~JsonValue() {}
+    JsonValueType GetType() const { return type_; }
+    bool IsNumber() const { return type_ == JsonValueType::Number; }
+    bool IsNull() const { return type_ == JsonValueType::Null; }
+    bool IsTrue() const { return type_ == JsonValueType::True; }
+    bool IsFalse() const { return type_ == JsonValueType::False; }
+    bool IsString() const { return type_ == JsonValueType::String; }
+    bool IsArray() const { return type_ == JsonValueType::Array; }
+    bool IsObject() const { return type_ == JsonValueType::Object; }
+    bool IsValid() const { return type_ != JsonValueType::InvalidValue; }
+    
+private:
+    JsonValueType type_;
+};
+
+class JsonNull: public JsonValue
+{
+public:
+    JsonNull(): JsonValue(JsonValueType::Null) {}
+    ~JsonNull() {}
+};
+
+class JsonNumber: public JsonValue
+{
+public:
+    JsonNumber(): JsonValue(JsonValueType::Number), value_(0.) {}
+    JsonNumber(double value): JsonValue(JsonValueType::Number), value_(value) {}
+    double ToDouble() const
     {
-        if (this->IsString()) {
-            auto p = std::static_pointer_cast<JsonString>(json_value_);
-            return p->GetStringRef();
-        }
-        std::string message = std::string("calling GetStringRef() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
+        return value_;
     }
+private:
+    double value_;
+};
 
-    const string_type& GetStringRef() const
-    {
-        if (this->IsString()) {
-            auto p = std::static_pointer_cast<JsonString>(json_value_);
-            return p->GetStringRef();
+class JsonTrue: public JsonValue
+{
+public:
+    JsonTrue(): JsonValue(JsonValueType::True) {}
+    ~JsonTrue() {}
+    operator bool() const { return true; }
+};
+
+class JsonFalse: public JsonValue
+{
+public:
+    JsonFalse(): JsonValue(JsonValueType::False) {}
+    ~JsonFalse() {}
+    operator bool() const { return false; }
+};
+
+// Characters that must be escaped inside a string literal. RFC 8259 only 
+// requires it for U+0000 to U+001F; DEL and the C1 controls may appear 
+// raw, which is also what Dump() writes for them and what IsValid() accepts.
+bool IsControlChar(string_type::value_type c)
+{
+    return c < 0x20;
+}
+
+
+// Decode the escape sequences of a string literal's text (without the 
+// quotes). The text must already have been validated by the parser.
+inline void _Unescape(const string_type &raw, string_type &out)
+{
+    out.reserve(raw.size());
+    for (auto iter = raw.cbegin(); iter < raw.cend(); ++iter) {
+        if (*iter != '\\') {
+            out.push_back(*iter);
+            continue;
+        }
+        switch (*++iter) {
+        case 'b': out.push_back(L'\b'); break;
+        case 'f': out.push_back(L'\f'); break;
+        case 'n': out.push_back(L'\n'); break;
+        case 'r': out.push_back(L'\r'); break;
+        case 't': out.push_back(L'\t'); break;
+        case 'u': {
+            unsigned value = 0;
+            for (int i = 0; i < 4; ++i) {
+                charT c = *++iter;
+                value = value * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+            }
+            out.push_back(static_cast<charT>(value));
+            break;
+        }
+        default:
+            // \\, \/ and \"
+            out.push_back(*iter);
         }
-        std::string message = std::string("calling GetStringRef() on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IncompatibleTypeError(std::move(message));
     }
+}
 
-    Json& operator[] (const string_type &key)
+
+class JsonString: public JsonValue, public string_type
+{
+public:
+    // What the stored text holds.
+    enum Form: unsigned char {
+        // The string value.
+        kDecoded = 0, 
+        // The string value, known to need no escaping when serialized 
+        // (parsed strings without escape sequences).
+        kVerbatim = 1, 
+        // The raw text of a parsed string literal, still containing escape 
+        // sequences; decoded on first access.
+        kEscaped = 2, 
+        // Being decoded, or its raw text being written, by another thread.
+        kDecoding = 3, 
+    };
+
+    JsonString(const string_type &str):
+            JsonValue(JsonValueType::String), 
+            string_type(str, _NodeContainerAllocator<string_type>()), 
+            form_(kDecoded) {}
+    JsonString(string_type &&str): 
+            JsonValue(JsonValueType::String), 
+            string_type(std::move(str), _NodeContainerAllocator<string_type>()), 
+            form_(kDecoded) {}
+    JsonString(string_type &&text, Form form): 
+            JsonValue(JsonValueType::String), 
+            string_type(std::move(text), _NodeContainerAllocator<string_type>()), 
+            form_(form) {}
+    JsonString(const JsonString &other): 
+            JsonValue(JsonValueType::String), 
+            string_type(other.GetStringRef(), 
+                        _NodeContainerAllocator<string_type>()), 
+            form_(other.form_.load(std::memory_order_acquire)) {}
+    string_type ToString() const
     {
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[key];
-        }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        return GetStringRef();
     }
-
-    Json& operator[] (string_type &&key)
+    const string_type& GetStringRef() const
     {
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[std::move(key)];
-        }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        Decode();
+        return *this;
     }
-
-
-    const Json& operator[] (const string_type &key) const
+    string_type& GetStringRef()
     {
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[key];
-        }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        Decode();
+        // The caller may modify the string.
+        form_.store(kDecoded, std::memory_order_relaxed);
+        return *this;
     }
-
-
-    Json& operator[] (const Json &key)
+    // A parsed string that needs no escaping, which can be written between 
+    // quotes as-is. Returns nullptr otherwise.
+    const string_type* GetVerbatim() const
     {
-        if (!key.IsString())
-        {
-            throw IndexTypeError("indexing with unsupported type");
-        }
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[key.GetStringRef()];
-        }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        unsigned char form = form_.load(std::memory_order_acquire);
+        return form == kVerbatim ? this : nullptr;
     }
-    Json& operator[] (Json &&key)
+    // Call `write` with the raw text of a string that has not been decoded 
+    // yet, which can also be written between quotes as-is. The text is 
+    // decoded in place on first access, so other threads wait for `write` 
+    // before decoding it. Returns false without calling `write` if the 
+    // string is decoded or being decoded.
+    template <typename Function>
+    bool WriteEscaped(Function write) const
     {
-        if (!key.IsString())
-        {
-            throw IndexTypeError("indexing with unsupported type");
+        unsigned char form = kEscaped;
+        if (!form_.compare_exchange_strong(form, kDecoding, 
+                                           std::memory_order_acquire)) {
+            return false;
         }
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[std::move(key.GetStringRef())];
+        try {
+            write(static_cast<const string_type&>(*this));
+        } catch (...) {
+            form_.store(kEscaped, std::memory_order_release);
+            throw;
         }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        form_.store(kEscaped, std::memory_order_release);
+        return true;
     }
-    const Json& operator[] (const Json &key) const
+private:
+    void Decode() const
     {
-        if (!key.IsString())
-        {
-            throw IndexTypeError("indexing with unsupported type");
-        }
-        if (this->IsObject()) {
-            auto p = std::static_pointer_cast<JsonObject>(json_value_);
-            return (*p)[key.GetStringRef()];
+        for (;;) {
+            unsigned char form = form_.load(std::memory_order_acquire);
+            if (form < kEscaped) return;
+            if (form == kEscaped && form_.compare_exchange_strong(
+                    form, kDecoding, std::memory_order_acquire)) {
+                // Same allocator, so the swap below is valid.
+                string_type decoded(get_allocator());
+                _Unescape(*this, decoded);
+                // Decoding caches the result in place; the object itself is 
+                // never const, only the access path is.
+                const_cast<JsonString*>(this)->string_type::swap(decoded);
+                form_.store(kDecoded, std::memory_order_release);
+                return;
+            }
+            // Decoded or written by another thread; it may still be 
+            // escaped afterwards.
+            if (form == kDecoding) std::this_thread::yield();
         }
-        std::string message = std::string("indexing with string on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
     }
 
-    Json& operator[] (int index)
+    mutable std::atomic<unsigned char> form_;
+};
+
+
+// A one-byte lock for per-node state, where a std::mutex in every node 
+// would outweigh the small containers it guards.
+class _NodeLock
+{
+public:
+    void lock()
     {
-        if (this->IsArray()) {
-            auto p = std::static_pointer_cast<JsonArray>(json_value_);
-            return (*p)[index];
+        while (flag_.test_and_set(std::memory_order_acquire)) {
+            std::this_thread::yield();
         }
-        std::string message = std::string("indexing with integer on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
     }
-    const Json& operator[] (int index) const
+    void unlock() { flag_.clear(std::memory_order_release); }
+private:
+    std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
+
+// The text a container was last serialized to by Json::DumpCached(), and 
+// the indentation it was written with. Any non-const access to the 
+// container invalidates it, and the caches of the containers that were 
+// serialized around it; copies of a container start without one.
+struct _DumpCache
+{
+    std::string bytes;
+    int indent = 0;
+    int level = 0;
+    // Containers whose cached text may include this one's. They register 
+    // each time they are serialized with DumpCached() and are dropped when 
+    // invalidated. Allocated on first use to keep containers small.
+    std::unique_ptr<std::vector<std::weak_ptr<JsonValue>>> parents;
+    std::atomic<bool> valid{false};
+    std::atomic<bool> has_parents{false};
+    // Guards everything above against concurrent DumpCached() calls.
+    _NodeLock lock;
+
+    _DumpCache() {}
+    _DumpCache(const _DumpCache&) {}
+    _DumpCache& operator= (const _DumpCache&) 
     {
-        if (this->IsArray()) {
-            auto p = std::static_pointer_cast<JsonArray>(json_value_);
-            return (*p)[index];
-        }
-        std::string message = std::string("indexing with integer on ") + 
-                ValueTypeToStr(GetType()) + " is invalid";
-        throw IndexTypeError(std::move(message));
+        Invalidate();
+        return *this;
     }
-    
-    bool IsNumber() const { return json_value_->IsNumber(); }
-    bool IsNull() const { return json_value_->IsNull(); }
-    bool IsTrue() const { return json_value_->IsTrue(); }
-    bool IsFalse() const { return json_value_->IsFalse(); }
-    bool IsString() const { return json_value_->IsString(); }
-    bool IsArray() const { return json_value_->IsArray(); }
-    bool IsObject() const { return json_value_->IsObject(); }
-    bool IsValid() const { return json_value_->IsValid(); }
-    
-    friend std::wostream& operator<< (std::wostream &o, const Json &json);
-    
-    // TODO: add iterator to iterate the elements
-    class object_iterator
-    {
-    public:
-        using self_type = object_iterator;
-    private:
 
-    };
+    void Invalidate();
+};
 
-    class const_object_iterator
-    {
 
-    };
-    
-    class array_iterator
-    {
+class JsonArray: public JsonValue, public _ArrayContainer
+{
+public:
+    using container_type = _ArrayContainer;
+    using iterator = container_type::iterator;
+    using const_iterator = container_type::const_iterator;
+    using size_type = container_type::size_type;
+    using difference_type = container_type::difference_type;
 
-    };
+    JsonArray(): 
+        JsonValue(JsonValueType::Array), 
+        container_type(_NodeContainerAllocator<container_type>()) {}
+    JsonArray(const std::initializer_list<Json> &init_list): 
+        JsonValue(JsonValueType::Array), 
+        container_type(init_list, _NodeContainerAllocator<container_type>()) {}
 
-    class const_array_iterator
-    {
-        
-    };
-    
-    static Json Parse(const string_type &str);
+    _DumpCache& GetDumpCache() const { return dump_cache_; }
+    void MarkDirty() { dump_cache_.Invalidate(); }
 private:
-    std::shared_ptr<JsonValue> json_value_;
+    mutable _DumpCache dump_cache_;
 };
 
 
-std::wostream & operator<< (std::wostream &o, const Json &json)
+class JsonObject: public JsonValue, public _ObjectContainer
 {
-    switch(json.GetType()) {
-    case JsonValueType::Null: 
-        o << "Null";
-        break;
-    case JsonValueType::True:
-        o << "true";
-        break;
-    case JsonValueType::False:
-        o << "false";
-        break;
-    case JsonValueType::Number:
-        o << json.ToDouble();
-        break;
-    case JsonValueType::String:
-        o << "\"" << json.GetStringRef() << "\"";
-        break;
-    case JsonValueType::Array: {
-        o << "[";
-        auto array_json = std::dynamic_pointer_cast<JsonArray>(json.json_value_);
-        for (auto iter = array_json->cbegin(), end = array_json->cend(); 
-                iter != end; ++iter) {
-            if (iter != array_json->cbegin()) o << ", ";
-            o << *iter;
-        }
-        o << "]";
-        break;
-    }
-    case JsonValueType::Object: {
-        o << "{";
-        auto object_json = std::dynamic_pointer_cast<JsonObject>(json.json_value_);
-        size_t count = 0;
-        for (auto iter = object_json->cbegin(), end = object_json->cend(); 
-                iter != end; ++iter) {
-            if (!iter->second.IsValid()) break;
-            if (count) o << ", ";
-            o << "\"" << iter->first << "\": " << iter->second;
-            ++count;
-        }
-        o << "}";
-        break;
-    }
-    default:
-        break;
-    }
-    return o;
-}
+public:
+    using container_type = _ObjectContainer;
+    using iterator = container_type::iterator;
+    using const_iterator = container_type::const_iterator;
+    using size_type = container_type::size_type;
+    using difference_type = container_type::difference_type;
 
+    JsonObject(): 
+        JsonValue(JsonValueType::Object), 
+        container_type(_NodeContainerAllocator<container_type>()) {}
 
-bool IsWhitespace(string_type::value_type c)
-{
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
-}
+    _DumpCache& GetDumpCache() const { return dump_cache_; }
+    void MarkDirty() { dump_cache_.Invalidate(); }
+private:
+    mutable _DumpCache dump_cache_;
+};
 
 
-bool IsControlChar(string_type::value_type c)
+inline _DumpCache* _GetDumpCache(const JsonValue *node)
 {
-    return (c < 0x1f) || (c == 0x7f) || ((0x80 < c) && c < 0x9f);
+    if (node->IsArray()) {
+        return &static_cast<const JsonArray*>(node)->GetDumpCache();
+    }
+    if (node->IsObject()) {
+        return &static_cast<const JsonObject*>(node)->GetDumpCache();
+    }
+    return nullptr;
 }
 
 
-constexpr bool IsDigit(charT c) {
-    return '0' <= c && c <= '9';
+inline void _DumpCache::Invalidate()
+{
+    valid.store(false, std::memory_order_relaxed);
+    if (!has_parents.load(std::memory_order_relaxed)) return;
+    std::unique_ptr<std::vector<std::weak_ptr<JsonValue>>> registered;
+    {
+        std::lock_guard<_NodeLock> guard(lock);
+        registered.swap(parents);
+        has_parents.store(false, std::memory_order_relaxed);
+    }
+    if (!registered) return;
+    for (auto &parent: *registered) {
+        if (auto node = parent.lock()) _GetDumpCache(node.get())->Invalidate();
+    }
 }
 
 
-string_type::difference_type _ParseValue(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end);
-
-
-string_type::difference_type _ParseArray(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end);
-
-
-string_type::difference_type _ParseString(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end);
-
-
-string_type::difference_type _ParseObject(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end);
+class JsonInvalidValue: public JsonValue
+{
+public:
+    JsonInvalidValue(): JsonValue(JsonValueType::InvalidValue) {}
+    ~JsonInvalidValue() {}
+};
 
 
-string_type::difference_type _ParseArray(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end)
+class Json
 {
-    enum Status {WAIT_LBRACKET, WAIT_RBRACKET, COMPLETED};
-    Status status = WAIT_LBRACKET;
-    auto iter = begin;
-    while (iter < end) {
-        // Skip whitespace
-        if (IsWhitespace(*iter)) {
-            ++iter;
+public:
+    using object_container_type = JsonObject::container_type;
+    using array_container_type = JsonArray::container_type;
+    using size_type = array_container_type::size_type;
+    Json()
+    {
+        json_value_ = _MakeNode<JsonInvalidValue>();
+    }
+    Json(JsonValueType type)
+    {
+        switch(type) {
+        case JsonValueType::Number: {
+            json_value_ = _MakeNode<JsonNumber>();
             break;
         }
-
-        if (status == WAIT_LBRACKET) {
-            switch (*iter) {
-            case '[': {
-                string_type::difference_type i;
-                status = WAIT_RBRACKET;
-                json = Json(JsonValueType::Array);
-                json.resize(1);
-                try {
-                    i = _ParseValue(json[0], iter+1, end);
-                } catch (ParseError &e) {
-                    throw ParseError("invalid json array", 
-                                     iter - begin + i, 
-                                     string_type(iter+i, end));
-                }
-                iter += i + 1;
-                continue;
-            }
-            default: {
-                goto complete;
-            }
-            }
-        } else if (status == WAIT_RBRACKET) {
-            switch (*iter) {
-            case ']': {
-                status = COMPLETED;
-                goto complete;
-            }
-            case ',': {
-                string_type::difference_type i;
-                json.resize(json.size() + 1);
-                try {
-                    i = _ParseValue(json[json.size() - 1], iter+1, end);
-                } catch (ParseError &e) {
-                    throw ParseError("invalid json array", 
-                                     iter - begin + i + 1,
-                                     string_type(iter, end));
-                }
-                iter += i + 1;
-                continue;
+        case JsonValueType::False: {
+            json_value_ = _MakeNode<JsonFalse>();
+            break;
+        }
+        case JsonValueType::True: {
+            json_value_ = _MakeNode<JsonTrue>();
+            break;
+        }
+        case JsonValueType::Null: {
+            json_value_ = _MakeNode<JsonNull>();
+            break;
+        }
+        case JsonValueType::Array: {
+            json_value_ = _MakeNode<JsonArray>();
+            break;
+        }
+        case JsonValueType::Object: {
+            json_value_ = _MakeNode<JsonObject>();
+            break;
+        }
+        default:
+            json_value_ = _MakeNode<JsonInvalidValue>();
+        }
+    }
+    Json(double value)
+    {
+        json_value_ = _MakeNode<JsonNumber>(value);
+    }
+    Json(const string_type &str)
+    {
+        json_value_ = _MakeNode<JsonString>(str);
+    }
+    Json(string_type &&str)
+    {
+        json_value_ = _MakeNode<JsonString>(std::move(str));
+    }
+    Json(const char *src)
+    {
+        std::wstring_convert<std::codecvt_utf8_utf16<charT> > converter;
+        string_type ws = _FromStdString(converter.from_bytes(src));
+        json_value_ = _MakeNode<JsonString>(std::move(ws));
+    }
+    Json(const string_type::value_type *src): Json(string_type(src)) {}
+    explicit Json(std::shared_ptr<JsonValue> value): 
+            json_value_(std::move(value)) {}
+    Json(bool value)
+    {
+        if (value) json_value_ = _MakeNode<JsonTrue>();
+        else json_value_ = _MakeNode<JsonFalse>();
+    }
+    Json(const std::initializer_list<Json> &init_list)
+    {
+        bool is_object = true;
+        for (auto iter = init_list.begin(); iter < init_list.end(); ++iter) {
+            if (!iter->IsArray() || iter->size() != 2 ||
+                    !(*iter)[0].IsString()) {
+                is_object = false;
+                break;
             }
+        }
+        if (is_object) {
+            json_value_ = _MakeNode<JsonObject>();
+            for (auto iter = init_list.begin(); iter < init_list.end(); ++iter) {
+                (*this)[(*iter)[0]] = (*iter)[1];
             }
         } else {
-            goto complete;
+            json_value_ = _MakeNode<JsonArray>(init_list);
         }
-next_iter:
-        ++iter;
     }
-complete:
-    if (status == COMPLETED) {
-        return iter - begin;
-    } else {
-        throw ParseError("invalid json array", 
-                         iter - begin, 
-                         string_type(begin, end));
-    }
-}
-
-
-// If any error occurred when parsing, an ParseError exception will be thrown.
-// If the parsing process completes without error, then the position of the 
-// final character, i.e., '}', will be returned.
-string_type::difference_type _ParseObject(Json &json, 
-        typename string_type::const_iterator begin, 
+    size_type size() const
+    {
+        if (this->IsArray())
+        {
+            auto p = std::static_pointer_cast<JsonArray>(json_value_);
+            return p->size();
+        } else if (this->IsObject())
+        {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            return p->size();
+        }
+        std::string message = std::string("calling size() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+    JsonValueType GetType() const { return json_value_->GetType(); } 
+    double ToDouble() const
+    {
+        if (this->IsNumber()) {
+            auto p = std::static_pointer_cast<JsonNumber>(json_value_);
+            return p->ToDouble();
+        }
+        std::string message = std::string("calling ToDouble() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+    bool ToBool() const {
+        if (this->IsTrue()) return true;
+        if (this->IsFalse()) return false;
+        std::string message = std::string("calling ToBool() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+    void resize(size_type n)
+    {
+        if (this->IsArray()) {
+            auto p = std::static_pointer_cast<JsonArray>(json_value_);
+            p->MarkDirty();
+            return p->resize(n);
+        } else if (this->IsString()) {
+            auto p = std::static_pointer_cast<JsonString>(json_value_);
+            return p->GetStringRef().resize(n);
+        }
+        std::string message = std::string("calling resize() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+    // For string
+    string_type ToString() const
+    {
+        if (this->IsString()) {
+            auto p = std::static_pointer_cast<JsonString>(json_value_);
+            return p->ToString();
+        }
+        std::string message = std::string("calling ToString() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    string_type& GetStringRef()
+    {
+        if (this->IsString()) {
+            auto p = std::static_pointer_cast<JsonString>(json_value_);
+            return p->GetStringRef();
+        }
+        std::string message = std::string("calling GetStringRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    const string_type& GetStringRef() const
+    {
+        if (this->IsString()) {
+            auto p = std::static_pointer_cast<JsonString>(json_value_);
+            return p->GetStringRef();
+        }
+        std::string message = std::string("calling GetStringRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    const array_container_type& GetArrayRef() const
+    {
+        if (this->IsArray()) {
+            return *std::static_pointer_cast<JsonArray>(json_value_);
+        }
+        std::string message = std::string("calling GetArrayRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    array_container_type& GetArrayRef()
+    {
+        if (this->IsArray()) {
+            auto p = std::static_pointer_cast<JsonArray>(json_value_);
+            p->MarkDirty();
+            return *p;
+        }
+        std::string message = std::string("calling GetArrayRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    const object_container_type& GetObjectRef() const
+    {
+        if (this->IsObject()) {
+            return *std::static_pointer_cast<JsonObject>(json_value_);
+        }
+        std::string message = std::string("calling GetObjectRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    object_container_type& GetObjectRef()
+    {
+        if (this->IsObject()) {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            p->MarkDirty();
+            return *p;
+        }
+        std::string message = std::string("calling GetObjectRef() on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    // Look up a member without inserting it. Returns nullptr if this is not 
+    // an object or the key is absent.
+    const Json* Find(const string_type &key) const
+    {
+        if (!this->IsObject()) return nullptr;
+        auto p = std::static_pointer_cast<JsonObject>(json_value_);
+        auto iter = p->find(_MemberKey(key));
+        return iter == p->end() ? nullptr : &iter->second;
+    }
+
+    // Follow a sequence of object keys. Returns nullptr if any step is missing.
+    const Json* Find(const key_path_type &path) const
+    {
+        const Json *current = this;
+        for (const auto &key: path) {
+            current = current->Find(key);
+            if (current == nullptr) return nullptr;
+        }
+        return current;
+    }
+
+    Json& operator[] (const string_type &key)
+    {
+        if (this->IsObject()) {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            p->MarkDirty();
+            // Look up before copying the key, which is only needed to insert.
+            const auto &member_key = _MemberKey(key);
+            auto iter = p->lower_bound(member_key);
+            if (iter == p->end() || p->key_comp()(member_key, iter->first)) {
+                iter = p->emplace_hint(iter, key, Json());
+            }
+            return iter->second;
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+
+    Json& operator[] (string_type &&key)
+    {
+        if (this->IsObject()) {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            p->MarkDirty();
+            return (*p)[std::move(key)];
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+
+
+    // Const lookups do not insert: a missing key yields an invalid value.
+    const Json& operator[] (const string_type &key) const
+    {
+        if (this->IsObject()) {
+            const Json *value = Find(key);
+            return value ? *value : _Invalid();
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+
+
+    Json& operator[] (const charT *key)
+    {
+        return (*this)[string_type(key)];
+    }
+
+    const Json& operator[] (const charT *key) const
+    {
+        return (*this)[string_type(key)];
+    }
+
+    Json& operator[] (const Json &key)
+    {
+        if (!key.IsString())
+        {
+            throw IndexTypeError("indexing with unsupported type");
+        }
+        if (this->IsObject()) {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            p->MarkDirty();
+            return (*p)[key.GetStringRef()];
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+    Json& operator[] (Json &&key)
+    {
+        if (!key.IsString())
+        {
+            throw IndexTypeError("indexing with unsupported type");
+        }
+        if (this->IsObject()) {
+            auto p = std::static_pointer_cast<JsonObject>(json_value_);
+            p->MarkDirty();
+            return (*p)[std::move(key.GetStringRef())];
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+    const Json& operator[] (const Json &key) const
+    {
+        if (!key.IsString())
+        {
+            throw IndexTypeError("indexing with unsupported type");
+        }
+        if (this->IsObject()) {
+            return (*this)[key.GetStringRef()];
+        }
+        std::string message = std::string("indexing with string on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+
+    Json& operator[] (int index)
+    {
+        if (this->IsArray()) {
+            auto p = std::static_pointer_cast<JsonArray>(json_value_);
+            p->MarkDirty();
+            return (*p)[index];
+        }
+        std::string message = std::string("indexing with integer on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+    const Json& operator[] (int index) const
+    {
+        if (this->IsArray()) {
+            auto p = std::static_pointer_cast<JsonArray>(json_value_);
+            return (*p)[index];
+        }
+        std::string message = std::string("indexing with integer on ") + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IndexTypeError(std::move(message));
+    }
+    
+    bool IsNumber() const { return json_value_->IsNumber(); }
+    bool IsNull() const { return json_value_->IsNull(); }
+    bool IsTrue() const { return json_value_->IsTrue(); }
+    bool IsFalse() const { return json_value_->IsFalse(); }
+    bool IsString() const { return json_value_->IsString(); }
+    bool IsArray() const { return json_value_->IsArray(); }
+    bool IsObject() const { return json_value_->IsObject(); }
+    bool IsValid() const { return json_value_->IsValid(); }
+
+    // Identity of the underlying value; copies of a Json share it.
+    const JsonValue* GetValuePtr() const { return json_value_.get(); }
+
+    // For serializers: string text that can be written between quotes 
+    // without escaping (see JsonString::GetVerbatim), or nullptr.
+    const string_type* GetVerbatimString() const
+    {
+        if (!this->IsString()) return nullptr;
+        return std::static_pointer_cast<JsonString>(json_value_)->GetVerbatim();
+    }
+    
+    friend std::wostream& operator<< (std::wostream &o, const Json &json);
+    
+    // TODO: add iterator to iterate the elements
+    class object_iterator
+    {
+    public:
+        using self_type = object_iterator;
+    private:
+
+    };
+
+    class const_object_iterator
+    {
+
+    };
+    
+    class array_iterator
+    {
+
+    };
+
+    class const_array_iterator
+    {
+        
+    };
+    
+    static Json Parse(const string_type &str);
+    // Parse and record the span of text each value was read from.
+    static Json Parse(const string_type &str, SourceMap &source_map);
+    // Parse UTF-8 encoded text.
+    static Json Parse(const char *data, size_t size);
+    // Parse UTF-8 text read from a source until end of input. This is not 
+    // incremental: the whole stream is gathered into one decoded string 
+    // before parsing starts, so memory grows with the input rather than 
+    // with the chunk size. Chunks are decoded straight into that string 
+    // instead of being collected into a byte string first. To bound memory 
+    // on a stream of many values, read them with JsonStreamReader.
+    static Json Parse(InputSource &source);
+    static Json Parse(std::istream &stream);
+
+    // Serialize to UTF-8 JSON text. A negative indent produces the most 
+    // compact form, otherwise nested values are put on their own lines 
+    // indented by `indent` spaces per level. A parsed string with escapes 
+    // is written as it appeared in the input until it is first read, and 
+    // in the minimal escaped form afterwards (["\u00e9"] then ["é"]), so 
+    // the text may differ between calls while the value it parses to does 
+    // not.
+    std::string Dump(int indent = -1) const;
+    void Dump(std::string &out, int indent = -1) const;
+
+    // Dump() for a document that is serialized again after small changes. 
+    // Containers keep the text they were last written as, and containers 
+    // not modified since are copied from it instead of being serialized 
+    // again, so the work follows the size of the change rather than of the 
+    // document. Any non-const access to a container (operator[], 
+    // GetArrayRef(), ...) counts as a modification, and invalidates the 
+    // cached text of every container it was last serialized inside, so a 
+    // change made through a container handle kept from earlier is seen as 
+    // well.
+    //
+    // Strings do not track the containers around them, so changes to a 
+    // string are only seen when it is reached through its parents (e.g. 
+    // doc[L"a"][L"s"].GetStringRef() = ...). What cannot be seen is:
+    //   - a change through a kept handle to a string, e.g. with 
+    //     GetStringRef() or resize() on it;
+    //   - a write through a reference returned by a non-const accessor 
+    //     before the last DumpCached() call: a kept `Json&` to an element 
+    //     that is then assigned, or a kept container reference from 
+    //     GetArrayRef()/GetObjectRef().
+    // Call ClearDumpCache() on the document after modifying it that way. 
+    // The cached text costs 
+    // memory of up to the document's serialized size per level of nesting; 
+    // containers whose text is shorter than kDumpCacheMinSize are not 
+    // cached. Like Dump(), it may be called from several threads at once 
+    // on a document that is not being modified.
+    std::string DumpCached(int indent = -1) const;
+    void DumpCached(std::string &out, int indent = -1) const;
+    // Drop the cached text of this value and everything below it.
+    void ClearDumpCache() const;
+
+    // Resolve an RFC 6901 JSON Pointer such as L"/items/0/id". Returns 
+    // nullptr if the pointer does not resolve.
+    const Json* FindPointer(const string_type &pointer) const;
+
+    // Stable sort of an array by the total ordering of Json values, or by the 
+    // value found at `path` in each element. Elements missing the path sort 
+    // first. Work is split into up to `num_threads` tasks on GetExecutor(); 
+    // 0 uses the executor's concurrency.
+    void Sort(unsigned num_threads = 0);
+    void SortBy(const key_path_type &path, unsigned num_threads = 0);
+private:
+    static const Json& _Invalid()
+    {
+        static const Json invalid;
+        return invalid;
+    }
+
+    // For the dump cache, which keeps weak references to parent containers.
+    friend const std::shared_ptr<JsonValue>& _ValueHandle(const Json &json)
+    {
+        return json.json_value_;
+    }
+
+    std::shared_ptr<JsonValue> json_value_;
+};
+
+
+std::wostream & operator<< (std::wostream &o, const Json &json)
+{
+    switch(json.GetType()) {
+    case JsonValueType::Null: 
+        o << "null";
+        break;
+    case JsonValueType::True:
+        o << "true";
+        break;
+    case JsonValueType::False:
+        o << "false";
+        break;
+    case JsonValueType::Number:
+        o << json.ToDouble();
+        break;
+    case JsonValueType::String:
+        o << "\"" << json.GetStringRef() << "\"";
+        break;
+    case JsonValueType::Array: {
+        o << "[";
+        auto array_json = std::dynamic_pointer_cast<JsonArray>(json.json_value_);
+        for (auto iter = array_json->cbegin(), end = array_json->cend(); 
+                iter != end; ++iter) {
+            if (iter != array_json->cbegin()) o << ", ";
+            o << *iter;
+        }
+        o << "]";
+        break;
+    }
+    case JsonValueType::Object: {
+        o << "{";
+        auto object_json = std::dynamic_pointer_cast<JsonObject>(json.json_value_);
+        size_t count = 0;
+        for (auto iter = object_json->cbegin(), end = object_json->cend(); 
+                iter != end; ++iter) {
+            if (!iter->second.IsValid()) break;
+            if (count) o << ", ";
+            o << "\"" << iter->first << "\": " << iter->second;
+            ++count;
+        }
+        o << "}";
+        break;
+    }
+    default:
+        break;
+    }
+    return o;
+}
+
+
+bool IsWhitespace(string_type::value_type c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+constexpr bool IsDigit(charT c) {
+    return '0' <= c && c <= '9';
+}
+
+
+constexpr bool IsHexDigit(charT c) {
+    return IsDigit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+}
+
+
+// Characters that may legally follow a number inside a JSON text.
+constexpr bool IsNumberTerminator(charT c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || 
+           c == ',' || c == ']' || c == '}';
+}
+
+
+// Decode UTF-8 bytes and append them to `out`. Code points outside the BMP 
+// become UTF-16 surrogate pairs, matching the conversion done by 
+// Json(const char*) and by \u escapes.
+inline void _AppendUtf8(string_type &out, const char *data, size_t size)
+{
+    const auto *p = reinterpret_cast<const unsigned char*>(data);
+    const auto *end = p + size;
+    out.reserve(out.size() + size);
+    while (p < end) {
+        // ASCII fast path
+        if (*p < 0x80) {
+            out.push_back(static_cast<charT>(*p++));
+            continue;
+        }
+        unsigned long code_point;
+        int extra;
+        if ((*p & 0xe0) == 0xc0) {
+            code_point = *p & 0x1f;
+            extra = 1;
+        } else if ((*p & 0xf0) == 0xe0) {
+            code_point = *p & 0x0f;
+            extra = 2;
+        } else if ((*p & 0xf8) == 0xf0) {
+            code_point = *p & 0x07;
+            extra = 3;
+        } else {
+            throw ParseError("invalid utf-8 sequence", 
+                             reinterpret_cast<const char*>(p) - data, 
+                             string_type());
+        }
+        if (end - p <= extra) {
+            throw ParseError("truncated utf-8 sequence", 
+                             reinterpret_cast<const char*>(p) - data, 
+                             string_type());
+        }
+        for (int i = 1; i <= extra; ++i) {
+            if ((p[i] & 0xc0) != 0x80) {
+                throw ParseError("invalid utf-8 sequence", 
+                                 reinterpret_cast<const char*>(p) - data + i, 
+                                 string_type());
+            }
+            code_point = (code_point << 6) | (p[i] & 0x3f);
+        }
+        p += extra + 1;
+        if (code_point >= 0x10000) {
+            code_point -= 0x10000;
+            out.push_back(static_cast<charT>(0xd800 + (code_point >> 10)));
+            out.push_back(static_cast<charT>(0xdc00 + (code_point & 0x3ff)));
+        } else {
+            out.push_back(static_cast<charT>(code_point));
+        }
+    }
+}
+
+
+// 1-based line and column of a position in a text.
+struct SourceLocation
+{
+    size_t line = 1;
+    size_t column = 1;
+};
+
+
+// Compute the location of `offset` in `text` by counting the newlines 
+// before it. This is only done on demand (e.g. when reporting an error), so 
+// parsing never tracks lines; the search uses wmemchr, which the C library 
+// vectorizes. Columns count code units.
+inline SourceLocation GetSourceLocation(const string_type &text, size_t offset)
+{
+    SourceLocation location;
+    const charT *p = text.data();
+    const charT *end = p + std::min(offset, text.size());
+    const charT *line_begin = p;
+    while (p < end && (p = std::wmemchr(p, L'\n', end - p)) != nullptr) {
+        ++location.line;
+        line_begin = ++p;
+    }
+    location.column = end - line_begin + 1;
+    return location;
+}
+
+
+// The same for UTF-8 text, with columns counted in bytes.
+inline SourceLocation GetSourceLocation(const char *data, size_t size, 
+                                        size_t offset)
+{
+    SourceLocation location;
+    const char *p = data;
+    const char *end = data + std::min(offset, size);
+    const char *line_begin = p;
+    while (p < end && (p = static_cast<const char*>(
+            std::memchr(p, '\n', end - p))) != nullptr) {
+        ++location.line;
+        line_begin = ++p;
+    }
+    location.column = end - line_begin + 1;
+    return location;
+}
+
+
+// Side table mapping parsed values to the span of text they were read from. 
+// Filled by Json::Parse(text, source_map); entries are kept in a flat array 
+// sorted by node address rather than in the nodes themselves, so parsing 
+// without a source map costs nothing.
+class SourceMap
+{
+public:
+    struct Span
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    // The span of `json` in the parsed text. Returns false for values that 
+    // were not produced by the parse.
+    bool Find(const Json &json, Span &span) const;
+
+    size_t size() const { return entries_.size(); }
+    void clear() { entries_.clear(); sorted_ = true; }
+
+    // Used by the parser.
+    void Add(const Json &json, size_t begin, size_t end);
+    // Used by the parser after a duplicate key replaced a member: keep only 
+    // the entries of nodes in the tree of `root`. Nodes freed during the 
+    // parse may have had their address reused, so of several entries for 
+    // one node only the last added is kept.
+    void Retain(const Json &root);
+    // Used by Reparse(): drop the entries of the `removed` nodes, move spans 
+    // at or after `old_end` to follow `new_end`, and add the entries of 
+    // `inserted` offset by `offset`.
+    void Splice(const std::vector<const void*> &removed, 
+                size_t old_end, size_t new_end, 
+                const SourceMap &inserted, size_t offset);
+
+private:
+    void Sort() const
+    {
+        if (sorted_) return;
+        std::sort(entries_.begin(), entries_.end(), 
+                  [](const Entry &a, const Entry &b) { return a.node < b.node; });
+        sorted_ = true;
+    }
+
+    struct Entry
+    {
+        const void *node;
+        Span span;
+    };
+    mutable std::vector<Entry> entries_;
+    mutable bool sorted_ = true;
+};
+
+
+// Arrays and objects nested deeper than this are rejected, so that hostile 
+// input cannot exhaust the stack of the recursive parser.
+constexpr size_t kMaxParseDepth = 1000;
+
+
+// State shared by the recursive parse functions of one parse.
+struct _ParseContext
+{
+    typename string_type::const_iterator base;
+    SourceMap *source_map = nullptr;
+    // Set when a duplicate key replaced an object member, leaving entries 
+    // for the nodes of the old value in the source map.
+    bool replaced_member = false;
+    // Containers open around the value being parsed.
+    size_t depth = 0;
+    bool too_deep = false;
+};
+
+
+string_type::difference_type _ParseValue(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context = nullptr);
+
+
+string_type::difference_type _ParseArray(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context = nullptr);
+
+
+string_type::difference_type _ParseString(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end);
+
+
+string_type::difference_type _ParseObject(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context = nullptr);
+
+
+string_type::difference_type _ParseArray(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context)
+{
+    enum Status {WAIT_LBRACKET, WAIT_FIRST_VALUE, WAIT_RBRACKET, COMPLETED};
+    Status status = WAIT_LBRACKET;
+    auto iter = begin;
+    while (iter < end) {
+        // Skip whitespace
+        if (IsWhitespace(*iter)) {
+            goto next_iter;
+        }
+
+        if (status == WAIT_LBRACKET) {
+            switch (*iter) {
+            case '[': {
+                status = WAIT_FIRST_VALUE;
+                json = Json(JsonValueType::Array);
+                goto next_iter;
+            }
+            default: {
+                goto complete;
+            }
+            }
+        } else if (status == WAIT_FIRST_VALUE) {
+            // Empty array
+            if (*iter == ']') {
+                status = COMPLETED;
+                ++iter;
+                goto complete;
+            }
+            string_type::difference_type i;
+            json.resize(1);
+            try {
+                i = _ParseValue(json[0], iter, end, context);
+            } catch (ParseError &e) {
+                throw ParseError("invalid json array", 
+                                 iter - begin + e.GetOffset(), 
+                                 string_type());
+            }
+            status = WAIT_RBRACKET;
+            iter += i;
+            continue;
+        } else if (status == WAIT_RBRACKET) {
+            switch (*iter) {
+            case ']': {
+                status = COMPLETED;
+                ++iter;
+                goto complete;
+            }
+            case ',': {
+                string_type::difference_type i;
+                if (FJSON_TRACE_ENABLED && 
+                        json.size() == json.GetArrayRef().capacity()) {
+                    FJSON_TRACE_INSTANT("array growth", json.size());
+                }
+                json.resize(json.size() + 1);
+                try {
+                    i = _ParseValue(json[json.size() - 1], iter+1, end, context);
+                } catch (ParseError &e) {
+                    throw ParseError("invalid json array", 
+                                     iter - begin + e.GetOffset() + 1,
+                                     string_type());
+                }
+                iter += i + 1;
+                continue;
+            }
+            default: {
+                goto complete;
+            }
+            }
+        } else {
+            goto complete;
+        }
+next_iter:
+        ++iter;
+    }
+complete:
+    if (status == COMPLETED) {
+        return iter - begin;
+    } else {
+        throw ParseError("invalid json array", 
+                         iter - begin, 
+                         string_type());
+    }
+}
+
+
+// If any error occurred when parsing, an ParseError exception will be thrown.
+// If the parsing process completes without error, then the position of the 
+// final character, i.e., '}', will be returned.
+string_type::difference_type _ParseObject(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context)
+{
+    enum Status {WAIT_LBRACE, WAIT_STRING1, WAIT_STRING2, WAIT_COLON, 
+                 WAIT_RBRACE_COMMA, COMPLETED};
+    Status status = WAIT_LBRACE;
+    auto iter = begin;
+    Json key, value;
+    json = Json(JsonValueType::Object);
+    while (iter < end) {
+        if (IsWhitespace(*iter)) {
+            goto next_iter;
+        }
+        if (status == WAIT_LBRACE) {
+            if (*iter == '{') {
+                status = WAIT_STRING1;
+                goto next_iter;
+            } else {
+                goto complete;
+            }
+        } else if (status == WAIT_STRING1) {
+            // Empty object
+            if (*iter == '}') {
+                status = COMPLETED;
+                ++iter;
+                goto complete;
+            }
+            string_type::difference_type i;
+            try {
+                i = _ParseString(key, iter, end);
+            } catch (ParseError &e) {
+                throw ParseError("invalid json object", 
+                                 iter - begin + e.GetOffset(),
+                                 string_type());
+            }
+            status = WAIT_COLON;
+            iter += i;
+            continue;
+        } else if (status == WAIT_STRING2) {
+            string_type::difference_type i;
+            try {
+                i = _ParseString(key, iter, end);
+            } catch (ParseError &e) {
+                throw ParseError("invalid json object", 
+                                 iter - begin + e.GetOffset(),
+                                 string_type());
+            }
+            status = WAIT_COLON;
+            iter += i;
+            continue;
+        } else if (status == WAIT_COLON) {
+            if (*iter == ':') {
+                string_type::difference_type i;
+                ++iter;
+                try {
+                    i = _ParseValue(value, iter, end, context);
+                } catch (ParseError &e) {
+                    throw ParseError("invalid json object", 
+                                     iter - begin + e.GetOffset(), 
+                                     string_type());
+                }
+                if (context && context->source_map && 
+                        json.Find(key.GetStringRef())) {
+                    context->replaced_member = true;
+                }
+                json[std::move(key)] = std::move(value);
+                status = WAIT_RBRACE_COMMA;
+                iter += i;
+                continue;
+            }
+            goto complete;
+        } else if (status == WAIT_RBRACE_COMMA) {
+            if (*iter == ',') {
+                status = WAIT_STRING2;
+                goto next_iter;
+            } else if (*iter == '}') {
+                status = COMPLETED;
+                ++iter;
+            }
+            goto complete;
+        } else {
+            break;
+        }
+next_iter:
+        ++iter;
+    }
+complete:
+    if (status != COMPLETED) {
+        throw ParseError("invalid json object", 
+                         iter - begin, 
+                         string_type());
+    }
+    return iter - begin;
+}
+
+
+
+// Scan a string literal. The escape sequences are validated here but not 
+// decoded: a string containing escapes keeps its raw text and is decoded on 
+// first access, and a string without escapes is copied in one piece.
+string_type::difference_type _ParseString(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end)
+{
+    auto iter = begin;
+    while (iter < end && IsWhitespace(*iter)) ++iter;
+    if (iter == end || *iter != '\"') {
+        throw ParseError("invalid json string", 
+                         iter - begin, 
+                         string_type());
+    }
+    auto start = ++iter;
+    bool has_escapes = false;
+    for (; iter < end; ++iter) {
+        charT c = *iter;
+        if (c == '\"') break;
+        if (IsControlChar(c)) goto fail;
+        if (c != '\\') continue;
+        has_escapes = true;
+        if (++iter == end) goto fail;
+        switch (*iter) {
+        case '\\': case '/': case '\"': case 'b': 
+        case 'f': case 'n': case 'r': case 't':
+            break;
+        case 'u':
+            for (int i = 0; i < 4; ++i) {
+                if (++iter == end || !IsHexDigit(*iter)) goto fail;
+            }
+            break;
+        default:
+            goto fail;
+        }
+    }
+    if (iter == end) goto fail;
+    json = Json(_MakeNode<JsonString>(
+            string_type(start, iter, _NodeContainerAllocator<string_type>()), 
+            has_escapes ? JsonString::kEscaped : JsonString::kVerbatim));
+    return iter + 1 - begin;
+fail:
+    throw ParseError("invalid json string", 
+                     iter - begin, 
+                     string_type());
+}
+
+
+string_type::difference_type _ParseNumber(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end)
+{
+    enum Status {START, WAIT_DIGIT1, WAIT_DIGIT2, FRACTION, WAIT_FRACTION_DIGIT, 
+            WAIT_FRACTION_DIGIT_END, WAIT_E_DIGIT, WAIT_E_SIGN, WAIT_E_DIGIT_END, 
+            COMPLETED, BAD};
+    Status status = START;
+    auto iter = begin;
+    double result;
+    string_type s;
+    while (iter < end) {
+        if (status == START) {
+            if (IsWhitespace(*iter)) {
+                goto next_iter;
+            } else if (*iter == '-') {
+                status = WAIT_DIGIT1;
+                goto add_char;
+            } else if (IsDigit(*iter)) {
+                status = WAIT_DIGIT1;
+                continue;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_DIGIT1) {
+            if (*iter == '0') {
+                status = FRACTION;
+                goto add_char;
+            } else if (IsDigit(*iter)) {
+                status = WAIT_DIGIT2;
+                goto add_char;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_DIGIT2) {
+            if (IsDigit(*iter)) {
+                goto add_char;
+            } else if (*iter == '.') {
+                status = WAIT_FRACTION_DIGIT;
+                goto add_char;
+            } else if (*iter == 'e' || *iter == 'E') {
+                status = WAIT_E_SIGN;
+                goto add_char;
+            } else if (IsNumberTerminator(*iter)) {
+                status = COMPLETED;
+                goto complete;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == FRACTION) {
+            if (*iter == '.') {
+                status = WAIT_FRACTION_DIGIT;
+                goto add_char;
+            } else if (*iter == 'e' || *iter == 'E') {
+                status = WAIT_E_SIGN;
+                goto add_char;
+            } else if (IsNumberTerminator(*iter)) {
+                status = COMPLETED;
+                goto complete;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_FRACTION_DIGIT) {
+            if (IsDigit(*iter)) {
+                status = WAIT_FRACTION_DIGIT_END;
+                goto add_char;
+            } else {
+                status = BAD;
+                goto complete;
+            } 
+        } else if (status == WAIT_FRACTION_DIGIT_END) {
+            if (IsDigit(*iter)) {
+                goto add_char;
+            } else if (*iter == 'e' || *iter == 'E') {
+                status = WAIT_E_SIGN;
+                goto add_char;
+            } else if (IsNumberTerminator(*iter)) {
+                status = COMPLETED;
+                goto complete;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_E_SIGN) {
+            if (IsDigit(*iter)) {
+                status = WAIT_E_DIGIT;
+                continue;
+            } else if (*iter == '-' || *iter == '+') {
+                status = WAIT_E_DIGIT;
+                goto add_char;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_E_DIGIT) {
+            if (IsDigit(*iter)) {
+                status = WAIT_E_DIGIT_END;
+                goto add_char;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else if (status == WAIT_E_DIGIT_END) {
+            if (IsDigit(*iter)) {
+                goto add_char;
+            } else if (IsNumberTerminator(*iter)) {
+                status = COMPLETED;
+                goto complete;
+            } else {
+                status = BAD;
+                goto complete;
+            }
+        } else {
+            break;
+        }
+add_char:
+        s.push_back(*iter);
+next_iter:
+        iter++;
+    }
+complete:
+    switch (status)
+    {
+    case COMPLETED:
+    case FRACTION:
+    case WAIT_DIGIT2: 
+    case WAIT_FRACTION_DIGIT_END:
+    case WAIT_E_DIGIT_END: {
+        FJSON_TRACE_SCOPE("number conversion");
+        // wcstod rounds out-of-range magnitudes to infinity or zero instead 
+        // of throwing like stod.
+        json = std::wcstod(s.c_str(), nullptr); 
+        return iter - begin;
+    }
+    default:
+        throw ParseError("invalid json number", 
+                         iter - begin, 
+                         string_type());
+    }
+}
+
+
+// Whether [iter + 1, end) starts with the n characters of `rest`, the tail 
+// of a literal whose first character is at `iter`.
+inline bool _MatchLiteral(typename string_type::const_iterator iter, 
+                          typename string_type::const_iterator end, 
+                          const charT *rest, size_t n)
+{
+    if (end - iter <= static_cast<string_type::difference_type>(n)) return false;
+    for (size_t i = 0; i < n; ++i) {
+        if (iter[i + 1] != rest[i]) return false;
+    }
+    return true;
+}
+
+
+// Errors raised inside nested values carry only their offset; the 
+// outermost call adds a copy of the input once, so reporting an error 
+// costs the same at any depth.
+string_type::difference_type _ParseValue(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        _ParseContext *context)
+{
+    _ParseContext local;
+    if (context == nullptr) {
+        local.base = begin;
+        context = &local;
+    }
+    auto iter = begin;
+    auto value_begin = begin;
+    bool completed = false;
+    while (iter < end) {
+        if (IsWhitespace(*iter)) {
+            goto next_iter;
+        }
+        value_begin = iter;
+        switch (*iter) {
+        case '{': 
+        case '[': {
+            if (context->depth == kMaxParseDepth) {
+                context->too_deep = true;
+                goto complete;
+            }
+            ++context->depth;
+            string_type::difference_type i;
+            try {
+                i = *iter == '{' ? _ParseObject(json, iter, end, context) : 
+                                   _ParseArray(json, iter, end, context);
+                completed = true;
+            } catch (ParseError &e) {
+                i = e.GetOffset();
+            }
+            --context->depth;
+            iter += i;
+            goto complete;
+        }
+        case '\"': {
+            string_type::difference_type i;
+            try {
+                i = _ParseString(json, iter, end);
+                completed = true;
+            } catch (ParseError &e) {
+                i = e.GetOffset();
+            }
+            iter += i;
+            goto complete;
+        }
+        case 't':
+            if (_MatchLiteral(iter, end, L"rue", 3)) {
+                json = Json(true);
+                completed = true;
+                iter += 4;
+                goto complete;
+            } else {
+                goto complete;
+            }
+        case 'f':
+            if (_MatchLiteral(iter, end, L"alse", 4)) {
+                json = Json(false);
+                completed = true;
+                iter += 5;
+                goto complete;
+            } else {
+                goto complete;
+            }
+        case 'n':
+            if (_MatchLiteral(iter, end, L"ull", 3)) {
+                json = Json(JsonValueType::Null);
+                completed = true;
+                iter += 4;
+                goto complete;
+            } else{
+                goto complete;
+            }
+        case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+        case '8': case '9': case '0': case '-': {
+            string_type::difference_type i;
+            try {
+                i = _ParseNumber(json, iter, end);
+                completed = true;
+            } catch (ParseError &e) {
+                i = e.GetOffset();
+            }
+            iter += i;
+            goto complete;
+        }
+        default:
+            goto complete;
+        }
+next_iter:
+        ++iter;
+    }
+complete:
+    if (!completed) {
+        if (context->depth) {
+            throw ParseError("invalid json value", iter - begin, string_type());
+        }
+        throw ParseError(context->too_deep ? "maximum nesting depth exceeded" : 
+                                             "invalid json value", 
+                         iter - begin, 
+                         string_type(begin, end));
+    }
+    if (context->source_map) {
+        context->source_map->Add(json, value_begin - context->base, 
+                                 iter - context->base);
+    }
+    return iter - begin;
+}
+
+
+// Parse a complete document. Errors are reported with their line and column.
+inline Json _ParseDocument(const string_type &str, _ParseContext *context)
+{
+    FJSON_TRACE_SCOPE("parse");
+    Json json;
+    try {
+        auto i = _ParseValue(json, str.cbegin(), str.cend(), context);
+        for (auto iter = str.cbegin() + i; iter < str.cend(); ++iter) {
+            if (!IsWhitespace(*iter)) {
+                throw ParseError("unexpected trailing characters", 
+                                 iter - str.cbegin(), 
+                                 string_type(str.cbegin(), str.cend()));
+            }
+        }
+    } catch (ParseError &e) {
+        SourceLocation location = GetSourceLocation(str, e.GetOffset());
+        ParseError error(std::string(e.what()) + " at line " + 
+                         std::to_string(location.line) + ", column " + 
+                         std::to_string(location.column), 
+                         e.GetOffset(), e.GetProcessedString());
+        error.SetLocation(location.line, location.column);
+        throw error;
+    }
+    return json;
+}
+
+
+Json Json::Parse(const string_type &str)
+{
+    return _ParseDocument(str, nullptr);
+}
+
+
+// Parse with a source map. `context.depth` may be preset to parse `str` as 
+// a value nested in that many containers (see Reparse()).
+inline Json _ParseDocument(const string_type &str, SourceMap &source_map, 
+                           _ParseContext &context)
+{
+    context.base = str.cbegin();
+    context.source_map = &source_map;
+    Json json = _ParseDocument(str, &context);
+    if (context.replaced_member) source_map.Retain(json);
+    return json;
+}
+
+
+Json Json::Parse(const string_type &str, SourceMap &source_map)
+{
+    _ParseContext context;
+    return _ParseDocument(str, source_map, context);
+}
+
+
+inline void _CollectNodes(const Json &json, std::vector<const void*> &nodes)
+{
+    nodes.push_back(json.GetValuePtr());
+    if (json.IsArray()) {
+        for (const auto &element: json.GetArrayRef()) _CollectNodes(element, nodes);
+    } else if (json.IsObject()) {
+        for (const auto &member: json.GetObjectRef()) {
+            _CollectNodes(member.second, nodes);
+        }
+    }
+}
+
+
+void SourceMap::Add(const Json &json, size_t begin, size_t end)
+{
+    if (sorted_ && !entries_.empty() && 
+            entries_.back().node > json.GetValuePtr()) sorted_ = false;
+    entries_.push_back(Entry{json.GetValuePtr(), Span{begin, end}});
+}
+
+
+void SourceMap::Retain(const Json &root)
+{
+    std::vector<const void*> nodes;
+    _CollectNodes(root, nodes);
+    std::sort(nodes.begin(), nodes.end());
+    // Stable, so that entries for one node stay in the order they were added.
+    std::stable_sort(entries_.begin(), entries_.end(), 
+                     [](const Entry &a, const Entry &b) { return a.node < b.node; });
+    size_t kept = 0;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (i + 1 < entries_.size() && entries_[i + 1].node == entries_[i].node) {
+            continue;
+        }
+        if (std::binary_search(nodes.begin(), nodes.end(), entries_[i].node)) {
+            entries_[kept++] = entries_[i];
+        }
+    }
+    entries_.resize(kept);
+    sorted_ = true;
+}
+
+
+bool SourceMap::Find(const Json &json, Span &span) const
+{
+    Sort();
+    const void *node = json.GetValuePtr();
+    auto iter = std::lower_bound(entries_.begin(), entries_.end(), node, 
+            [](const Entry &entry, const void *node) { return entry.node < node; });
+    if (iter == entries_.end() || iter->node != node) return false;
+    span = iter->span;
+    return true;
+}
+
+
+void SourceMap::Splice(const std::vector<const void*> &removed, 
+                       size_t old_end, size_t new_end, 
+                       const SourceMap &inserted, size_t offset)
+{
+    Sort();
+    // Look the removed nodes up and mark them; the pass below drops them.
+    std::vector<bool> dropped(entries_.size());
+    for (const void *node: removed) {
+        auto iter = std::lower_bound(entries_.begin(), entries_.end(), node, 
+                [](const Entry &entry, const void *node) { return entry.node < node; });
+        if (iter != entries_.end() && iter->node == node) {
+            dropped[iter - entries_.begin()] = true;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (dropped[i]) continue;
+        Entry &entry = entries_[i];
+        if (entry.span.begin >= old_end) {
+            entry.span.begin = entry.span.begin - old_end + new_end;
+        }
+        if (entry.span.end >= old_end) {
+            entry.span.end = entry.span.end - old_end + new_end;
+        }
+        entries_[kept++] = entry;
+    }
+    entries_.resize(kept);
+    // Both runs are sorted by node: merge them instead of sorting again.
+    inserted.Sort();
+    for (const auto &entry: inserted.entries_) {
+        entries_.push_back(Entry{entry.node, 
+                Span{entry.span.begin + offset, entry.span.end + offset}});
+    }
+    std::inplace_merge(entries_.begin(), entries_.begin() + kept, entries_.end(), 
+                       [](const Entry &a, const Entry &b) { return a.node < b.node; });
+}
+
+
+// Split an RFC 6901 JSON Pointer into its unescaped reference tokens. 
+// Returns false if it is not a pointer.
+inline bool _SplitPointer(const string_type &pointer, 
+                          std::vector<string_type> &tokens)
+{
+    size_t pos = 0;
+    while (pos < pointer.size()) {
+        if (pointer[pos] != '/') return false;
+        size_t next = pointer.find('/', pos + 1);
+        if (next == string_type::npos) next = pointer.size();
+        // Unescape ~1 to '/' and ~0 to '~'.
+        string_type token;
+        for (size_t i = pos + 1; i < next; ++i) {
+            if (pointer[i] == '~' && i + 1 < next && 
+                    (pointer[i + 1] == '0' || pointer[i + 1] == '1')) {
+                token.push_back(pointer[++i] == '0' ? '~' : '/');
+            } else {
+                token.push_back(pointer[i]);
+            }
+        }
+        tokens.push_back(std::move(token));
+        pos = next;
+    }
+    return true;
+}
+
+
+// Parse a reference token as an array index (no sign or leading zeros).
+inline bool _PointerIndex(const string_type &token, size_t &index)
+{
+    if (token.empty() || token.size() > 18 || 
+            (token.size() > 1 && token[0] == '0')) return false;
+    index = 0;
+    for (auto c: token) {
+        if (!IsDigit(c)) return false;
+        index = index * 10 + (c - '0');
+    }
+    return true;
+}
+
+
+// A change to a document's text: `removed` characters at `offset` are 
+// replaced by `inserted`.
+struct TextEdit
+{
+    size_t offset;
+    size_t removed;
+    string_type inserted;
+};
+
+
+// Apply `edit` to `text` and bring `json` and `source_map`, the result of 
+// Json::Parse(text, source_map), up to date with it. Only the smallest value 
+// whose text contains the edit is parsed again and replaced in the tree; if 
+// its new text is not a single value (the edit changed the structure around 
+// it), its parent is tried instead, and so on up to the whole document. 
+// Returns the length of the text that was parsed. Throws ParseError if the 
+// edited document is invalid, leaving the arguments unchanged; this 
+// includes nesting deeper than kMaxParseDepth, since the reparsed value is 
+// parsed at its depth in the document.
+//
+// Values outside the reparsed one keep their identity. Their spans are 
+// shifted in one pass over the source map, without any parsing.
+inline size_t Reparse(Json &json, string_type &text, SourceMap &source_map, 
+                      const TextEdit &edit)
+{
+    if (edit.offset > text.size() || edit.removed > text.size() - edit.offset) {
+        throw JsonError("edit out of range");
+    }
+    size_t edit_end = edit.offset + edit.removed;
+
+    auto contains = [&](const Json &value, SourceMap::Span &span) {
+        return source_map.Find(value, span) && 
+               span.begin <= edit.offset && edit_end <= span.end;
+    };
+    // The values whose text contains the edit, outermost first.
+    std::vector<std::pair<Json*, SourceMap::Span> > chain;
+    SourceMap::Span span;
+    Json *current = contains(json, span) ? &json : nullptr;
+    while (current != nullptr) {
+        chain.emplace_back(current, span);
+        Json *next = nullptr;
+        if (current->IsArray()) {
+            // Elements appear in text order: find the first one ending at or 
+            // after the edit. Elements added since the parse have no span 
+            // and count as ending before it.
+            auto &elements = current->GetArrayRef();
+            auto iter = std::partition_point(elements.begin(), elements.end(), 
+                    [&](const Json &element) {
+                        SourceMap::Span element_span;
+                        return !source_map.Find(element, element_span) || 
+                               element_span.end < edit_end;
+                    });
+            if (iter != elements.end() && contains(*iter, span)) next = &*iter;
+        } else if (current->IsObject()) {
+            for (auto &member: current->GetObjectRef()) {
+                if (contains(member.second, span)) {
+                    next = &member.second;
+                    break;
+                }
+            }
+        }
+        current = next;
+    }
+
+    // Edit in place; undone below if the document turns out invalid.
+    string_type replaced = text.substr(edit.offset, edit.removed);
+    text.replace(edit.offset, edit.removed, edit.inserted);
+    for (size_t k = chain.size(); k-- > 0; ) {
+        Json &target = *chain[k].first;
+        size_t begin = chain[k].second.begin;
+        size_t old_end = chain[k].second.end;
+        size_t new_end = old_end - edit.removed + edit.inserted.size();
+        SourceMap inserted;
+        Json value;
+        // chain[k] is nested in k containers.
+        _ParseContext context;
+        context.depth = k;
+        try {
+            value = _ParseDocument(text.substr(begin, new_end - begin), 
+                                   inserted, context);
+        } catch (ParseError &) {
+            // Too deep here is too deep in every parent as well.
+            if (context.too_deep) break;
+            continue;
+        }
+        std::vector<const void*> removed;
+        _CollectNodes(target, removed);
+        source_map.Splice(removed, old_end, new_end, inserted, begin);
+        target = std::move(value);
+        return new_end - begin;
+    }
+
+    // The edit is outside every value, or only the whole document can be 
+    // parsed; errors report their location in the whole document.
+    SourceMap rebuilt;
+    try {
+        json = Json::Parse(text, rebuilt);
+    } catch (...) {
+        text.replace(edit.offset, edit.inserted.size(), replaced);
+        throw;
+    }
+    source_map = std::move(rebuilt);
+    return text.size();
+}
+
+
+// All-or-nothing updates of objects and arrays. Each operation is applied 
+// at once and recorded in an undo log holding what it replaced (a handle, 
+// not a copy of the old value), so Rollback() restores the previous state 
+// in time proportional to the number of operations, and Commit() just 
+// drops the log. A transaction that is destroyed without Commit() is rolled 
+// back.
+//
+// Only changes made through the transaction are recorded: to modify a 
+// nested value, pass the nested container to it rather than modifying it 
+// through operator[]. Values replaced or removed must not be modified in 
+// place before the transaction ends, since rollback puts them back as they 
+// are.
+class Transaction
+{
+public:
+    Transaction() {}
+    ~Transaction()
+    {
+        if (!log_.empty()) Rollback();
+    }
+    Transaction(const Transaction&) = delete;
+    Transaction& operator= (const Transaction&) = delete;
+
+    // Set a member of an object, adding it if absent.
+    void Set(Json &object, const string_type &key, Json value)
+    {
+        auto &members = object.GetObjectRef();
+        auto iter = members.find(_MemberKey(key));
+        bool existed = iter != members.end() && iter->second.IsValid();
+        Record(kSetMember, object, key, 0, 
+               existed ? iter->second : Json(), existed);
+        if (iter != members.end()) iter->second = std::move(value);
+        else Apply([&]() { members.emplace(key, std::move(value)); });
+    }
+
+    // Remove a member of an object. Returns false if it was absent.
+    bool Erase(Json &object, const string_type &key)
+    {
+        auto &members = object.GetObjectRef();
+        auto iter = members.find(_MemberKey(key));
+        if (iter == members.end()) return false;
+        bool existed = iter->second.IsValid();
+        Record(kEraseMember, object, key, 0, iter->second, existed);
+        members.erase(iter);
+        return existed;
+    }
+
+    // Replace an element of an array.
+    void Set(Json &array, size_t index, Json value)
+    {
+        auto &elements = array.GetArrayRef();
+        CheckIndex(index, elements.size());
+        Record(kSetElement, array, string_type(), index, elements[index], true);
+        elements[index] = std::move(value);
+    }
+
+    void PushBack(Json &array, Json value)
+    {
+        auto &elements = array.GetArrayRef();
+        Record(kPushBack, array, string_type(), 0, Json(), false);
+        Apply([&]() { elements.push_back(std::move(value)); });
+    }
+
+    void PopBack(Json &array)
+    {
+        auto &elements = array.GetArrayRef();
+        if (elements.empty()) throw JsonError("PopBack() on an empty array");
+        Record(kPopBack, array, string_type(), 0, elements.back(), true);
+        elements.pop_back();
+    }
+
+    // Insert before position `index` (which may be the size).
+    void InsertAt(Json &array, size_t index, Json value)
+    {
+        auto &elements = array.GetArrayRef();
+        CheckIndex(index, elements.size() + 1);
+        Record(kInsertAt, array, string_type(), index, Json(), false);
+        Apply([&]() { elements.insert(elements.begin() + index, std::move(value)); });
+    }
+
+    void EraseAt(Json &array, size_t index)
+    {
+        auto &elements = array.GetArrayRef();
+        CheckIndex(index, elements.size());
+        Record(kEraseAt, array, string_type(), index, elements[index], true);
+        elements.erase(elements.begin() + index);
+    }
+
+    // Keep the changes.
+    void Commit()
+    {
+        log_.clear();
+    }
+
+    // Undo the changes, most recent first.
+    void Rollback()
+    {
+        for (size_t i = log_.size(); i-- > 0; ) Undo(log_[i]);
+        log_.clear();
+    }
+
+    // Number of operations recorded.
+    size_t size() const { return log_.size(); }
+
+private:
+    enum Operation: unsigned char {
+        kSetMember, kEraseMember, kSetElement, kPushBack, kPopBack, 
+        kInsertAt, kEraseAt, 
+    };
+
+    struct _Undo
+    {
+        Operation operation;
+        // Keeps the container alive until the transaction ends.
+        Json container;
+        string_type key;
+        size_t index;
+        Json previous;
+        bool existed;
+    };
+
+    void Record(Operation operation, const Json &container, string_type key, 
+                size_t index, Json previous, bool existed)
+    {
+        log_.push_back(_Undo{operation, container, std::move(key), index, 
+                             std::move(previous), existed});
+    }
+
+    // Run an operation that may throw after its undo entry was recorded. If 
+    // it throws it did not happen, so the entry is dropped again.
+    template <typename Function>
+    void Apply(Function function)
+    {
+        try {
+            function();
+        } catch (...) {
+            log_.pop_back();
+            throw;
+        }
+    }
+
+    static void CheckIndex(size_t index, size_t limit)
+    {
+        if (index >= limit) throw JsonError("array index out of range");
+    }
+
+    static void Undo(_Undo &undo)
+    {
+        switch (undo.operation) {
+        case kSetMember:
+        case kEraseMember: {
+            auto &members = undo.container.GetObjectRef();
+            if (undo.existed) members[undo.key] = std::move(undo.previous);
+            else members.erase(undo.key);
+            break;
+        }
+        case kSetElement:
+            undo.container.GetArrayRef()[undo.index] = std::move(undo.previous);
+            break;
+        case kPushBack:
+            undo.container.GetArrayRef().pop_back();
+            break;
+        case kPopBack:
+            undo.container.GetArrayRef().push_back(std::move(undo.previous));
+            break;
+        case kInsertAt: {
+            auto &elements = undo.container.GetArrayRef();
+            elements.erase(elements.begin() + undo.index);
+            break;
+        }
+        case kEraseAt: {
+            auto &elements = undo.container.GetArrayRef();
+            elements.insert(elements.begin() + undo.index, std::move(undo.previous));
+            break;
+        }
+        }
+    }
+
+    std::vector<_Undo> log_;
+};
+
+
+// A document with multi-version concurrency control: any number of readers 
+// and one writer at a time. A reader pins the current version with Read() 
+// and sees it unchanged however long it holds the snapshot; pinning is an 
+// atomic shared_ptr load, and readers never wait for the writer. The writer 
+// copies only the containers on the paths it modifies (path copying), so 
+// each version shares every unmodified subtree with the previous one, and 
+// Publish() swaps the new root in atomically. A version's nodes are freed 
+// when no snapshot and no later version refers to them any more.
+//
+// Snapshots must be read through the const interface only; DumpCached() 
+// counts as const, since the writer never modifies the nodes it shares.
+class VersionedDocument
+{
+    struct _Version
+    {
+        Json root;
+        uint64_t number;
+    };
+
+public:
+    explicit VersionedDocument(Json root = Json(JsonValueType::Object)): 
+            current_(std::make_shared<const _Version>(
+                    _Version{std::move(root), 1})) {}
+    VersionedDocument(const VersionedDocument&) = delete;
+    VersionedDocument& operator= (const VersionedDocument&) = delete;
+
+    // A pinned version.
+    class Snapshot
+    {
+    public:
+        const Json& Root() const { return version_->root; }
+        uint64_t Version() const { return version_->number; }
+
+    private:
+        friend class VersionedDocument;
+        explicit Snapshot(std::shared_ptr<const _Version> version): 
+                version_(std::move(version)) {}
+
+        std::shared_ptr<const _Version> version_;
+    };
+
+    // Exclusive access for building new versions. Edits are invisible to 
+    // readers until Publish(); edits not published when the writer is 
+    // destroyed are discarded.
+    class Writer
+    {
+    public:
+        Writer(Writer&&) = default;
+
+        // The value at JSON Pointer `pointer`, made private to this writer: 
+        // it and every container above it are copied (containers shallowly, 
+        // sharing their elements) unless this writer already copied them 
+        // since the last Publish(). The returned value may be assigned or 
+        // modified; if it is a container, the values below it are still 
+        // shared and must be reached through Edit() to be modified.
+        Json& Edit(const string_type &pointer)
+        {
+            std::vector<string_type> tokens;
+            if (!_SplitPointer(pointer, tokens)) {
+                throw JsonError("invalid JSON pointer");
+            }
+            Json *current = &MakePrivate(root_);
+            for (const auto &token: tokens) {
+                Json *child = nullptr;
+                if (current->IsObject()) {
+                    auto &members = current->GetObjectRef();
+                    auto iter = members.find(token);
+                    if (iter != members.end() && iter->second.IsValid()) {
+                        child = &iter->second;
+                    }
+                } else if (current->IsArray()) {
+                    auto &elements = current->GetArrayRef();
+                    size_t index;
+                    if (_PointerIndex(token, index) && index < elements.size()) {
+                        child = &elements[index];
+                    }
+                }
+                if (child == nullptr) {
+                    throw JsonError("JSON pointer does not resolve");
+                }
+                current = &MakePrivate(*child);
+            }
+            return *current;
+        }
+
+        // Set the member or element at `pointer`, adding an object member 
+        // if absent; "-" as the last token appends to an array.
+        void Set(const string_type &pointer, Json value)
+        {
+            string_type token;
+            Json &parent = EditParent(pointer, token);
+            if (parent.IsObject()) {
+                parent.GetObjectRef()[token] = std::move(value);
+            } else if (parent.IsArray() && token == L"-") {
+                parent.GetArrayRef().push_back(std::move(value));
+            } else {
+                ElementAt(parent, token) = std::move(value);
+            }
+        }
+
+        // Remove the member or element at `pointer`. Returns false if absent.
+        bool Erase(const string_type &pointer)
+        {
+            string_type token;
+            Json &parent = EditParent(pointer, token);
+            if (parent.IsObject()) {
+                return parent.GetObjectRef().erase(token) > 0;
+            }
+            auto &elements = parent.GetArrayRef();
+            size_t index;
+            if (!_PointerIndex(token, index) || index >= elements.size()) {
+                return false;
+            }
+            elements.erase(elements.begin() + index);
+            return true;
+        }
+
+        // The version being built.
+        const Json& Root() const { return root_; }
+
+        // Make the edits visible to new readers; returns the new version 
+        // number. The writer may go on to build the next version.
+        uint64_t Publish()
+        {
+            auto version = std::make_shared<const _Version>(
+                    _Version{root_, document_->Read().Version() + 1});
+            std::atomic_store(&document_->current_, version);
+            // Everything built so far is now shared with readers.
+            private_.clear();
+            return version->number;
+        }
+
+    private:
+        friend class VersionedDocument;
+        explicit Writer(VersionedDocument &document): 
+                document_(&document), lock_(document.writer_mutex_), 
+                root_(document.Read().Root()) {}
+
+        // Strings are copied too, since they can be modified in place; 
+        // other scalars can only be replaced.
+        Json& MakePrivate(Json &json)
+        {
+            if (!json.IsArray() && !json.IsObject() && !json.IsString()) {
+                return json;
+            }
+            if (private_.count(json.GetValuePtr())) return json;
+            const Json &source = json;
+            Json copy(json.GetType());
+            if (json.IsArray()) {
+                copy.GetArrayRef() = source.GetArrayRef();
+            } else if (json.IsObject()) {
+                copy.GetObjectRef() = source.GetObjectRef();
+            } else {
+                copy = Json(source.GetStringRef());
+            }
+            private_.insert(copy.GetValuePtr());
+            json = std::move(copy);
+            return json;
+        }
+
+        Json& EditParent(const string_type &pointer, string_type &token)
+        {
+            size_t slash = pointer.rfind('/');
+            if (slash == string_type::npos) throw JsonError("invalid JSON pointer");
+            std::vector<string_type> tokens;
+            if (!_SplitPointer(pointer.substr(slash), tokens)) {
+                throw JsonError("invalid JSON pointer");
+            }
+            token = std::move(tokens[0]);
+            Json &parent = Edit(pointer.substr(0, slash));
+            if (!parent.IsObject() && !parent.IsArray()) {
+                throw JsonError("JSON pointer does not resolve");
+            }
+            return parent;
+        }
+
+        static Json& ElementAt(Json &array, const string_type &token)
+        {
+            auto &elements = array.GetArrayRef();
+            size_t index;
+            if (!_PointerIndex(token, index) || index >= elements.size()) {
+                throw JsonError("JSON pointer does not resolve");
+            }
+            return elements[index];
+        }
+
+        VersionedDocument *document_;
+        std::unique_lock<std::mutex> lock_;
+        Json root_;
+        // Containers copied by this writer since the last Publish().
+        std::unordered_set<const JsonValue*> private_;
+    };
+
+    Snapshot Read() const
+    {
+        return Snapshot(std::atomic_load(&current_));
+    }
+
+    // Waits for the current writer, if any, to be destroyed.
+    Writer Write()
+    {
+        return Writer(*this);
+    }
+
+private:
+    std::shared_ptr<const _Version> current_;
+    std::mutex writer_mutex_;
+};
+
+
+Json Json::Parse(const char *data, size_t size)
+{
+    string_type str;
+    {
+        FJSON_TRACE_SCOPE("decode utf-8");
+        _AppendUtf8(str, data, size);
+    }
+    return Parse(str);
+}
+
+
+// Length of the longest prefix of data[0, size) that does not end inside a 
+// UTF-8 multi-byte sequence.
+inline size_t _Utf8CompletePrefix(const char *data, size_t size)
+{
+    const auto *p = reinterpret_cast<const unsigned char*>(data);
+    // A sequence is at most 4 bytes, so only the last 3 bytes can start an 
+    // incomplete one.
+    for (size_t back = 1; back <= 3 && back <= size; ++back) {
+        unsigned char c = p[size - back];
+        if ((c & 0xc0) == 0x80) continue;
+        size_t length = c < 0x80 ? 1 : (c & 0xe0) == 0xc0 ? 2 : 
+                        (c & 0xf0) == 0xe0 ? 3 : 4;
+        return length > back ? size - back : size;
+    }
+    return size;
+}
+
+
+Json Json::Parse(InputSource &source)
+{
+    string_type str;
+    {
+        FJSON_TRACE_SCOPE("read input");
+        std::vector<char> buffer(kInputChunkSize);
+        size_t carry = 0;
+        while (size_t n = source.Read(buffer.data() + carry, buffer.size() - carry)) {
+            size_t total = carry + n;
+            size_t complete = _Utf8CompletePrefix(buffer.data(), total);
+            _AppendUtf8(str, buffer.data(), complete);
+            // Keep a split multi-byte sequence for the next chunk.
+            carry = total - complete;
+            std::memmove(buffer.data(), buffer.data() + complete, carry);
+        }
+        _AppendUtf8(str, buffer.data(), carry);
+    }
+    return Parse(str);
+}
+
+
+Json Json::Parse(std::istream &stream)
+{
+    IstreamSource source(stream);
+    return Parse(source);
+}
+
+
+// Reads a sequence of JSON values (NDJSON, or values simply concatenated 
+// with optional whitespace) from an InputSource, one value at a time. 
+// Input is read in chunks into a buffer that is compacted as values are 
+// consumed, so memory stays bounded by the largest single value rather 
+// than the whole stream.
+class JsonStreamReader
+{
+public:
+    explicit JsonStreamReader(InputSource &source, 
+                              size_t chunk_size = kInputChunkSize):
+            source_(source), chunk_size_(chunk_size), buffer_(chunk_size) {}
+
+    // Parse the next value into `json`. Returns false at end of input.
+    bool Next(Json &json)
+    {
+        size_t end;
+        while (!FindValueEnd(end)) {
+            if (!Fill()) {
+                if (!started_) return false;
+                if (depth_ || in_string_) {
+                    throw ParseError("unexpected end of input", 
+                                     consumed_ + (end_ - begin_), string_type());
+                }
+                // A scalar value ends at end of input.
+                end = end_;
+                break;
+            }
+        }
+        json = Json::Parse(buffer_.data() + begin_, end - begin_);
+        consumed_ += end - begin_;
+        begin_ = scan_ = end;
+        started_ = false;
+        return true;
+    }
+
+    // Bytes consumed by the values returned so far.
+    size_t GetOffset() const { return consumed_; }
+
+private:
+    // Advance the scanner over buffered input. Returns true with `end` set 
+    // once the current value is complete.
+    bool FindValueEnd(size_t &end)
+    {
+        const char *data = buffer_.data();
+        for (; scan_ < end_; ++scan_) {
+            char c = data[scan_];
+            if (!started_) {
+                if (IsWhitespace(c)) {
+                    ++begin_;
+                    ++consumed_;
+                    continue;
+                }
+                started_ = true;
+                scalar_ = c != '[' && c != '{' && c != '\"';
+            }
+            if (in_string_) {
+                if (escaped_) escaped_ = false;
+                else if (c == '\\') escaped_ = true;
+                else if (c == '\"') {
+                    in_string_ = false;
+                    if (depth_ == 0) {
+                        end = scan_ + 1;
+                        return true;
+                    }
+                }
+            } else if (scalar_) {
+                if (IsWhitespace(c) || c == '[' || c == '{' || c == '\"') {
+                    end = scan_;
+                    return true;
+                }
+            } else if (c == '\"') {
+                in_string_ = true;
+            } else if (c == '[' || c == '{') {
+                ++depth_;
+            } else if (c == ']' || c == '}') {
+                if (depth_ == 0 || --depth_ == 0) {
+                    end = scan_ + 1;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Read another chunk. Consumed bytes are dropped from the front first; 
+    // the buffer only grows when a single value does not fit.
+    bool Fill()
+    {
+        if (begin_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            scan_ -= begin_;
+            begin_ = 0;
+        }
+        if (buffer_.size() - end_ < chunk_size_) {
+            buffer_.resize(std::max(buffer_.size() * 2, end_ + chunk_size_));
+        }
+        size_t n = source_.Read(buffer_.data() + end_, buffer_.size() - end_);
+        end_ += n;
+        return n > 0;
+    }
+
+    InputSource &source_;
+    size_t chunk_size_;
+    std::vector<char> buffer_;
+    // buffer_[begin_, end_) holds unconsumed input, scanned up to scan_.
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    size_t scan_ = 0;
+    size_t consumed_ = 0;
+    size_t depth_ = 0;
+    bool started_ = false;
+    bool scalar_ = false;
+    bool in_string_ = false;
+    bool escaped_ = false;
+};
+
+
+// Append a UTF-16 code unit sequence as UTF-8, combining surrogate pairs.
+inline void _AppendUtf16AsUtf8(std::string &out, const charT *begin, 
+                               const charT *end)
+{
+    for (const charT *p = begin; p < end; ++p) {
+        unsigned long c = static_cast<unsigned long>(*p);
+        if (c >= 0xd800 && c < 0xdc00 && p + 1 < end && 
+                p[1] >= 0xdc00 && p[1] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (p[1] - 0xdc00);
+            ++p;
+        }
+        if (c < 0x80) {
+            out.push_back(static_cast<char>(c));
+        } else if (c < 0x800) {
+            out.push_back(static_cast<char>(0xc0 | (c >> 6)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        } else if (c < 0x10000) {
+            out.push_back(static_cast<char>(0xe0 | (c >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        } else {
+            out.push_back(static_cast<char>(0xf0 | (c >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+    }
+}
+
+
+inline void _AppendQuoted(std::string &out, const string_type &str)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('\"');
+    const charT *run = str.data();
+    const charT *end = str.data() + str.size();
+    for (const charT *p = run; p < end; ++p) {
+        charT c = *p;
+        if (c >= 0x20 && c != '\"' && c != '\\') continue;
+        // Copy the run of characters that need no escaping in one go.
+        _AppendUtf16AsUtf8(out, run, p);
+        run = p + 1;
+        out.push_back('\\');
+        switch (c) {
+        case '\"': out.push_back('\"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '\b': out.push_back('b'); break;
+        case '\f': out.push_back('f'); break;
+        case '\n': out.push_back('n'); break;
+        case '\r': out.push_back('r'); break;
+        case '\t': out.push_back('t'); break;
+        default:
+            out += "u00";
+            out.push_back(hex[(c >> 4) & 0xf]);
+            out.push_back(hex[c & 0xf]);
+        }
+    }
+    _AppendUtf16AsUtf8(out, run, end);
+    out.push_back('\"');
+}
+
+
+// Append string text that needs no escaping, between quotes.
+inline void _AppendVerbatim(std::string &out, const string_type &text)
+{
+    out.push_back('\"');
+    _AppendUtf16AsUtf8(out, text.data(), text.data() + text.size());
+    out.push_back('\"');
+}
+
+
+// Shortest of %.15g / %.17g that round-trips; integers are written without 
+// an exponent. JSON has no representation for NaN or infinity, so those 
+// are written as null.
+inline void _AppendNumber(std::string &out, double value)
+{
+    FJSON_TRACE_SCOPE("number formatting");
+    char buffer[32];
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    if (value == std::floor(value) && std::fabs(value) < 1e15) {
+        std::snprintf(buffer, sizeof(buffer), "%.0f", value);
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+        if (std::strtod(buffer, nullptr) != value) {
+            std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+        }
+    }
+    out += buffer;
+}
+
+
+inline void _AppendNewline(std::string &out, int indent, int level)
+{
+    if (indent < 0) return;
+    out.push_back('\n');
+    out.append(static_cast<size_t>(indent) * level, ' ');
+}
+
+
+inline std::atomic<size_t>& _PrefetchDistanceRef()
+{
+    static std::atomic<size_t> distance{4};
+    return distance;
+}
+
+
+// How many children ahead Dump, Compare and Select prefetch the nodes of 
+// arrays and objects they walk; 0 disables prefetching. Nodes of a freshly 
+// parsed document sit in allocation order and gain little, documents whose 
+// nodes are scattered by sorting or editing gain the most. 
+inline size_t GetPrefetchDistance()
+{
+    return _PrefetchDistanceRef().load(std::memory_order_relaxed);
+}
+
+
+inline void SetPrefetchDistance(size_t distance)
+{
+    _PrefetchDistanceRef().store(distance, std::memory_order_relaxed);
+}
+
+
+inline void _PrefetchElement(const _ArrayContainer &elements, size_t i, 
+                             size_t distance)
+{
+    if (distance && i + distance < elements.size()) {
+        FJSON_PREFETCH(elements[i + distance].GetValuePtr());
+    }
+}
+
+
+// Runs `distance` members ahead of a walk over an object and prefetches 
+// their value nodes. Call Next() once per member visited.
+class _MemberPrefetcher
+{
+public:
+    _MemberPrefetcher(const _ObjectContainer &members, size_t distance): 
+            ahead_(members.cbegin()), end_(members.cend())
+    {
+        for (size_t i = 0; i < distance; ++i) Next();
+    }
+
+    void Next()
+    {
+        if (ahead_ == end_) return;
+        FJSON_PREFETCH(ahead_->second.GetValuePtr());
+        ++ahead_;
+    }
+private:
+    _ObjectContainer::const_iterator ahead_, end_;
+};
+
+
+constexpr size_t kDumpCacheMinSize = 64;
+
+
+inline _DumpCache* _GetDumpCache(const Json &json)
+{
+    return _GetDumpCache(json.GetValuePtr());
+}
+
+
+// Append the cached text of a container if it is valid for this 
+// indentation. Compact text does not depend on the nesting level.
+inline bool _DumpFromCache(const Json &json, std::string &out, int indent, 
+                           int level)
+{
+    _DumpCache *cache = _GetDumpCache(json);
+    std::lock_guard<_NodeLock> guard(cache->lock);
+    if (!cache->valid.load(std::memory_order_relaxed) || 
+            cache->indent != indent || (indent >= 0 && cache->level != level)) {
+        return false;
+    }
+    out += cache->bytes;
+    return true;
+}
+
+
+inline void _StoreDumpCache(const Json &json, const std::string &out, 
+                            size_t start, int indent, int level)
+{
+    if (out.size() - start < kDumpCacheMinSize) return;
+    _DumpCache *cache = _GetDumpCache(json);
+    std::lock_guard<_NodeLock> guard(cache->lock);
+    cache->bytes.assign(out, start, std::string::npos);
+    cache->indent = indent;
+    cache->level = level;
+    cache->valid.store(true, std::memory_order_relaxed);
+}
+
+
+// Record `parent` as a container whose cached text may include the text 
+// of `child`, so that changing the child invalidates the parent's cache.
+inline void _RegisterDumpParent(const Json &child, const Json &parent)
+{
+    _DumpCache *cache = _GetDumpCache(child);
+    if (cache == nullptr) return;
+    const auto &node = _ValueHandle(parent);
+    std::lock_guard<_NodeLock> guard(cache->lock);
+    if (!cache->parents) {
+        cache->parents = std::make_unique<std::vector<std::weak_ptr<JsonValue>>>();
+    }
+    auto &parents = *cache->parents;
+    for (size_t i = 0; i < parents.size(); ) {
+        if (parents[i].expired()) {
+            parents[i] = std::move(parents.back());
+            parents.pop_back();
+            continue;
+        }
+        if (!parents[i].owner_before(node) && !node.owner_before(parents[i])) {
+            return;
+        }
+        ++i;
+    }
+    parents.emplace_back(node);
+    cache->has_parents.store(true, std::memory_order_relaxed);
+}
+
+
+void _Dump(const Json &json, std::string &out, int indent, int level, 
+           bool cached = false)
+{
+    switch (json.GetType()) {
+    case JsonValueType::Number:
+        _AppendNumber(out, json.ToDouble());
+        break;
+    case JsonValueType::True:
+        out += "true";
+        break;
+    case JsonValueType::False:
+        out += "false";
+        break;
+    case JsonValueType::String:
+        if (const string_type *verbatim = json.GetVerbatimString()) {
+            _AppendVerbatim(out, *verbatim);
+        } else if (!static_cast<const JsonString*>(json.GetValuePtr())->WriteEscaped(
+                [&out](const string_type &text) { _AppendVerbatim(out, text); })) {
+            _AppendQuoted(out, json.GetStringRef());
+        }
+        break;
+    case JsonValueType::Array: {
+        if (cached && _DumpFromCache(json, out, indent, level)) break;
+        size_t start = out.size();
+        const auto &elements = json.GetArrayRef();
+        size_t distance = GetPrefetchDistance();
+        out.push_back('[');
+        for (Json::size_type i = 0; i < elements.size(); ++i) {
+            _PrefetchElement(elements, i, distance);
+            if (i) out.push_back(',');
+            _AppendNewline(out, indent, level + 1);
+            if (cached) _RegisterDumpParent(elements[i], json);
+            _Dump(elements[i], out, indent, level + 1, cached);
+        }
+        if (!elements.empty()) _AppendNewline(out, indent, level);
+        out.push_back(']');
+        if (cached) _StoreDumpCache(json, out, start, indent, level);
+        break;
+    }
+    case JsonValueType::Object: {
+        if (cached && _DumpFromCache(json, out, indent, level)) break;
+        size_t start = out.size();
+        out.push_back('{');
+        bool first = true;
+        _MemberPrefetcher prefetcher(json.GetObjectRef(), GetPrefetchDistance());
+        for (const auto &member: json.GetObjectRef()) {
+            prefetcher.Next();
+            // Placeholders left behind by lookups are not members.
+            if (!member.second.IsValid()) continue;
+            if (!first) out.push_back(',');
+            first = false;
+            _AppendNewline(out, indent, level + 1);
+            _AppendQuoted(out, member.first);
+            out += indent < 0 ? ":" : ": ";
+            if (cached) _RegisterDumpParent(member.second, json);
+            _Dump(member.second, out, indent, level + 1, cached);
+        }
+        if (!first) _AppendNewline(out, indent, level);
+        out.push_back('}');
+        if (cached) _StoreDumpCache(json, out, start, indent, level);
+        break;
+    }
+    default:
+        // Null, and invalid values inside arrays.
+        out += "null";
+    }
+}
+
+
+void Json::Dump(std::string &out, int indent) const
+{
+    FJSON_TRACE_SCOPE("dump");
+    _Dump(*this, out, indent, 0);
+}
+
+
+std::string Json::Dump(int indent) const
+{
+    std::string out;
+    Dump(out, indent);
+    return out;
+}
+
+
+void Json::DumpCached(std::string &out, int indent) const
+{
+    FJSON_TRACE_SCOPE("dump cached");
+    _Dump(*this, out, indent, 0, true);
+}
+
+
+std::string Json::DumpCached(int indent) const
+{
+    std::string out;
+    DumpCached(out, indent);
+    return out;
+}
+
+
+void Json::ClearDumpCache() const
+{
+    _DumpCache *cache = _GetDumpCache(*this);
+    if (cache == nullptr) return;
+    {
+        std::lock_guard<_NodeLock> guard(cache->lock);
+        cache->valid.store(false, std::memory_order_relaxed);
+        std::string().swap(cache->bytes);
+    }
+    if (IsArray()) {
+        for (const auto &element: GetArrayRef()) element.ClearDumpCache();
+    } else {
+        for (const auto &member: GetObjectRef()) member.second.ClearDumpCache();
+    }
+}
+
+
+const Json* Json::FindPointer(const string_type &pointer) const
+{
+    std::vector<string_type> tokens;
+    if (!_SplitPointer(pointer, tokens)) return nullptr;
+    const Json *current = this;
+    for (const auto &token: tokens) {
+        if (current->IsObject()) {
+            current = current->Find(token);
+        } else if (current->IsArray()) {
+            size_t index;
+            if (!_PointerIndex(token, index)) return nullptr;
+            const auto &elements = current->GetArrayRef();
+            if (index >= elements.size()) return nullptr;
+            current = &elements[index];
+        } else {
+            return nullptr;
+        }
+        if (current == nullptr) return nullptr;
+    }
+    return current;
+}
+
+
+// Evaluate a JSONPath expression against `json`. The supported subset is 
+// the root `$`, member access `.name` and `['name']`, array indices `[n]` 
+// (negative counts from the end), wildcards `.*` and `[*]`, and recursive 
+// descent `..name` / `..*`.
+inline std::vector<const Json*> Select(const Json &json, const string_type &path)
+{
+    auto fail = [&](size_t pos) {
+        return ParseError("invalid json path", pos, string_type(path));
+    };
+    std::vector<const Json*> current{&json}, next;
+    size_t pos = 0;
+    if (pos < path.size() && path[pos] == '$') ++pos;
+
+    // Append all children of `value` (or all its descendants) to `out`.
+    std::function<void(const Json*, bool, std::vector<const Json*>&)> 
+            add_children = [&](const Json *value, bool recursive, 
+                               std::vector<const Json*> &out) {
+        size_t distance = recursive ? GetPrefetchDistance() : 0;
+        if (value->IsArray()) {
+            const auto &elements = value->GetArrayRef();
+            for (size_t i = 0; i < elements.size(); ++i) {
+                _PrefetchElement(elements, i, distance);
+                out.push_back(&elements[i]);
+                if (recursive) add_children(&elements[i], true, out);
+            }
+        } else if (value->IsObject()) {
+            _MemberPrefetcher prefetcher(value->GetObjectRef(), distance);
+            for (const auto &member: value->GetObjectRef()) {
+                prefetcher.Next();
+                if (!member.second.IsValid()) continue;
+                out.push_back(&member.second);
+                if (recursive) add_children(&member.second, true, out);
+            }
+        }
+    };
+
+    while (pos < path.size()) {
+        next.clear();
+        bool recursive = false;
+        bool wildcard = false;
+        bool has_index = false;
+        long index = 0;
+        string_type name;
+        if (path[pos] == '.') {
+            ++pos;
+            if (pos < path.size() && path[pos] == '.') {
+                recursive = true;
+                ++pos;
+            }
+            size_t start = pos;
+            while (pos < path.size() && path[pos] != '.' && path[pos] != '[') {
+                ++pos;
+            }
+            name = path.substr(start, pos - start);
+            if (name.empty()) throw fail(pos);
+            wildcard = name == L"*";
+        } else if (path[pos] == '[') {
+            size_t close = path.find(']', pos);
+            if (close == string_type::npos) throw fail(pos);
+            string_type inner = path.substr(pos + 1, close - pos - 1);
+            pos = close + 1;
+            if (inner == L"*") {
+                wildcard = true;
+            } else if (inner.size() >= 2 && 
+                       (inner[0] == '\'' || inner[0] == '\"') && 
+                       inner.back() == inner[0]) {
+                name = inner.substr(1, inner.size() - 2);
+            } else {
+                size_t consumed = 0;
+                try {
+                    index = std::stol(_ToStdString(inner), &consumed);
+                } catch (std::exception &) {
+                    throw fail(pos);
+                }
+                if (consumed != inner.size()) throw fail(pos);
+                has_index = true;
+            }
+        } else {
+            throw fail(pos);
+        }
+
+        for (const Json *value: current) {
+            if (wildcard) {
+                add_children(value, recursive, next);
+                continue;
+            }
+            std::vector<const Json*> scope{value};
+            if (recursive) add_children(value, true, scope);
+            for (const Json *candidate: scope) {
+                if (has_index && candidate->IsArray()) {
+                    long size = static_cast<long>(candidate->size());
+                    long i = index < 0 ? index + size : index;
+                    if (0 <= i && i < size) {
+                        next.push_back(&candidate->GetArrayRef()[i]);
+                    }
+                } else if (!has_index) {
+                    const Json *member = candidate->Find(name);
+                    if (member != nullptr && member->IsValid()) {
+                        next.push_back(member);
+                    }
+                }
+            }
+        }
+        std::swap(current, next);
+    }
+    return current;
+}
+
+
+// Check one UTF-8 multi-byte sequence starting at `p`. Returns the position 
+// after it, or nullptr if it is malformed. The second byte is checked 
+// against the ranges of RFC 3629, section 4, which exclude overlong forms 
+// (E0 80..9F, F0 80..8F), UTF-16 surrogates (ED A0..BF) and code points 
+// above U+10FFFF (F4 90..BF).
+inline const unsigned char* _ValidateUtf8Sequence(const unsigned char *p, 
+                                                  const unsigned char *end)
+{
+    int extra;
+    unsigned char low = 0x80, high = 0xbf;
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        extra = 1;
+    } else if (*p >= 0xe0 && *p <= 0xef) {
+        extra = 2;
+        if (*p == 0xe0) low = 0xa0;
+        else if (*p == 0xed) high = 0x9f;
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+        extra = 3;
+        if (*p == 0xf0) low = 0x90;
+        else if (*p == 0xf4) high = 0x8f;
+    } else {
+        return nullptr;
+    }
+    if (end - p <= extra) return nullptr;
+    if (p[1] < low || p[1] > high) return nullptr;
+    for (int i = 2; i <= extra; ++i) {
+        if ((p[i] & 0xc0) != 0x80) return nullptr;
+    }
+    return p + extra + 1;
+}
+
+
+// Check that data[0, size) is exactly one well-formed JSON value (with 
+// optional surrounding whitespace) encoded in UTF-8. This runs the grammar 
+// only: no Json value or string is created, and nesting is tracked with an 
+// explicit stack rather than recursion, though limited to kMaxParseDepth 
+// like Parse(). On failure the offset of the offending byte is stored in 
+// `error_offset` if given.
+//
+// This is a second implementation of the grammar, not the parser run 
+// without building values, so a change to what Parse() accepts has to be 
+// made here too. It is stricter about UTF-8 than Parse(), whose decoder 
+// does not reject overlong forms or encoded surrogates.
+inline bool IsValid(const char *data, size_t size, size_t *error_offset = nullptr)
+{
+    const auto *p = reinterpret_cast<const unsigned char*>(data);
+    const auto *end = p + size;
+    // '[' or '{' for every open container.
+    std::string stack;
+
+    auto skip_whitespace = [&]() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+            ++p;
+        }
+    };
+    // Scan a string starting at its opening quote.
+    auto scan_string = [&]() {
+        ++p;
+        while (p < end) {
+            unsigned char c = *p;
+            if (c == '\"') {
+                ++p;
+                return true;
+            } else if (c == '\\') {
+                if (++p == end) return false;
+                switch (*p) {
+                case '\"': case '\\': case '/': case 'b': 
+                case 'f': case 'n': case 'r': case 't':
+                    ++p;
+                    break;
+                case 'u':
+                    if (end - p <= 4 || !IsHexDigit(p[1]) || !IsHexDigit(p[2]) || 
+                            !IsHexDigit(p[3]) || !IsHexDigit(p[4])) return false;
+                    p += 5;
+                    break;
+                default:
+                    return false;
+                }
+            } else if (IsControlChar(c)) {
+                return false;
+            } else if (c < 0x80) {
+                ++p;
+            } else {
+                const unsigned char *next = _ValidateUtf8Sequence(p, end);
+                if (next == nullptr) return false;
+                p = next;
+            }
+        }
+        return false;
+    };
+    auto scan_digits = [&]() {
+        const unsigned char *start = p;
+        while (p < end && IsDigit(*p)) ++p;
+        return p > start;
+    };
+    auto scan_number = [&]() {
+        if (*p == '-') ++p;
+        if (p == end) return false;
+        if (*p == '0') {
+            ++p;
+        } else if (!scan_digits()) {
+            return false;
+        }
+        if (p < end && *p == '.') {
+            ++p;
+            if (!scan_digits()) return false;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            if (p < end && (*p == '+' || *p == '-')) ++p;
+            if (!scan_digits()) return false;
+        }
+        return true;
+    };
+    auto scan_literal = [&](const char *literal, size_t length) {
+        if (static_cast<size_t>(end - p) < length || 
+                std::memcmp(p, literal, length) != 0) return false;
+        p += length;
+        return true;
+    };
+    // Scan `"key" :` inside an object.
+    auto scan_key = [&]() {
+        skip_whitespace();
+        if (p == end || *p != '\"' || !scan_string()) return false;
+        skip_whitespace();
+        if (p == end || *p != ':') return false;
+        ++p;
+        return true;
+    };
+
+value:
+    skip_whitespace();
+    if (p == end) goto fail;
+    switch (*p) {
+    case '{':
+        if (stack.size() == kMaxParseDepth) goto fail;
+        stack.push_back('{');
+        ++p;
+        skip_whitespace();
+        if (p < end && *p == '}') {
+            ++p;
+            stack.pop_back();
+            goto after_value;
+        }
+        if (!scan_key()) goto fail;
+        goto value;
+    case '[':
+        if (stack.size() == kMaxParseDepth) goto fail;
+        stack.push_back('[');
+        ++p;
+        skip_whitespace();
+        if (p < end && *p == ']') {
+            ++p;
+            stack.pop_back();
+            goto after_value;
+        }
+        goto value;
+    case '\"':
+        if (!scan_string()) goto fail;
+        goto after_value;
+    case 't':
+        if (!scan_literal("true", 4)) goto fail;
+        goto after_value;
+    case 'f':
+        if (!scan_literal("false", 5)) goto fail;
+        goto after_value;
+    case 'n':
+        if (!scan_literal("null", 4)) goto fail;
+        goto after_value;
+    default:
+        if (*p != '-' && !IsDigit(*p)) goto fail;
+        if (!scan_number()) goto fail;
+        goto after_value;
+    }
+
+after_value:
+    skip_whitespace();
+    if (stack.empty()) {
+        if (p == end) return true;
+        goto fail;
+    }
+    if (p == end) goto fail;
+    if (*p == ',') {
+        ++p;
+        if (stack.back() == '{' && !scan_key()) goto fail;
+        goto value;
+    }
+    if (*p == (stack.back() == '{' ? '}' : ']')) {
+        ++p;
+        stack.pop_back();
+        goto after_value;
+    }
+
+fail:
+    if (error_offset) {
+        *error_offset = reinterpret_cast<const char*>(p) - data;
+    }
+    return false;
+}
+
+
+// Reformats JSON text without building any Json value: whitespace between 
+// tokens is dropped (negative indent) or regenerated (indent >= 0), and 
+// strings, numbers and literals are copied verbatim, so member order and 
+// number spelling are preserved. Input may be fed in arbitrary chunks. 
+// The token grammar is checked as the text goes by: misplaced commas and 
+// colons, adjacent values, non-string keys, unbalanced brackets and 
+// malformed numbers or literals throw ParseError. String contents (escapes, 
+// control characters, UTF-8) are copied without being checked; use 
+// IsValid() for that. Consecutive top-level values (e.g. NDJSON) must be 
+// separated by whitespace and are written one per line.
+class Reformatter
+{
+public:
+    explicit Reformatter(int indent = -1): indent_(indent) {}
+
+    void Feed(const char *data, size_t size, std::string &out)
+    {
+        const char *p = data, *end = data + size;
+        auto fail = [&](const char *message) {
+            throw ParseError(message, offset_ + (p - data), string_type());
+        };
+        while (p < end) {
+            if (in_string_) {
+                p = CopyString(p, end, out);
+                continue;
+            }
+            if (in_scalar_) {
+                p = CopyScalar(p, end, data, out);
+                continue;
+            }
+            char c = *p;
+            if (IsWhitespace(c)) {
+                if (stack_.empty() && emitted_) pending_separator_ = true;
+                ++p;
+                continue;
+            }
+            // A value may start where one is expected, or at the top level 
+            // after whitespace following the previous value.
+            bool value_allowed = expect_ == kValue || expect_ == kValueOrClose || 
+                    (expect_ == kAfterValue && stack_.empty() && 
+                     pending_separator_);
+            // The newline after an opening bracket is held back until we 
+            // know the container is not empty.
+            bool after_open = after_open_;
+            after_open_ = false;
+            if (after_open) {
+                if (c != ']' && c != '}') Newline(out);
+            } else if (pending_separator_) {
+                pending_separator_ = false;
+                if (stack_.empty()) out.push_back('\n');
+            }
+            emitted_ = true;
+            switch (c) {
+            case '{':
+            case '[':
+                if (!value_allowed) fail("unexpected bracket");
+                stack_.push_back(c);
+                out.push_back(c);
+                after_open_ = true;
+                expect_ = c == '{' ? kKeyOrClose : kValueOrClose;
+                ++p;
+                break;
+            case '}':
+            case ']': {
+                char open = c == '}' ? '{' : '[';
+                if (stack_.empty() || stack_.back() != open) {
+                    fail("mismatched bracket");
+                }
+                if (expect_ != kAfterValue && 
+                        expect_ != (c == '}' ? kKeyOrClose : kValueOrClose)) {
+                    fail("unexpected bracket");
+                }
+                stack_.pop_back();
+                if (!after_open) Newline(out);
+                out.push_back(c);
+                expect_ = kAfterValue;
+                ++p;
+                break;
+            }
+            case ',':
+                if (expect_ != kAfterValue || stack_.empty()) {
+                    fail("unexpected comma");
+                }
+                out.push_back(',');
+                Newline(out);
+                expect_ = stack_.back() == '{' ? kKey : kValue;
+                ++p;
+                break;
+            case ':':
+                if (expect_ != kColon) fail("unexpected colon");
+                out.push_back(':');
+                if (indent_ >= 0) out.push_back(' ');
+                expect_ = kValue;
+                ++p;
+                break;
+            case '\"':
+                // The state after the closing quote is set up front.
+                if (expect_ == kKey || expect_ == kKeyOrClose) {
+                    expect_ = kColon;
+                } else if (value_allowed) {
+                    expect_ = kAfterValue;
+                } else {
+                    fail("unexpected string");
+                }
+                in_string_ = true;
+                out.push_back('\"');
+                ++p;
+                break;
+            default:
+                if (!value_allowed) fail("unexpected value");
+                expect_ = kAfterValue;
+                in_scalar_ = true;
+                p = CopyScalar(p, end, data, out);
+            }
+        }
+        offset_ += size;
+    }
+
+    // Call once all input has been fed. Throws ParseError if the input 
+    // ended inside a string or an unclosed array or object, or right after 
+    // a key or a separator.
+    void Finish(std::string &out)
+    {
+        if (in_scalar_) {
+            in_scalar_ = false;
+            CheckScalar(scalar_.data(), scalar_.size(), offset_);
+            scalar_.clear();
+        }
+        if (in_string_ || !stack_.empty() || 
+                (expect_ != kAfterValue && emitted_)) {
+            throw ParseError("unexpected end of input", offset_, string_type());
+        }
+        if (indent_ >= 0 && emitted_) out.push_back('\n');
+        emitted_ = false;
+        pending_separator_ = false;
+        expect_ = kValue;
+    }
+
+private:
+    enum Expect { kValue, kValueOrClose, kKey, kKeyOrClose, kColon, kAfterValue };
+
+    void Newline(std::string &out)
+    {
+        _AppendNewline(out, indent_, static_cast<int>(stack_.size()));
+    }
+
+    // A number or literal token must be valid JSON on its own.
+    static void CheckScalar(const char *token, size_t size, size_t end_offset)
+    {
+        size_t error_offset;
+        if (!IsValid(token, size, &error_offset)) {
+            throw ParseError("invalid number or literal", 
+                             end_offset - size + error_offset, string_type());
+        }
+    }
+
+    // Copy a number or literal up to the next delimiter. A token split 
+    // across chunks is buffered so that it can be checked as a whole.
+    const char* CopyScalar(const char *p, const char *end, const char *data, 
+                           std::string &out)
+    {
+        const char *run = p;
+        while (p < end && !IsWhitespace(*p) && *p != ',' && *p != ':' && 
+               *p != ']' && *p != '}' && *p != '\"' && *p != '[' && 
+               *p != '{') ++p;
+        out.append(run, p - run);
+        if (p == end) {
+            scalar_.append(run, p - run);
+            return p;
+        }
+        in_scalar_ = false;
+        size_t end_offset = offset_ + (p - data);
+        if (scalar_.empty()) {
+            CheckScalar(run, p - run, end_offset);
+        } else {
+            scalar_.append(run, p - run);
+            CheckScalar(scalar_.data(), scalar_.size(), end_offset);
+            scalar_.clear();
+        }
+        return p;
+    }
+
+    // Copy string content up to and including the closing quote, using 
+    // memchr to find the quote so long strings are copied in bulk.
+    const char* CopyString(const char *p, const char *end, std::string &out)
+    {
+        if (escaped_) {
+            escaped_ = false;
+            out.push_back(*p++);
+        }
+        while (p < end) {
+            const char *quote = static_cast<const char*>(
+                    std::memchr(p, '\"', end - p));
+            const char *stop = quote ? quote : end;
+            const char *backslash = static_cast<const char*>(
+                    std::memchr(p, '\\', stop - p));
+            if (backslash == nullptr) {
+                if (quote == nullptr) {
+                    out.append(p, end - p);
+                    return end;
+                }
+                out.append(p, quote + 1 - p);
+                in_string_ = false;
+                return quote + 1;
+            }
+            // Copy through the escaped character.
+            if (backslash + 1 == end) {
+                out.append(p, end - p);
+                escaped_ = true;
+                return end;
+            }
+            out.append(p, backslash + 2 - p);
+            p = backslash + 2;
+        }
+        return p;
+    }
+
+    int indent_;
+    std::string stack_;
+    size_t offset_ = 0;
+    bool in_string_ = false;
+    bool escaped_ = false;
+    bool after_open_ = false;
+    bool pending_separator_ = false;
+    bool emitted_ = false;
+    bool in_scalar_ = false;
+    std::string scalar_;
+    Expect expect_ = kValue;
+};
+
+
+inline std::string Minify(const char *data, size_t size)
+{
+    std::string out;
+    out.reserve(size);
+    Reformatter reformatter(-1);
+    reformatter.Feed(data, size, out);
+    reformatter.Finish(out);
+    return out;
+}
+
+
+inline std::string Prettify(const char *data, size_t size, int indent = 2)
+{
+    std::string out;
+    out.reserve(size + size / 2);
+    Reformatter reformatter(indent);
+    reformatter.Feed(data, size, out);
+    reformatter.Finish(out);
+    return out;
+}
+
+
+// Skip over one value without building it. Only the nesting and string 
+// quoting are tracked, so a skipped value is not validated.
+string_type::difference_type _SkipValue(
+        typename string_type::const_iterator begin, 
         typename string_type::const_iterator end)
 {
-    enum Status {WAIT_LBRACE, WAIT_STRING1, WAIT_STRING2, WAIT_COLON, 
-                 WAIT_RBRACE_COMMA, COMPLETED};
-    Status status = WAIT_LBRACE;
     auto iter = begin;
-    Json key, value;
+    while (iter < end && IsWhitespace(*iter)) ++iter;
+    if (iter == end) {
+        throw ParseError("invalid json value", iter - begin, string_type());
+    }
+    size_t depth = 0;
+    bool in_string = false;
+    do {
+        charT c = *iter;
+        if (in_string) {
+            if (c == '\\') {
+                ++iter;
+            } else if (c == '\"') {
+                in_string = false;
+                if (depth == 0) return iter - begin + 1;
+            }
+        } else if (c == '\"') {
+            in_string = true;
+        } else if (c == '[' || c == '{') {
+            ++depth;
+        } else if (c == ']' || c == '}') {
+            if (depth == 0) return iter - begin;
+            if (--depth == 0) return iter - begin + 1;
+        } else if (depth == 0 && IsNumberTerminator(c)) {
+            return iter - begin;
+        }
+        ++iter;
+    } while (iter < end);
+    if (in_string || depth) {
+        throw ParseError("unterminated json value", iter - begin, string_type());
+    }
+    return iter - begin;
+}
+
+
+// Parse the members of an object that lie on one of `paths` (starting at key 
+// index `depth`) and skip everything else.
+string_type::difference_type _ParseProjected(Json &json, 
+        typename string_type::const_iterator begin, 
+        typename string_type::const_iterator end, 
+        const std::vector<const key_path_type*> &paths, 
+        size_t depth)
+{
+    auto iter = begin;
+    auto skip_whitespace = [&]() {
+        while (iter < end && IsWhitespace(*iter)) ++iter;
+    };
+    auto fail = [&](const char *message) {
+        return ParseError(message, iter - begin, string_type());
+    };
     json = Json(JsonValueType::Object);
-    while (iter < end) {
-        if (IsWhitespace(*iter)) {
-            goto next_iter;
+    skip_whitespace();
+    if (iter == end || *iter != '{') throw fail("invalid json object");
+    ++iter;
+    skip_whitespace();
+    if (iter < end && *iter == '}') return iter - begin + 1;
+    Json key;
+    std::vector<const key_path_type*> nested;
+    while (true) {
+        iter += _ParseString(key, iter, end);
+        skip_whitespace();
+        if (iter == end || *iter != ':') throw fail("invalid json object");
+        ++iter;
+
+        bool take_whole = false;
+        nested.clear();
+        for (const auto *path: paths) {
+            if ((*path)[depth] != key.GetStringRef()) continue;
+            if (path->size() == depth + 1) take_whole = true;
+            else nested.push_back(path);
         }
-        if (status == WAIT_LBRACE) {
-            if (*iter == '{') {
-                status = WAIT_STRING1;
-                goto next_iter;
-            } else {
-                goto complete;
+        skip_whitespace();
+        if (take_whole) {
+            Json value;
+            iter += _ParseValue(value, iter, end);
+            json[key] = std::move(value);
+        } else if (!nested.empty() && iter < end && *iter == '{') {
+            Json value;
+            iter += _ParseProjected(value, iter, end, nested, depth + 1);
+            json[key] = std::move(value);
+        } else {
+            iter += _SkipValue(iter, end);
+        }
+
+        skip_whitespace();
+        if (iter == end) throw fail("invalid json object");
+        if (*iter == '}') return iter - begin + 1;
+        if (*iter != ',') throw fail("invalid json object");
+        ++iter;
+    }
+}
+
+
+// Parse only the parts of an object document reachable through `paths`. The 
+// result is an object holding just those members (with their enclosing 
+// objects); members off the paths are skipped without being built.
+inline Json ParseProjected(const string_type &str, 
+                           const std::vector<key_path_type> &paths)
+{
+    std::vector<const key_path_type*> pointers;
+    for (const auto &path: paths) {
+        if (!path.empty()) pointers.push_back(&path);
+    }
+    Json json;
+    _ParseProjected(json, str.cbegin(), str.cend(), pointers, 0);
+    return json;
+}
+
+
+// Rank of each type in the total ordering used by Compare().
+inline int _TypeRank(JsonValueType type)
+{
+    switch (type) {
+    case JsonValueType::Null: return 0;
+    case JsonValueType::False: return 1;
+    case JsonValueType::True: return 2;
+    case JsonValueType::Number: return 3;
+    case JsonValueType::String: return 4;
+    case JsonValueType::Array: return 5;
+    case JsonValueType::Object: return 6;
+    default: return 7;
+    }
+}
+
+
+inline int _CompareDouble(double a, double b)
+{
+    if (a < b) return -1;
+    if (b < a) return 1;
+    // NaN sorts after every other number.
+    if (std::isnan(a)) return std::isnan(b) ? 0 : 1;
+    if (std::isnan(b)) return -1;
+    return 0;
+}
+
+
+// Total ordering on Json values: values of different types are ordered by 
+// null < false < true < number < string < array < object < invalid, arrays 
+// compare lexicographically by element and objects by their (key, value) 
+// sequence. Returns a negative, zero or positive value like wstring::compare.
+inline int Compare(const Json &a, const Json &b)
+{
+    int rank_a = _TypeRank(a.GetType()), rank_b = _TypeRank(b.GetType());
+    if (rank_a != rank_b) return rank_a < rank_b ? -1 : 1;
+    switch (a.GetType()) {
+    case JsonValueType::Number:
+        return _CompareDouble(a.ToDouble(), b.ToDouble());
+    case JsonValueType::String:
+        return a.GetStringRef().compare(b.GetStringRef());
+    case JsonValueType::Array: {
+        const auto &x = a.GetArrayRef(), &y = b.GetArrayRef();
+        size_t distance = GetPrefetchDistance();
+        for (Json::size_type i = 0; i < x.size() && i < y.size(); ++i) {
+            _PrefetchElement(x, i, distance);
+            _PrefetchElement(y, i, distance);
+            int result = Compare(x[i], y[i]);
+            if (result) return result;
+        }
+        return x.size() < y.size() ? -1 : (x.size() > y.size() ? 1 : 0);
+    }
+    case JsonValueType::Object: {
+        const auto &x = a.GetObjectRef(), &y = b.GetObjectRef();
+        size_t distance = GetPrefetchDistance();
+        _MemberPrefetcher prefetch_x(x, distance), prefetch_y(y, distance);
+        auto i = x.cbegin(), j = y.cbegin();
+        for (; i != x.cend() && j != y.cend(); ++i, ++j) {
+            prefetch_x.Next();
+            prefetch_y.Next();
+            int result = i->first.compare(j->first);
+            if (result) return result;
+            result = Compare(i->second, j->second);
+            if (result) return result;
+        }
+        return x.size() < y.size() ? -1 : (x.size() > y.size() ? 1 : 0);
+    }
+    default:
+        return 0;
+    }
+}
+
+
+inline bool operator== (const Json &a, const Json &b) { return Compare(a, b) == 0; }
+inline bool operator!= (const Json &a, const Json &b) { return Compare(a, b) != 0; }
+inline bool operator< (const Json &a, const Json &b) { return Compare(a, b) < 0; }
+inline bool operator<= (const Json &a, const Json &b) { return Compare(a, b) <= 0; }
+inline bool operator> (const Json &a, const Json &b) { return Compare(a, b) > 0; }
+inline bool operator>= (const Json &a, const Json &b) { return Compare(a, b) >= 0; }
+
+
+// Runs the tasks of the library's parallel algorithms (sorting, GroupBy). 
+// The default is a process-wide ThreadPool; applications with their own 
+// scheduler can implement this interface and install it with SetExecutor().
+class Executor
+{
+public:
+    virtual ~Executor() {}
+    // How many tasks can run at once, counting the calling thread.
+    virtual unsigned Concurrency() const = 0;
+    // Call f(0), ..., f(n - 1), possibly concurrently, and return once all 
+    // calls have finished. Calls may themselves call ParallelFor. If any 
+    // call throws, one of the exceptions is rethrown.
+    virtual void ParallelFor(size_t n, const std::function<void(size_t)> &f) = 0;
+};
+
+
+// A work-stealing thread pool. Every worker has its own task deque: it 
+// pushes and pops work at the back, while idle workers steal from the front, 
+// which holds the largest pieces. ParallelFor splits its range in halves 
+// recursively, so work is divided only as far as idle threads ask for it. A 
+// thread waiting for its tasks runs queued tasks meanwhile, so nested 
+// ParallelFor calls cannot deadlock the pool.
+class ThreadPool: public Executor
+{
+public:
+    // `num_threads` counts the calling thread, which takes part while it 
+    // waits; 0 means one per hardware thread.
+    explicit ThreadPool(unsigned num_threads = 0)
+    {
+        if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+        if (num_threads == 0) num_threads = 1;
+        // One deque per worker and a shared one for outside threads.
+        queues_ = std::vector<_Queue>(num_threads);
+        for (unsigned i = 0; i + 1 < num_threads; ++i) {
+            workers_.emplace_back([this, i]() { Work(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stopped_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker: workers_) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    unsigned Concurrency() const override
+    {
+        return static_cast<unsigned>(workers_.size() + 1);
+    }
+
+    void ParallelFor(size_t n, const std::function<void(size_t)> &f) override
+    {
+        if (n == 0) return;
+        _Group group;
+        RunRange(0, n, f, group);
+        Wait(group);
+        if (group.error) std::rethrow_exception(group.error);
+    }
+
+private:
+    struct _Group
+    {
+        std::atomic<size_t> pending{0};
+        std::mutex mutex;
+        std::exception_ptr error;
+
+        void Fail(std::exception_ptr e)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = e;
+        }
+    };
+
+    struct _Task
+    {
+        std::function<void()> run;
+        _Group *group;
+    };
+
+    struct _Queue
+    {
+        std::mutex mutex;
+        std::deque<_Task> tasks;
+    };
+
+    // The pool and queue of the current thread if it is a worker.
+    static const ThreadPool*& CurrentPool()
+    {
+        thread_local const ThreadPool *pool = nullptr;
+        return pool;
+    }
+    static size_t& CurrentIndex()
+    {
+        thread_local size_t index = 0;
+        return index;
+    }
+
+    size_t QueueIndex() const
+    {
+        return CurrentPool() == this ? CurrentIndex() : queues_.size() - 1;
+    }
+
+    void RunRange(size_t begin, size_t end, 
+                  const std::function<void(size_t)> &f, _Group &group)
+    {
+        while (end - begin > 1) {
+            size_t middle = begin + (end - begin) / 2;
+            Spawn(group, [this, middle, end, &f, &group]() {
+                RunRange(middle, end, f, group);
+            });
+            end = middle;
+        }
+        try {
+            f(begin);
+        } catch (...) {
+            group.Fail(std::current_exception());
+        }
+    }
+
+    void Spawn(_Group &group, std::function<void()> run)
+    {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        _Queue &queue = queues_[QueueIndex()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(_Task{std::move(run), &group});
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            ++queued_;
+        }
+        wake_.notify_one();
+    }
+
+    // Take a task from queue `index`, or steal one from another queue.
+    bool Pop(size_t index, _Task &task)
+    {
+        {
+            _Queue &own = queues_[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return Took();
             }
-        } else if (status == WAIT_STRING1) {
-            // Empty object
-            if (*iter == '}') {
-                status = COMPLETED;
-                goto next_iter;
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            _Queue &victim = queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return Took();
             }
-            string_type::difference_type i;
-            try {
-                i = _ParseString(key, iter, end);
-            } catch (ParseError &e) {
-                throw ParseError("invalid json object", 
-                                 iter - begin + e.GetOffset(),
-                                 string_type(begin, end));
+        }
+        return false;
+    }
+
+    bool Took()
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        --queued_;
+        return true;
+    }
+
+    void Run(_Task &task)
+    {
+        try {
+            task.run();
+        } catch (...) {
+            task.group->Fail(std::current_exception());
+        }
+        if (task.group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // Last task of the group: wake its waiter. The group may be gone 
+            // once pending is 0, so only the pool is touched from here on. 
+            // Taking the lock orders this with a waiter about to sleep.
+            { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+            wake_.notify_all();
+        }
+    }
+
+    // Run queued tasks until the group's tasks are done. With nothing left 
+    // to steal, sleep until the last of them finishes or more work is 
+    // queued (which may be needed to finish them).
+    void Wait(_Group &group)
+    {
+        size_t index = QueueIndex();
+        while (group.pending.load(std::memory_order_acquire) > 0) {
+            _Task task;
+            if (Pop(index, task)) {
+                Run(task);
+                continue;
             }
-            status = WAIT_COLON;
-            iter += i;
-            continue;
-        } else if (status == WAIT_STRING2) {
-            string_type::difference_type i;
-            try {
-                i = _ParseString(key, iter, end);
-            } catch (ParseError &e) {
-                throw ParseError("invalid json object", 
-                                 iter - begin + e.GetOffset(),
-                                 string_type(begin, end));
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait(lock, [this, &group]() {
+                return group.pending.load(std::memory_order_acquire) == 0 || 
+                       queued_ > 0;
+            });
+        }
+    }
+
+    void Work(size_t index)
+    {
+        CurrentPool() = this;
+        CurrentIndex() = index;
+        while (true) {
+            _Task task;
+            if (Pop(index, task)) {
+                Run(task);
+                continue;
             }
-            status = WAIT_COLON;
-            iter += i;
-            continue;
-        } else if (status == WAIT_COLON) {
-            if (*iter == ':') {
-                string_type::difference_type i;
-                ++iter;
-                try {
-                    i = _ParseValue(value, iter, end);
-                } catch (ParseError &e) {
-                    throw ParseError("invalid json object", 
-                                     iter - begin + e.GetOffset(), 
-                                     string_type(begin, end));
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait(lock, [this]() { return stopped_ || queued_ > 0; });
+            if (stopped_ && queued_ == 0) return;
+        }
+    }
+
+    std::vector<_Queue> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    size_t queued_ = 0;
+    bool stopped_ = false;
+};
+
+
+inline std::atomic<Executor*>& _InstalledExecutor()
+{
+    static std::atomic<Executor*> executor{nullptr};
+    return executor;
+}
+
+
+// The executor parallel algorithms run on: the one installed with 
+// SetExecutor(), or else a ThreadPool with one thread per hardware thread, 
+// created on first use.
+inline Executor& GetExecutor()
+{
+    if (Executor *executor = _InstalledExecutor().load(std::memory_order_acquire)) {
+        return *executor;
+    }
+    static ThreadPool pool;
+    return pool;
+}
+
+
+// Install `executor` (nullptr restores the default) and return the previous 
+// one. The executor must stay alive while it is installed.
+inline Executor* SetExecutor(Executor *executor)
+{
+    return _InstalledExecutor().exchange(executor, std::memory_order_acq_rel);
+}
+
+
+// Ranges shorter than this are sorted on the calling thread.
+constexpr size_t kParallelSortThreshold = 1 << 14;
+
+
+// Fork-join stable merge sort: halves are sorted as two tasks and merged.
+template <typename Iter, typename Less>
+void _ParallelStableSort(Iter first, Iter last, Less less, unsigned num_threads)
+{
+    auto n = static_cast<size_t>(last - first);
+    if (num_threads <= 1 || n < kParallelSortThreshold) {
+        std::stable_sort(first, last, less);
+        return;
+    }
+    Iter middle = first + n / 2;
+    GetExecutor().ParallelFor(2, [&](size_t half) {
+        if (half == 0) _ParallelStableSort(first, middle, less, num_threads / 2);
+        else _ParallelStableSort(middle, last, less, num_threads - num_threads / 2);
+    });
+    std::inplace_merge(first, middle, last, less);
+}
+
+
+// Number of parallel tasks to split work into; 0 means the executor's 
+// concurrency.
+inline unsigned _ResolveThreadCount(unsigned num_threads)
+{
+    if (num_threads) return num_threads;
+    return GetExecutor().Concurrency();
+}
+
+
+// Reorder `elements` so that position i receives the element previously at 
+// order[i]. Elements are moved, never copied.
+template <typename Keys>
+void _PermuteByOrder(Json::array_container_type &elements, const Keys &keys)
+{
+    // Same allocator as `elements`, so they can be swapped.
+    Json::array_container_type sorted(elements.get_allocator());
+    sorted.reserve(elements.size());
+    for (const auto &key: keys) {
+        sorted.push_back(std::move(elements[key.second]));
+    }
+    elements.swap(sorted);
+}
+
+
+void Json::Sort(unsigned num_threads)
+{
+    auto &elements = GetArrayRef();
+    std::vector<std::pair<const Json*, size_type> > keys;
+    keys.reserve(elements.size());
+    for (size_type i = 0; i < elements.size(); ++i) {
+        keys.emplace_back(&elements[i], i);
+    }
+    _ParallelStableSort(keys.begin(), keys.end(), 
+            [](const std::pair<const Json*, size_type> &a, 
+               const std::pair<const Json*, size_type> &b) {
+                return Compare(*a.first, *b.first) < 0;
+            }, _ResolveThreadCount(num_threads));
+    _PermuteByOrder(elements, keys);
+}
+
+
+void Json::SortBy(const key_path_type &path, unsigned num_threads)
+{
+    auto &elements = GetArrayRef();
+    num_threads = _ResolveThreadCount(num_threads);
+
+    // Sort keys are extracted once. When every key is a number (the common 
+    // case) they are kept as plain doubles so the sort never touches the 
+    // elements.
+    bool all_numbers = true;
+    std::vector<std::pair<const Json*, size_type> > keys;
+    keys.reserve(elements.size());
+    for (size_type i = 0; i < elements.size(); ++i) {
+        const Json *key = elements[i].Find(path);
+        if (key == nullptr || !key->IsNumber()) all_numbers = false;
+        keys.emplace_back(key, i);
+    }
+
+    if (all_numbers) {
+        std::vector<std::pair<double, size_type> > numeric_keys;
+        numeric_keys.reserve(keys.size());
+        for (const auto &key: keys) {
+            numeric_keys.emplace_back(key.first->ToDouble(), key.second);
+        }
+        _ParallelStableSort(numeric_keys.begin(), numeric_keys.end(), 
+                [](const std::pair<double, size_type> &a, 
+                   const std::pair<double, size_type> &b) {
+                    return _CompareDouble(a.first, b.first) < 0;
+                }, num_threads);
+        _PermuteByOrder(elements, numeric_keys);
+        return;
+    }
+
+    _ParallelStableSort(keys.begin(), keys.end(), 
+            [](const std::pair<const Json*, size_type> &a, 
+               const std::pair<const Json*, size_type> &b) {
+                if (a.first == nullptr || b.first == nullptr) {
+                    return a.first == nullptr && b.first != nullptr;
                 }
-                status = WAIT_RBRACE_COMMA;
-                iter += i;
-                continue;
-            }
-            goto complete;
-        } else if (status == WAIT_RBRACE_COMMA) {
-            if (*iter == ',') {
-                status == WAIT_STRING2;
-            } else if (*iter == '}') {
-                status = COMPLETED;
-            }
-            goto next_iter;
-        } else {
-            break;
+                return Compare(*a.first, *b.first) < 0;
+            }, num_threads);
+    _PermuteByOrder(elements, keys);
+}
+
+
+// How aggregation treats elements that are not numbers (or, for key path 
+// aggregation, elements where the path is missing).
+enum class NonNumericPolicy {
+    Skip = 0, 
+    Throw = 1, 
+};
+
+
+struct AggregateResult
+{
+    Json::size_type count = 0;
+    double sum = 0.;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    // NaN when no numeric element has been aggregated.
+    double Mean() const
+    {
+        if (count == 0) return std::numeric_limits<double>::quiet_NaN();
+        return sum / count;
+    }
+};
+
+
+// Reduce a contiguous buffer of doubles. Uses SSE2 when the target has it, 
+// with two independent accumulators to hide the latency of the adds.
+inline AggregateResult _AggregateDoubles(const double *data, size_t n)
+{
+    AggregateResult result;
+    result.count = n;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (n >= 4) {
+        __m128d sum0 = _mm_setzero_pd();
+        __m128d sum1 = _mm_setzero_pd();
+        __m128d min = _mm_set1_pd(result.min);
+        __m128d max = _mm_set1_pd(result.max);
+        for (; i + 4 <= n; i += 4) {
+            __m128d a = _mm_loadu_pd(data + i);
+            __m128d b = _mm_loadu_pd(data + i + 2);
+            sum0 = _mm_add_pd(sum0, a);
+            sum1 = _mm_add_pd(sum1, b);
+            min = _mm_min_pd(min, _mm_min_pd(a, b));
+            max = _mm_max_pd(max, _mm_max_pd(a, b));
         }
-next_iter:
-        ++iter;
+        double lanes[2];
+        _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+        result.sum = lanes[0] + lanes[1];
+        _mm_storeu_pd(lanes, min);
+        result.min = std::fmin(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, max);
+        result.max = std::fmax(lanes[0], lanes[1]);
     }
-complete:
-    if (status != COMPLETED) {
-        throw ParseError("invalid json object", 
-                         iter - begin, 
-                         string_type(begin, end));
+#endif
+    for (; i < n; ++i) {
+        result.sum += data[i];
+        if (data[i] < result.min) result.min = data[i];
+        if (data[i] > result.max) result.max = data[i];
     }
-    return iter - begin;
+    return result;
 }
 
 
+inline void _CollectNumber(std::vector<double> &values, const Json *element, 
+                           Json::size_type index, NonNumericPolicy policy)
+{
+    if (element != nullptr && element->IsNumber()) {
+        values.push_back(element->ToDouble());
+        return;
+    }
+    if (policy == NonNumericPolicy::Throw) {
+        std::string message = "aggregating non-numeric element at index " + 
+                std::to_string(index) + " (" + 
+                (element ? ValueTypeToStr(element->GetType()) : "missing") + 
+                ")";
+        throw IncompatibleTypeError(std::move(message));
+    }
+}
 
-string_type::difference_type _ParseString(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end)
+
+// Aggregate the numbers of an array. The elements are first gathered into a 
+// contiguous buffer so the reduction itself runs on plain doubles.
+inline AggregateResult Aggregate(const Json &array, 
+        NonNumericPolicy policy = NonNumericPolicy::Skip)
 {
-    enum Status {WAIT_QUOT1, WAIT_QUOT2, BACKSLASH_PENDING, COMPLETED};
-    Status status = WAIT_QUOT1;
-    auto iter = begin;
-    string_type result;
-    while (iter < end) {
-        if (status == WAIT_QUOT1) {
-            if (IsWhitespace(*iter)) {
-                goto next_iter;
-            }
-            switch (*iter) {
-            case '\"': {
-                status = WAIT_QUOT2;
-                goto next_iter;
-            }
-            default:
-                goto complete;
-            }
-        } else if (status == WAIT_QUOT2) {
-            if (IsControlChar(*iter)) {
-                goto complete;
-            }
-            switch (*iter) {
-            case '\"': {
-                status = COMPLETED;
-                goto next_iter;
-            }
-            case '\\': {
-                status = BACKSLASH_PENDING;
-                goto next_iter;
-            }
-            default:
-                result.push_back(*iter);
-            }
-        } else if (status == BACKSLASH_PENDING) {
-            switch (*iter) {
-            case '\\':
-            case '/':
-            case '\"': {
-                result.push_back(*iter);
-                break;
-            }
-            case 'b': {
-                result.push_back(L'\b');
-                break;
-            }
-            case 'f': {
-                result.push_back(L'\f');
-                break;
-            }
-            case 'n': {
-                result.push_back(L'\n');
-                break;
-            }
-            case 'r': {
-                result.push_back(L'\r');
-                break;
-            }
-            case 't': {
-                result.push_back(L'\t');
-                break;
-            }
-            case 'u': {
-                using charT = string_type::value_type;
-                charT c;
-                try {
-                    c = static_cast<charT>(
-                            stoi(string_type(iter+1, iter+5), nullptr, 16));
-                } catch (std::invalid_argument &e) {
-                    throw ParseError("invalid json string.", 
-                                     iter - begin, 
-                                     string_type(begin, end));
-                } 
-                iter += 4;
-                result.push_back(c);
-                break;
-            }
-            default: {
-                goto complete;
-            }
-            }
-            status = WAIT_QUOT2;
-        } else if (status == COMPLETED) {
-            break;
+    const auto &elements = array.GetArrayRef();
+    std::vector<double> values;
+    values.reserve(elements.size());
+    for (Json::size_type i = 0; i < elements.size(); ++i) {
+        _CollectNumber(values, &elements[i], i, policy);
+    }
+    return _AggregateDoubles(values.data(), values.size());
+}
+
+
+// Aggregate the value found at `path` in every element of an array of objects, 
+// e.g. Aggregate(records, {L"latency", L"p99"}).
+inline AggregateResult Aggregate(const Json &array, const key_path_type &path, 
+        NonNumericPolicy policy = NonNumericPolicy::Skip)
+{
+    const auto &elements = array.GetArrayRef();
+    std::vector<double> values;
+    values.reserve(elements.size());
+    for (Json::size_type i = 0; i < elements.size(); ++i) {
+        _CollectNumber(values, elements[i].Find(path), i, policy);
+    }
+    return _AggregateDoubles(values.data(), values.size());
+}
+
+
+inline double Sum(const Json &array, 
+                  NonNumericPolicy policy = NonNumericPolicy::Skip)
+{
+    return Aggregate(array, policy).sum;
+}
+
+
+inline double Min(const Json &array, 
+                  NonNumericPolicy policy = NonNumericPolicy::Skip)
+{
+    return Aggregate(array, policy).min;
+}
+
+
+inline double Max(const Json &array, 
+                  NonNumericPolicy policy = NonNumericPolicy::Skip)
+{
+    return Aggregate(array, policy).max;
+}
+
+
+inline double Mean(const Json &array, 
+                   NonNumericPolicy policy = NonNumericPolicy::Skip)
+{
+    return Aggregate(array, policy).Mean();
+}
+
+
+// Frozen documents: an immutable, position-independent image of a Json
+// value in one contiguous buffer. Nodes refer to each other by offsets from
+// the start of the image instead of pointers, so the same bytes can be
+// mapped at different addresses in several processes (see SharedDocument)
+// and read in place without parsing or copying. The image uses the native
+// byte order and wchar_t size, so it is only portable between processes of
+// the same build.
+//
+// Layout (all fields 8-byte aligned):
+//   header:  magic "FJSONIMG", uint32 version, uint32 sizeof(charT),
+//            uint64 image size, uint64 root offset
+//   node:    uint64 type, then by type
+//     Number   double
+//     String   uint64 length, length charT units
+//     Array    uint64 count, count uint64 element offsets
+//     Object   uint64 count, count (uint64 key offset, uint64 value offset)
+//              pairs sorted by key; keys are String nodes
+struct _FrozenHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t char_size;
+    uint64_t size;
+    uint64_t root;
+};
+
+
+constexpr uint32_t kFrozenVersion = 1;
+
+
+inline uint64_t _AlignFrozen(uint64_t n)
+{
+    return (n + 7) & ~static_cast<uint64_t>(7);
+}
+
+
+inline uint64_t _FrozenStringSize(const string_type &str)
+{
+    return 16 + _AlignFrozen(str.size() * sizeof(charT));
+}
+
+
+// Bytes needed for `json` and everything below it.
+inline uint64_t _FrozenSize(const Json &json)
+{
+    switch (json.GetType()) {
+    case JsonValueType::Number:
+        return 16;
+    case JsonValueType::String:
+        return _FrozenStringSize(json.GetStringRef());
+    case JsonValueType::Array: {
+        const auto &elements = json.GetArrayRef();
+        uint64_t size = 16 + 8 * elements.size();
+        for (const auto &element: elements) size += _FrozenSize(element);
+        return size;
+    }
+    case JsonValueType::Object: {
+        uint64_t size = 16;
+        for (const auto &member: json.GetObjectRef()) {
+            if (!member.second.IsValid()) continue;
+            size += 16 + _FrozenStringSize(member.first) + 
+                    _FrozenSize(member.second);
         }
-next_iter:
-        ++iter;
+        return size;
     }
-complete:
-    if (status == COMPLETED) {
-        json = Json(std::move(result));
-        return iter - begin;
-    } else {
-        throw ParseError("invalid json string", 
-                         iter - begin, 
-                         string_type(begin, end));
+    default:
+        return 8;
     }
 }
 
 
-string_type::difference_type _ParseNumber(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end)
+class _FrozenWriter
 {
-    enum Status {START, WAIT_DIGIT1, WAIT_DIGIT2, FRACTION, WAIT_FRACTION_DIGIT, 
-            WAIT_FRACTION_DIGIT_END, WAIT_E_DIGIT, WAIT_E_SIGN, WAIT_E_DIGIT_END, 
-            COMPLETED, BAD};
-    Status status = START;
-    auto iter = begin;
-    double result;
-    string_type s;
-    while (iter < end) {
-        if (status == START) {
-            if (IsWhitespace(*iter)) {
-                goto next_iter;
-            } else if (*iter == '-') {
-                status = WAIT_DIGIT1;
-                goto add_char;
-            } else if (IsDigit(*iter)) {
-                status = WAIT_DIGIT1;
-                continue;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_DIGIT1) {
-            if (*iter == '0') {
-                status = FRACTION;
-                goto add_char;
-            } else if (IsDigit(*iter)) {
-                status = WAIT_DIGIT2;
-                goto add_char;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_DIGIT2) {
-            if (IsDigit(*iter)) {
-                goto add_char;
-            } else if (*iter == '.') {
-                status = WAIT_FRACTION_DIGIT;
-                goto add_char;
-            } else if (*iter == 'e' || *iter == 'E') {
-                status = WAIT_E_SIGN;
-                goto add_char;
-            } else if (IsWhitespace(*iter)) {
-                status = COMPLETED;
-                goto next_iter;
-            } else {
-                goto complete;
-            }
-        } else if (status == FRACTION) {
-            if (*iter == '.') {
-                status = WAIT_FRACTION_DIGIT;
-                goto next_iter;
-            } else if (*iter == 'e' || *iter == 'E') {
-                status = WAIT_E_SIGN;
-                goto next_iter;
-            } if (IsWhitespace(*iter)) {
-                status = COMPLETED;
-                goto next_iter;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_FRACTION_DIGIT) {
-            if (IsDigit(*iter)) {
-                status = WAIT_FRACTION_DIGIT_END;
-                goto add_char;
-            } else {
-                status = BAD;
-                goto complete;
-            } 
-        } else if (status == WAIT_FRACTION_DIGIT_END) {
-            if (IsDigit(*iter)) {
-                goto add_char;
-            } else if (*iter == 'e' || *iter == 'E') {
-                status = WAIT_E_SIGN;
-                goto add_char;
-            } else if (IsWhitespace(*iter) || *iter == ',') {
-                status = COMPLETED;
-                goto complete;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_E_SIGN) {
-            if (IsDigit(*iter)) {
-                status = WAIT_E_DIGIT;
-                continue;
-            } else if (*iter == '-' || *iter == '+') {
-                status = WAIT_E_DIGIT;
-                goto add_char;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_E_DIGIT) {
-            if (IsDigit(*iter)) {
-                status = WAIT_E_DIGIT_END;
-                goto add_char;
-            } else {
-                status = BAD;
-                goto complete;
-            }
-        } else if (status == WAIT_E_DIGIT_END) {
-            if (IsDigit(*iter)) {
-                goto add_char;
-            } else if (IsWhitespace(*iter) || *iter == ',') {
-                status = COMPLETED;
-                goto complete;
-            } else {
-                status = BAD;
-                goto complete;
+public:
+    _FrozenWriter(char *base): base_(base) {}
+
+    uint64_t Write(const Json &json)
+    {
+        uint64_t offset = position_;
+        JsonValueType type = json.GetType();
+        // Invalid placeholders inside arrays are written as null.
+        if (type == JsonValueType::InvalidValue) type = JsonValueType::Null;
+        Store(offset, static_cast<uint64_t>(type));
+        switch (type) {
+        case JsonValueType::Number:
+            Store(offset + 8, json.ToDouble());
+            position_ += 16;
+            break;
+        case JsonValueType::String:
+            return WriteString(json.GetStringRef());
+        case JsonValueType::Array: {
+            const auto &elements = json.GetArrayRef();
+            Store(offset + 8, static_cast<uint64_t>(elements.size()));
+            position_ += 16 + 8 * elements.size();
+            for (size_t i = 0; i < elements.size(); ++i) {
+                Store(offset + 16 + 8 * i, Write(elements[i]));
             }
-        } else {
             break;
         }
-add_char:
-        s.push_back(*iter);
-next_iter:
-        iter++;
+        case JsonValueType::Object: {
+            // Members sorted by plain code unit order, whatever the order
+            // of the object container, so readers can binary search.
+            std::vector<const Json::object_container_type::value_type*> members;
+            for (const auto &member: json.GetObjectRef()) {
+                if (member.second.IsValid()) members.push_back(&member);
+            }
+            std::sort(members.begin(), members.end(), 
+                      [](const Json::object_container_type::value_type *a, 
+                         const Json::object_container_type::value_type *b) {
+                          return a->first < b->first;
+                      });
+            Store(offset + 8, static_cast<uint64_t>(members.size()));
+            position_ += 16 + 16 * members.size();
+            for (size_t i = 0; i < members.size(); ++i) {
+                Store(offset + 16 + 16 * i, WriteString(members[i]->first));
+                Store(offset + 24 + 16 * i, Write(members[i]->second));
+            }
+            break;
+        }
+        default:
+            position_ += 8;
+        }
+        return offset;
     }
-complete:
-    switch (status)
+
+    uint64_t WriteString(const string_type &str)
     {
-    case COMPLETED:
-    case FRACTION:
-    case WAIT_DIGIT2: 
-    case WAIT_FRACTION_DIGIT_END:
-    case WAIT_E_DIGIT_END:
-        json = std::stod(s); 
-        return iter - begin;
-    default:
-        throw ParseError("invalid json number", 
-                         iter - begin, 
-                         string_type(begin, end));
+        uint64_t offset = position_;
+        Store(offset, static_cast<uint64_t>(JsonValueType::String));
+        Store(offset + 8, static_cast<uint64_t>(str.size()));
+        std::memcpy(base_ + offset + 16, str.data(), str.size() * sizeof(charT));
+        position_ += _FrozenStringSize(str);
+        return offset;
     }
+
+    void Skip(uint64_t n) { position_ += n; }
+
+private:
+    template <typename T>
+    void Store(uint64_t offset, T value)
+    {
+        std::memcpy(base_ + offset, &value, sizeof(value));
+    }
+
+    char *base_;
+    uint64_t position_ = 0;
+};
+
+
+// Size of the image Freeze() writes for `json`.
+inline uint64_t FrozenImageSize(const Json &json)
+{
+    return sizeof(_FrozenHeader) + _FrozenSize(json);
 }
 
 
-string_type::difference_type _ParseValue(Json &json, 
-        typename string_type::const_iterator begin, 
-        typename string_type::const_iterator end)
+// Write the image of `json` to buffer[0, FrozenImageSize(json)). The buffer
+// must be 8-byte aligned.
+inline void Freeze(const Json &json, char *buffer)
 {
-    auto iter = begin;
-    bool completed = false;
-    while (iter < end) {
-        if (IsWhitespace(*iter)) {
-            goto next_iter;
+    _FrozenHeader header;
+    std::memcpy(header.magic, "FJSONIMG", 8);
+    header.version = kFrozenVersion;
+    header.char_size = sizeof(charT);
+    header.size = FrozenImageSize(json);
+    _FrozenWriter writer(buffer);
+    writer.Skip(sizeof(_FrozenHeader));
+    header.root = writer.Write(json);
+    std::memcpy(buffer, &header, sizeof(header));
+}
+
+
+// A read-only view of a value in a frozen image. Views are three words and 
+// are passed by value; they stay valid as long as the image is mapped. The 
+// image may come from another process, so every offset, count and length 
+// read from it is checked against its size, and a JsonError is thrown for 
+// one that points outside it.
+class FrozenValue
+{
+public:
+    FrozenValue(const char *base, uint64_t size, uint64_t offset): 
+            base_(base), size_(size), offset_(offset)
+    {
+        if (offset % 8 != 0) Corrupt();
+        Check(offset, 8);
+        // Every other accessor relies on the type word naming a known type.
+        if (Load<uint64_t>(offset) > 
+                static_cast<uint64_t>(JsonValueType::InvalidValue)) {
+            Corrupt();
         }
-        switch (*iter) {
-        case '{': {
-            string_type::difference_type i;
-            try {
-                i = _ParseObject(json, iter, end);
-                completed = true;
-            } catch (ParseError &e) {
-                i = e.GetOffset();
+    }
+
+    // View the root of an image, checking its header.
+    static FrozenValue Root(const char *image, size_t size)
+    {
+        _FrozenHeader header;
+        if (size < sizeof(header)) throw JsonError("frozen image too small");
+        std::memcpy(&header, image, sizeof(header));
+        if (std::memcmp(header.magic, "FJSONIMG", 8) != 0 || 
+                header.version != kFrozenVersion || 
+                header.char_size != sizeof(charT) || header.size > size) {
+            throw JsonError("not a compatible frozen image");
+        }
+        if (header.root < sizeof(header)) Corrupt();
+        return FrozenValue(image, header.size, header.root);
+    }
+
+    JsonValueType GetType() const
+    {
+        return static_cast<JsonValueType>(Load<uint64_t>(offset_));
+    }
+    bool IsNumber() const { return GetType() == JsonValueType::Number; }
+    bool IsNull() const { return GetType() == JsonValueType::Null; }
+    bool IsTrue() const { return GetType() == JsonValueType::True; }
+    bool IsFalse() const { return GetType() == JsonValueType::False; }
+    bool IsString() const { return GetType() == JsonValueType::String; }
+    bool IsArray() const { return GetType() == JsonValueType::Array; }
+    bool IsObject() const { return GetType() == JsonValueType::Object; }
+
+    double ToDouble() const
+    {
+        Expect(JsonValueType::Number, "ToDouble()");
+        Check(offset_, 16);
+        return Load<double>(offset_ + 8);
+    }
+    bool ToBool() const
+    {
+        if (IsTrue()) return true;
+        if (IsFalse()) return false;
+        Expect(JsonValueType::True, "ToBool()");
+        return false;
+    }
+
+    // String contents, in place.
+    const charT* StringData() const
+    {
+        Expect(JsonValueType::String, "StringData()");
+        Check(offset_, 16);
+        return reinterpret_cast<const charT*>(base_ + offset_ + 16);
+    }
+    size_t StringSize() const
+    {
+        Expect(JsonValueType::String, "StringSize()");
+        Check(offset_, 16);
+        uint64_t length = Load<uint64_t>(offset_ + 8);
+        if (length > (size_ - offset_ - 16) / sizeof(charT)) Corrupt();
+        return length;
+    }
+    string_type ToString() const
+    {
+        return string_type(StringData(), StringSize());
+    }
+
+    // Number of elements or members.
+    size_t size() const
+    {
+        if (!IsArray() && !IsObject()) Expect(JsonValueType::Array, "size()");
+        Check(offset_, 16);
+        uint64_t count = Load<uint64_t>(offset_ + 8);
+        uint64_t entry_size = IsArray() ? 8 : 16;
+        if (count > (size_ - offset_ - 16) / entry_size) Corrupt();
+        return count;
+    }
+
+    FrozenValue operator[] (size_t index) const
+    {
+        Expect(JsonValueType::Array, "indexing with integer");
+        if (index >= size()) throw JsonError("frozen array index out of range");
+        return Child(offset_ + 16 + 8 * index);
+    }
+
+    // Key and value of the index-th member of an object, in key order.
+    FrozenValue KeyAt(size_t index) const
+    {
+        Expect(JsonValueType::Object, "KeyAt()");
+        if (index >= size()) throw JsonError("frozen object index out of range");
+        return Child(offset_ + 16 + 16 * index);
+    }
+    FrozenValue ValueAt(size_t index) const
+    {
+        Expect(JsonValueType::Object, "ValueAt()");
+        if (index >= size()) throw JsonError("frozen object index out of range");
+        return Child(offset_ + 24 + 16 * index);
+    }
+
+    // Binary search for a member. Returns false if absent or not an object.
+    bool Find(const string_type &key, FrozenValue &value) const
+    {
+        if (!IsObject()) return false;
+        size_t low = 0, high = size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            FrozenValue candidate = KeyAt(middle);
+            int result = std::char_traits<charT>::compare(
+                    candidate.StringData(), key.data(), 
+                    std::min(candidate.StringSize(), key.size()));
+            if (result == 0) {
+                if (candidate.StringSize() == key.size()) {
+                    value = ValueAt(middle);
+                    return true;
+                }
+                result = candidate.StringSize() < key.size() ? -1 : 1;
             }
-            iter += i;
-            goto complete;
+            if (result < 0) low = middle + 1;
+            else high = middle;
         }
-        case '[': {
-            string_type::difference_type i;
-            try {
-                i = _ParseArray(json, iter, end);
-                completed = true;
-            } catch (ParseError &e) {
-                i = e.GetOffset();
+        return false;
+    }
+
+    // Copy into an ordinary Json value.
+    Json Thaw() const
+    {
+        switch (GetType()) {
+        case JsonValueType::Number: return Json(ToDouble());
+        case JsonValueType::True: return Json(true);
+        case JsonValueType::False: return Json(false);
+        case JsonValueType::String: return Json(ToString());
+        case JsonValueType::Array: {
+            Json json(JsonValueType::Array);
+            auto &elements = json.GetArrayRef();
+            elements.reserve(size());
+            for (size_t i = 0; i < size(); ++i) {
+                elements.push_back((*this)[i].Thaw());
             }
-            iter += i;
-            goto complete;
+            return json;
         }
-        case '\"': {
-            string_type::difference_type i;
-            try {
-                i = _ParseString(json, iter, end);
-                completed = true;
-            } catch (ParseError &e) {
-                i = e.GetOffset();
+        case JsonValueType::Object: {
+            Json json(JsonValueType::Object);
+            for (size_t i = 0; i < size(); ++i) {
+                json[KeyAt(i).ToString()] = ValueAt(i).Thaw();
             }
-            iter += i;
-            goto complete;
+            return json;
         }
-        case 't':
-            if (string_type(iter+1, iter+4) == L"rue") {
-                json = Json(true);
-                completed = true;
+        default:
+            return Json(JsonValueType::Null);
+        }
+    }
+
+private:
+    template <typename T>
+    T Load(uint64_t offset) const
+    {
+        T value;
+        std::memcpy(&value, base_ + offset, sizeof(value));
+        return value;
+    }
+
+    // The node whose offset is stored at `entry`. Freeze() writes children 
+    // after their parent, so an offset that does not lead forward (and 
+    // could form a cycle) is rejected as well.
+    FrozenValue Child(uint64_t entry) const
+    {
+        uint64_t offset = Load<uint64_t>(entry);
+        if (offset <= offset_) Corrupt();
+        return FrozenValue(base_, size_, offset);
+    }
+
+    // Throw unless image[offset, offset + bytes) lies inside the image.
+    void Check(uint64_t offset, uint64_t bytes) const
+    {
+        if (offset > size_ || bytes > size_ - offset) Corrupt();
+    }
+
+    [[noreturn]] static void Corrupt()
+    {
+        throw JsonError("corrupt frozen image");
+    }
+
+    void Expect(JsonValueType type, const char *operation) const
+    {
+        if (GetType() == type) return;
+        std::string message = std::string("calling ") + operation + " on " + 
+                ValueTypeToStr(GetType()) + " is invalid";
+        throw IncompatibleTypeError(std::move(message));
+    }
+
+    const char *base_;
+    uint64_t size_;
+    uint64_t offset_;
+};
+
+
+#ifdef FJSON_HAVE_POSIX_IO
+// A frozen document in a POSIX shared memory object. One process creates
+// it; any number of processes open it by name and read it in place through
+// FrozenValue, sharing the same physical pages instead of each parsing and
+// holding its own copy.
+class SharedDocument
+{
+public:
+    SharedDocument(const SharedDocument&) = delete;
+    SharedDocument& operator= (const SharedDocument&) = delete;
+    SharedDocument(SharedDocument &&other): 
+            image_(other.image_), size_(other.size_)
+    {
+        other.image_ = nullptr;
+        other.size_ = 0;
+    }
+    ~SharedDocument()
+    {
+        if (image_) munmap(image_, size_);
+    }
+
+    // Create the shared memory object `name` (e.g. "/reference-data") and
+    // freeze `json` into it. Fails if the name already exists.
+    static SharedDocument Create(const std::string &name, const Json &json)
+    {
+        uint64_t size = FrozenImageSize(json);
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) Fail("shm_open", name);
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            Fail("ftruncate", name);
+        }
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            Fail("mmap", name);
+        }
+        // Owns the mapping from here on, so it is unmapped if Freeze() throws.
+        SharedDocument document(p, size);
+        try {
+            Freeze(json, static_cast<char*>(p));
+            // Readers never write; the creator does not either from now on.
+            if (mprotect(p, size, PROT_READ) != 0) Fail("mprotect", name);
+        } catch (...) {
+            shm_unlink(name.c_str());
+            throw;
+        }
+        return document;
+    }
+
+    // Map an existing document read-only.
+    static SharedDocument Open(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) Fail("shm_open", name);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            Fail("fstat", name);
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) Fail("mmap", name);
+        SharedDocument document(p, st.st_size);
+        // Validate the header.
+        document.Root();
+        return document;
+    }
+
+    // Remove the name; mappings that are already open stay valid.
+    static void Unlink(const std::string &name)
+    {
+        shm_unlink(name.c_str());
+    }
+
+    FrozenValue Root() const
+    {
+        return FrozenValue::Root(static_cast<const char*>(image_), size_);
+    }
+    size_t size() const { return size_; }
+
+private:
+    SharedDocument(void *image, size_t size): image_(image), size_(size) {}
+
+    static void Fail(const char *operation, const std::string &name)
+    {
+        throw JsonError(std::string(operation) + " failed for " + name + ": " + 
+                        std::strerror(errno));
+    }
+
+    void *image_;
+    size_t size_;
+};
+#endif
+
+
+// A group-by query over NDJSON (one JSON object per line) input.
+struct GroupByQuery
+{
+    // Records are grouped by the value at this path, and each group is 
+    // keyed by the compact JSON text of that value, so the string "1" 
+    // (key "\"1\""), the number 1 (key "1") and null (key "null") are 
+    // separate groups. Records missing it fall into the group with the 
+    // empty key.
+    key_path_type group_by;
+    // Numeric fields aggregated per group.
+    std::vector<key_path_type> fields;
+    NonNumericPolicy policy = NonNumericPolicy::Skip;
+    // Number of chunks processed as tasks on GetExecutor(); 0 uses the 
+    // executor's concurrency.
+    unsigned num_threads = 0;
+};
+
+
+struct _GroupState
+{
+    Json::size_type count = 0;
+    std::vector<AggregateResult> fields;
+};
+
+
+// Keyed by the UTF-8 text of the group key (see GroupByQuery::group_by).
+using _GroupTable = std::unordered_map<std::string, _GroupState>;
+
+
+// The key a record is grouped under: the JSON text of the value, which 
+// keeps values of different types apart, or empty if it is missing.
+inline std::string _GroupKey(const Json *value)
+{
+    if (value == nullptr || !value->IsValid()) return std::string();
+    return value->Dump();
+}
+
+
+inline void _MergeAggregate(AggregateResult &into, const AggregateResult &from)
+{
+    into.count += from.count;
+    into.sum += from.sum;
+    into.min = std::fmin(into.min, from.min);
+    into.max = std::fmax(into.max, from.max);
+}
+
+
+// Aggregate the records of data[0, size) into `table`. `first_line` is the 
+// line number of the first record, used in error messages.
+inline void _GroupByChunk(const char *data, size_t size, size_t first_line, 
+                          const GroupByQuery &query, _GroupTable &table)
+{
+    std::vector<key_path_type> paths(query.fields);
+    paths.push_back(query.group_by);
+#ifdef FJSON_USE_PMR
+    // Records die at the end of each line: parse them into an arena owned 
+    // by this worker, local to its NUMA node, and rewind it per record.
+    HugePageArena arena(kHugePageSize);
+    MemoryResourceScope scope(&arena);
+#endif
+    string_type line;
+    size_t line_number = first_line;
+    for (const char *p = data, *end = data + size; p < end; ++line_number) {
+        const char *newline = static_cast<const char*>(
+                std::memchr(p, '\n', end - p));
+        const char *line_end = newline ? newline : end;
+        line.clear();
+        _AppendUtf8(line, p, line_end - p);
+        p = line_end + 1;
+        bool blank = true;
+        for (auto c: line) {
+            if (!IsWhitespace(c)) {
+                blank = false;
                 break;
-            } else {
-                goto complete;
             }
-        case 'f':
-            if (string_type(iter+1, iter+5) == L"alse") {
-                json = Json(false);
-                completed = true;
-                break;
-            } else {
-                goto complete;
+        }
+        if (blank) continue;
+
+#ifdef FJSON_USE_PMR
+        arena.Reset();
+#endif
+        Json record;
+        try {
+            record = ParseProjected(line, paths);
+        } catch (ParseError &e) {
+            throw ParseError("invalid record on line " + 
+                             std::to_string(line_number + 1), 
+                             e.GetOffset(), std::move(line));
+        }
+        auto &state = table[_GroupKey(record.Find(query.group_by))];
+        if (state.fields.empty()) state.fields.resize(query.fields.size());
+        ++state.count;
+        for (size_t i = 0; i < query.fields.size(); ++i) {
+            const Json *value = record.Find(query.fields[i]);
+            if (value != nullptr && value->IsNumber()) {
+                double x = value->ToDouble();
+                AggregateResult &field = state.fields[i];
+                ++field.count;
+                field.sum += x;
+                if (x < field.min) field.min = x;
+                if (x > field.max) field.max = x;
+            } else if (query.policy == NonNumericPolicy::Throw) {
+                throw IncompatibleTypeError("non-numeric field on line " + 
+                                            std::to_string(line_number + 1));
             }
-        case 'n':
-            if (string_type(iter+1, iter+4) == L"ull") {
-                json = Json(JsonValueType::Null);
-                completed = true;
-                break;
-            } else{
-                goto complete;
+        }
+    }
+}
+
+
+inline string_type _JoinPath(const key_path_type &path)
+{
+    string_type result;
+    for (const auto &key: path) {
+        if (!result.empty()) result.push_back('.');
+        result += key;
+    }
+    return result;
+}
+
+
+// Split data[0, size) into `num_chunks` ranges whose boundaries fall on line 
+// starts. Returns the num_chunks + 1 boundary offsets; ranges may be empty.
+inline std::vector<size_t> _SplitLines(const char *data, size_t size, 
+                                       unsigned num_chunks)
+{
+    std::vector<size_t> bounds(1, 0);
+    for (unsigned i = 1; i < num_chunks; ++i) {
+        size_t bound = std::max(bounds.back(), size * i / num_chunks);
+        const void *newline = bound < size ? 
+                std::memchr(data + bound, '\n', size - bound) : nullptr;
+        bound = newline ? static_cast<const char*>(newline) - data + 1 : size;
+        bounds.push_back(bound);
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+
+// Run a group-by over NDJSON text. The input is split into line-aligned 
+// chunks which are parsed concurrently, each worker projecting only the 
+// grouping key and the aggregated fields and filling its own hash table; 
+// the tables are merged once all workers finish. The result maps each group 
+// key to {"count": n, "<field.path>": {"count", "sum", "min", "max", "mean"}}.
+inline Json GroupBy(const char *data, size_t size, const GroupByQuery &query)
+{
+    unsigned num_threads = _ResolveThreadCount(query.num_threads);
+    // Small inputs are not worth a thread each.
+    constexpr size_t kMinChunkSize = 1 << 16;
+    if (size / kMinChunkSize + 1 < num_threads) {
+        num_threads = static_cast<unsigned>(size / kMinChunkSize + 1);
+    }
+
+    std::vector<size_t> bounds = _SplitLines(data, size, num_threads);
+
+    // Line numbers of the chunk starts, only needed for error messages.
+    std::vector<size_t> first_lines(num_threads, 0);
+    for (unsigned i = 1; i < num_threads; ++i) {
+        first_lines[i] = first_lines[i - 1] + std::count(
+                data + bounds[i - 1], data + bounds[i], '\n');
+    }
+
+    std::vector<_GroupTable> tables(num_threads);
+    // Errors are kept per chunk so that the earliest line is reported.
+    std::vector<std::exception_ptr> errors(num_threads);
+    GetExecutor().ParallelFor(num_threads, [&](size_t i) {
+        try {
+            _GroupByChunk(data + bounds[i], bounds[i + 1] - bounds[i], 
+                          first_lines[i], query, tables[i]);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    });
+    for (auto &error: errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    _GroupTable &merged = tables[0];
+    for (unsigned i = 1; i < num_threads; ++i) {
+        for (auto &entry: tables[i]) {
+            auto inserted = merged.try_emplace(entry.first);
+            auto &state = inserted.first->second;
+            if (inserted.second) {
+                state = std::move(entry.second);
+                continue;
             }
-        case '1': case '2': case '3': case '4': case '5': case '6': case '7':
-        case '8': case '9': case '0': case '-': {
-            string_type::difference_type i;
-            try {
-                i = _ParseNumber(json, iter, end);
-                completed = true;
-            } catch (ParseError &e) {
-                i = e.GetOffset();
+            state.count += entry.second.count;
+            for (size_t j = 0; j < state.fields.size(); ++j) {
+                _MergeAggregate(state.fields[j], entry.second.fields[j]);
             }
-            iter += i;
-            goto complete;
-        }
         }
-        if (completed) break;
-next_iter:
-        ++iter;
     }
-complete:
-    if (!completed) {
-        throw ParseError("invalid json value", 
-                         iter - begin, 
-                         string_type(begin, end));
+
+    Json result(JsonValueType::Object);
+    for (auto &entry: merged) {
+        Json group(JsonValueType::Object);
+        group[L"count"] = static_cast<double>(entry.second.count);
+        for (size_t i = 0; i < query.fields.size(); ++i) {
+            const AggregateResult &field = entry.second.fields[i];
+            Json aggregate(JsonValueType::Object);
+            aggregate[L"count"] = static_cast<double>(field.count);
+            aggregate[L"sum"] = field.sum;
+            if (field.count) {
+                aggregate[L"min"] = field.min;
+                aggregate[L"max"] = field.max;
+                aggregate[L"mean"] = field.Mean();
+            }
+            group[_JoinPath(query.fields[i])] = std::move(aggregate);
+        }
+        string_type key;
+        _AppendUtf8(key, entry.first.data(), entry.first.size());
+        result[key] = std::move(group);
     }
-    return iter - begin;
+    return result;
 }
 };
 
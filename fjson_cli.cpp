@@ -0,0 +1,506 @@
+// fjson: command-line tool for querying and reformatting JSON files.
+//
+// Usage: fjson [options] [file]
+// Reads `file` (mmapped) or standard input, and writes the selected values.
+// Gzip-compressed input is detected and streamed when built with zlib.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fjson.h"
+
+using namespace fjson;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+struct Options
+{
+    int indent = 2;
+    bool indent_given = false;
+    bool ndjson = false;
+    bool stats = false;
+    bool validate = false;
+    unsigned num_threads = 0;
+    std::string pointer;
+    std::string query;
+    const char *file = nullptr;
+};
+
+
+struct Stats
+{
+    double read = 0.;
+    double parse = 0.;
+    double select = 0.;
+    double dump = 0.;
+    double write = 0.;
+    size_t input_bytes = 0;
+    size_t output_bytes = 0;
+    size_t documents = 0;
+};
+
+
+// The input, either mapped from a file or read from a pipe.
+class Input
+{
+public:
+    Input(const Input&) = delete;
+    Input& operator= (const Input&) = delete;
+    explicit Input(const char *file)
+    {
+        if (file == nullptr || std::strcmp(file, "-") == 0) {
+            ReadAll(STDIN_FILENO);
+            return;
+        }
+        int fd = open(file, O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(std::string(file) + ": " +
+                                     std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                mapped_ = static_cast<const char*>(p);
+                size_ = st.st_size;
+                close(fd);
+                return;
+            }
+        }
+        ReadAll(fd);
+        close(fd);
+    }
+    ~Input()
+    {
+        if (mapped_) munmap(const_cast<char*>(mapped_), size_);
+    }
+    const char* data() const { return mapped_ ? mapped_ : buffer_.data(); }
+    size_t size() const { return mapped_ ? size_ : buffer_.size(); }
+private:
+    void ReadAll(int fd)
+    {
+        constexpr size_t kChunkSize = 1 << 20;
+        ssize_t n;
+        do {
+            size_t old_size = buffer_.size();
+            buffer_.resize(old_size + kChunkSize);
+            n = read(fd, &buffer_[old_size], kChunkSize);
+            buffer_.resize(old_size + (n > 0 ? n : 0));
+        } while (n > 0);
+        if (n < 0) throw std::runtime_error(std::strerror(errno));
+    }
+
+    const char *mapped_ = nullptr;
+    size_t size_ = 0;
+    std::string buffer_;
+};
+
+
+string_type Widen(const std::string &s)
+{
+    string_type out;
+    _AppendUtf8(out, s.data(), s.size());
+    return out;
+}
+
+
+// Append the values selected from `json` to `out`, one per line.
+void EmitSelected(const Json &json, const Options &options, std::string &out,
+                  Stats &stats)
+{
+    auto start = Clock::now();
+    std::vector<const Json*> selected{&json};
+    if (!options.pointer.empty()) {
+        const Json *value = json.FindPointer(Widen(options.pointer));
+        selected.assign(value ? 1 : 0, value);
+    } else if (!options.query.empty()) {
+        selected = Select(json, Widen(options.query));
+    }
+    stats.select += SecondsSince(start);
+
+    start = Clock::now();
+    for (const Json *value: selected) {
+        value->Dump(out, options.indent);
+        out.push_back('\n');
+    }
+    stats.dump += SecondsSince(start);
+    ++stats.documents;
+}
+
+
+// Parse one document and append its selected values to `out`.
+void ProcessDocument(const char *data, size_t size, const Options &options,
+                     std::string &out, Stats &stats)
+{
+    auto start = Clock::now();
+    Json json = Json::Parse(data, size);
+    stats.parse += SecondsSince(start);
+    EmitSelected(json, options, out, stats);
+}
+
+
+// Process data[0, size) as NDJSON. `first_line` is used in error messages.
+void ProcessLines(const char *data, size_t size, size_t first_line,
+                  const Options &options, std::string &out, Stats &stats)
+{
+    size_t line_number = first_line;
+    for (const char *p = data, *end = data + size; p < end; ++line_number) {
+        const char *newline = static_cast<const char*>(
+                std::memchr(p, '\n', end - p));
+        const char *line_end = newline ? newline : end;
+        const char *line = p;
+        p = line_end + 1;
+        bool blank = true;
+        for (const char *c = line; c < line_end; ++c) {
+            if (!IsWhitespace(*c)) {
+                blank = false;
+                break;
+            }
+        }
+        if (blank) continue;
+        try {
+            ProcessDocument(line, line_end - line, options, out, stats);
+        } catch (JsonError &e) {
+            throw std::runtime_error("line " + std::to_string(line_number + 1) +
+                                     ": " + e.what());
+        }
+    }
+}
+
+
+void ProcessNdjson(const char *data, size_t size, const Options &options,
+                   std::string &out, Stats &stats)
+{
+    unsigned num_threads = _ResolveThreadCount(options.num_threads);
+    constexpr size_t kMinChunkSize = 1 << 16;
+    if (size / kMinChunkSize + 1 < num_threads) {
+        num_threads = static_cast<unsigned>(size / kMinChunkSize + 1);
+    }
+    std::vector<size_t> bounds = _SplitLines(data, size, num_threads);
+    std::vector<size_t> first_lines(num_threads, 0);
+    for (unsigned i = 1; i < num_threads; ++i) {
+        first_lines[i] = first_lines[i - 1] + std::count(
+                data + bounds[i - 1], data + bounds[i], '\n');
+    }
+
+    // Each worker writes its own buffer; buffers are concatenated in order.
+    std::vector<std::string> outputs(num_threads);
+    std::vector<Stats> worker_stats(num_threads);
+    std::vector<std::exception_ptr> errors(num_threads);
+    GetExecutor().ParallelFor(num_threads, [&](size_t i) {
+        try {
+            ProcessLines(data + bounds[i], bounds[i + 1] - bounds[i],
+                         first_lines[i], options, outputs[i],
+                         worker_stats[i]);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    });
+    for (auto &error: errors) {
+        if (error) std::rethrow_exception(error);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        out += outputs[i];
+        // Per-phase times are summed over workers, i.e. CPU time.
+        stats.parse += worker_stats[i].parse;
+        stats.select += worker_stats[i].select;
+        stats.dump += worker_stats[i].dump;
+        stats.documents += worker_stats[i].documents;
+    }
+}
+
+
+// Without a selection the input is reformatted as text, block by block, 
+// without building any Json values.
+void Reformat(const char *data, size_t size, const Options &options,
+              Stats &stats)
+{
+    constexpr size_t kBlockSize = 1 << 20;
+    Reformatter reformatter(options.indent);
+    std::string out;
+    out.reserve(kBlockSize * 2);
+    for (size_t offset = 0; offset < size; offset += kBlockSize) {
+        auto start = Clock::now();
+        out.clear();
+        try {
+            reformatter.Feed(data + offset, std::min(kBlockSize, size - offset),
+                             out);
+            if (offset + kBlockSize >= size) reformatter.Finish(out);
+        } catch (ParseError &e) {
+            SourceLocation location = GetSourceLocation(data, size, e.GetOffset());
+            throw std::runtime_error(
+                    std::string(e.what()) + " at line " + 
+                    std::to_string(location.line) + ", column " + 
+                    std::to_string(location.column));
+        }
+        // Compact output still ends with a newline.
+        if (offset + kBlockSize >= size && options.indent < 0 && !out.empty()) {
+            out.push_back('\n');
+        }
+        stats.dump += SecondsSince(start);
+
+        start = Clock::now();
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        stats.write += SecondsSince(start);
+        stats.output_bytes += out.size();
+    }
+    std::fflush(stdout);
+}
+
+
+void PrintStats(const Stats &stats, double total);
+
+
+#ifdef FJSON_HAVE_ZLIB
+// Compressed input is inflated on a background thread while the main thread
+// processes it as a stream, so the decompressed text is never held in full.
+void ProcessCompressed(const Input &input, const Options &options,
+                       Stats &stats)
+{
+    MemorySource memory(input.data(), input.size());
+    GzipSource gzip(memory);
+    std::string out;
+    auto flush = [&]() {
+        auto start = Clock::now();
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        stats.write += SecondsSince(start);
+        stats.output_bytes += out.size();
+        out.clear();
+    };
+
+    if (options.pointer.empty() && options.query.empty() && !options.validate) {
+        Reformatter reformatter(options.indent);
+        std::vector<char> block(1 << 20);
+        while (true) {
+            auto start = Clock::now();
+            size_t n = gzip.Read(block.data(), block.size());
+            if (n == 0) {
+                reformatter.Finish(out);
+                if (options.indent < 0 && !out.empty()) out.push_back('\n');
+            } else {
+                reformatter.Feed(block.data(), n, out);
+            }
+            stats.dump += SecondsSince(start);
+            flush();
+            if (n == 0) break;
+        }
+    } else if (options.ndjson) {
+        JsonStreamReader reader(gzip);
+        Json json;
+        while (true) {
+            auto start = Clock::now();
+            bool more = reader.Next(json);
+            stats.parse += SecondsSince(start);
+            if (!more) break;
+            if (options.validate) {
+                ++stats.documents;
+                continue;
+            }
+            EmitSelected(json, options, out, stats);
+            if (out.size() >= (1 << 20)) flush();
+        }
+    } else {
+        auto start = Clock::now();
+        Json json = Json::Parse(gzip);
+        stats.parse += SecondsSince(start);
+        if (options.validate) ++stats.documents;
+        else EmitSelected(json, options, out, stats);
+    }
+    flush();
+    std::fflush(stdout);
+}
+#endif
+
+
+// Check the input without building any Json values. NDJSON input is checked
+// line by line. Returns the exit status: 0 if valid, 1 otherwise.
+int Validate(const char *data, size_t size, const Options &options,
+             Stats &stats, Clock::time_point total_start)
+{
+    auto start = Clock::now();
+    size_t offset = 0;
+    bool valid = true;
+    if (options.ndjson) {
+        size_t line_number = 0;
+        for (const char *p = data, *end = data + size; p < end && valid;
+                ++line_number) {
+            const char *newline = static_cast<const char*>(
+                    std::memchr(p, '\n', end - p));
+            const char *line_end = newline ? newline : end;
+            bool blank = std::all_of(p, line_end, [](char c) {
+                return IsWhitespace(c);
+            });
+            if (!blank && !IsValid(p, line_end - p, &offset)) {
+                valid = false;
+                offset += p - data;
+                std::fprintf(stderr, "fjson: line %zu: ", line_number + 1);
+            }
+            if (!blank) ++stats.documents;
+            p = line_end + 1;
+        }
+    } else {
+        valid = IsValid(data, size, &offset);
+        stats.documents = 1;
+    }
+    stats.parse = SecondsSince(start);
+    if (!valid) {
+        SourceLocation location = GetSourceLocation(data, size, offset);
+        std::fprintf(stderr, "invalid JSON at line %zu, column %zu "
+                     "(byte offset %zu)\n", location.line, location.column,
+                     offset);
+    }
+    if (options.stats) PrintStats(stats, SecondsSince(total_start));
+    return valid ? 0 : 1;
+}
+
+
+void PrintStats(const Stats &stats, double total)
+{
+    double mb = stats.input_bytes / double(1 << 20);
+    std::fprintf(stderr,
+            "documents: %zu\n"
+            "input:     %.3f MB\n"
+            "output:    %.3f MB\n"
+            "read:      %.6f s\n"
+            "parse:     %.6f s (%.1f MB/s)\n"
+            "select:    %.6f s\n"
+            "dump:      %.6f s (reformat when nothing is selected)\n"
+            "write:     %.6f s\n"
+            "total:     %.6f s (%.1f MB/s)\n",
+            stats.documents, mb, stats.output_bytes / double(1 << 20),
+            stats.read, stats.parse, stats.parse > 0 ? mb / stats.parse : 0.,
+            stats.select, stats.dump, stats.write,
+            total, total > 0 ? mb / total : 0.);
+}
+
+
+int Usage(int status)
+{
+    std::fprintf(status ? stderr : stdout,
+            "usage: fjson [options] [file]\n"
+            "  -c, --compact          write compact output\n"
+            "  -i, --indent N         indent by N spaces (default 2)\n"
+            "  -p, --pointer POINTER  select a JSON Pointer, e.g. /items/0\n"
+            "  -q, --query PATH       select a JSONPath, e.g. $.items[*].id\n"
+            "  -n, --ndjson           input has one document per line\n"
+            "  -j, --threads N        worker threads for --ndjson\n"
+            "  -v, --validate         only check that the input is valid JSON\n"
+            "  -s, --stats            print timings to stderr\n"
+            "  -h, --help             show this help\n");
+    return status;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::fprintf(stderr, "fjson: %s needs an argument\n", argv[i]);
+                std::exit(Usage(2));
+            }
+            return argv[++i];
+        };
+        if (arg == "-c" || arg == "--compact") {
+            options.indent = -1;
+            options.indent_given = true;
+        } else if (arg == "-i" || arg == "--indent") {
+            options.indent = std::atoi(value());
+            options.indent_given = true;
+        } else if (arg == "-p" || arg == "--pointer") {
+            options.pointer = value();
+        } else if (arg == "-q" || arg == "--query") {
+            options.query = value();
+        } else if (arg == "-n" || arg == "--ndjson") {
+            options.ndjson = true;
+        } else if (arg == "-j" || arg == "--threads") {
+            options.num_threads = std::strtoul(value(), nullptr, 10);
+        } else if (arg == "-v" || arg == "--validate") {
+            options.validate = true;
+        } else if (arg == "-s" || arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "-h" || arg == "--help") {
+            return Usage(0);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::fprintf(stderr, "fjson: unknown option %s\n", arg.c_str());
+            return Usage(2);
+        } else {
+            options.file = argv[i];
+        }
+    }
+    // NDJSON output stays one document per line unless asked otherwise.
+    if (options.ndjson && !options.indent_given) options.indent = -1;
+    // -j sizes the thread pool as well as the number of chunks.
+    std::unique_ptr<ThreadPool> pool;
+    if (options.num_threads) {
+        pool.reset(new ThreadPool(options.num_threads));
+        SetExecutor(pool.get());
+    }
+
+    Stats stats;
+    auto total_start = Clock::now();
+    try {
+        auto start = Clock::now();
+        Input input(options.file);
+        stats.read = SecondsSince(start);
+        stats.input_bytes = input.size();
+
+#ifdef FJSON_HAVE_ZLIB
+        if (IsGzip(input.data(), input.size())) {
+            ProcessCompressed(input, options, stats);
+            if (options.stats) PrintStats(stats, SecondsSince(total_start));
+            return 0;
+        }
+#endif
+        if (options.validate) {
+            return Validate(input.data(), input.size(), options, stats,
+                            total_start);
+        }
+        if (options.pointer.empty() && options.query.empty()) {
+            Reformat(input.data(), input.size(), options, stats);
+            if (options.stats) PrintStats(stats, SecondsSince(total_start));
+            return 0;
+        }
+
+        std::string out;
+        if (options.ndjson) {
+            ProcessNdjson(input.data(), input.size(), options, out, stats);
+        } else {
+            ProcessDocument(input.data(), input.size(), options, out, stats);
+        }
+
+        start = Clock::now();
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        std::fflush(stdout);
+        stats.write = SecondsSince(start);
+        stats.output_bytes = out.size();
+    } catch (std::exception &e) {
+        std::fprintf(stderr, "fjson: %s\n", e.what());
+        return 1;
+    }
+    if (options.stats) PrintStats(stats, SecondsSince(total_start));
+    return 0;
+}
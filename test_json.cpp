@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include <iostream>
 #include <exception>
+#include <sstream>
+#include <thread>
 #include "fjson.h"
 
 using namespace fjson;
@@ -192,6 +194,1099 @@ TEST(JsonTest, JsonParseObject)
     ASSERT_EQ(json["test"].GetStringRef(), L"test2");
 }
 
+TEST(JsonTest, JsonParseNested)
+{
+    Json json = Json::Parse(LR"({"a": [1, [2, 0.5], {}], "b": {"c": null}, "d": []})");
+    ASSERT_EQ(json["a"].size(), 3);
+    ASSERT_EQ(json["a"][1][1].ToDouble(), 0.5);
+    ASSERT_EQ(json["a"][2].size(), 0);
+    ASSERT_TRUE(json["b"]["c"].IsNull());
+    ASSERT_EQ(json["d"].size(), 0);
+    ASSERT_THROW(Json::Parse(L"[1, 2] x"), ParseError);
+
+    // Numbers end at a closing bracket and keep their fraction; literals 
+    // are consumed before the next token.
+    json = Json::Parse(L"[[ 1.25],{\"x\": 2.5}, true, false,null ]");
+    ASSERT_EQ(json.size(), 5);
+    ASSERT_EQ(json[0][0].ToDouble(), 1.25);
+    ASSERT_EQ(json[1]["x"].ToDouble(), 2.5);
+    ASSERT_TRUE(json[2].ToBool());
+    ASSERT_FALSE(json[3].ToBool());
+    ASSERT_TRUE(json[4].IsNull());
+    ASSERT_THROW(Json::Parse(L"[1 2]"), ParseError);
+    ASSERT_THROW(Json::Parse(L"{\"a\": 1 \"b\": 2}"), ParseError);
+}
+
+
+TEST(JsonTest, JsonAggregate)
+{
+    Json json = {1., 2., "three", 4., 5., -6., 7.};
+    AggregateResult result = Aggregate(json);
+    ASSERT_EQ(result.count, 6);
+    ASSERT_EQ(result.sum, 13.);
+    ASSERT_EQ(result.min, -6.);
+    ASSERT_EQ(result.max, 7.);
+    ASSERT_THROW(Aggregate(json, NonNumericPolicy::Throw), IncompatibleTypeError);
+    ASSERT_TRUE(std::isnan(Mean(Json(JsonValueType::Array))));
+
+    json = Json::Parse(LR"([{"latency": {"p99": 3}}, {"latency": {"p99": 5}}, 
+                            {"latency": {}}, {"other": 1}])");
+    result = Aggregate(json, {L"latency", L"p99"});
+    ASSERT_EQ(result.count, 2);
+    ASSERT_EQ(result.Mean(), 4.);
+    ASSERT_THROW(Aggregate(json, {L"latency", L"p99"}, NonNumericPolicy::Throw), 
+                 IncompatibleTypeError);
+}
+
+TEST(JsonTest, JsonCompare)
+{
+    ASSERT_TRUE(Json(JsonValueType::Null) < Json(false));
+    ASSERT_TRUE(Json(true) < Json(-1.));
+    ASSERT_TRUE(Json(2.) < Json("a"));
+    ASSERT_TRUE(Json("a") < Json("b"));
+    ASSERT_TRUE(Json({1., 2.}) < Json({1., 3.}));
+    ASSERT_TRUE(Json({1., 2.}) < Json({1., 2., 0.}));
+    ASSERT_EQ(Json::Parse(LR"({"a": [1, {"b": null}]})"), 
+              Json::Parse(LR"({"a": [1, {"b": null}]})"));
+    ASSERT_NE(Json::Parse(LR"({"a": 1})"), Json::Parse(LR"({"b": 1})"));
+}
+
+
+TEST(JsonTest, JsonSortBy)
+{
+    Json json = Json::Parse(LR"([{"k": 3, "id": 0}, {"k": 1, "id": 1}, 
+                                 {"k": 3, "id": 2}, {"k": 2, "id": 3}])");
+    json.SortBy({L"k"});
+    ASSERT_EQ(json[0]["id"].ToDouble(), 1.);
+    ASSERT_EQ(json[1]["id"].ToDouble(), 3.);
+    ASSERT_EQ(json[2]["id"].ToDouble(), 0.);
+    ASSERT_EQ(json[3]["id"].ToDouble(), 2.);
+
+    json = Json::Parse(LR"([{"k": "b"}, {}, {"k": 1}, {"k": "a"}])");
+    json.SortBy({L"k"});
+    ASSERT_EQ(json[0].size(), 0);
+    ASSERT_EQ(json[1]["k"].ToDouble(), 1.);
+    ASSERT_EQ(json[2]["k"].GetStringRef(), L"a");
+
+    // Large enough to take the multi-threaded path.
+    Json large(JsonValueType::Array);
+    const int n = 100000;
+    for (int i = 0; i < n; ++i) {
+        large.GetArrayRef().push_back(Json({{"k", double((i * 7919) % n)}}));
+    }
+    large.SortBy({L"k"}, 4);
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(large[i]["k"].ToDouble(), double(i));
+    }
+    large.Sort(4);
+    ASSERT_EQ(large[n - 1]["k"].ToDouble(), double(n - 1));
+}
+
+TEST(JsonTest, JsonParseProjected)
+{
+    Json json = ParseProjected(
+            LR"({"skip": [1, {"x": "}"}], "a": {"b": 1, "c": [2]}, "d": "e"})", 
+            {{L"a", L"b"}, {L"d"}});
+    ASSERT_EQ(json.size(), 2);
+    ASSERT_EQ(json["a"].size(), 1);
+    ASSERT_EQ(json["a"]["b"].ToDouble(), 1.);
+    ASSERT_EQ(json["d"].GetStringRef(), L"e");
+}
+
+
+TEST(JsonTest, JsonGroupBy)
+{
+    std::string log;
+    for (int i = 0; i < 20000; ++i) {
+        log += "{\"service\": \"svc" + std::to_string(i % 3) + 
+               "\", \"latency\": {\"p99\": " + std::to_string(i % 10) + 
+               "}, \"tags\": [\"x\"]}\n";
+    }
+    log += "{\"latency\": {\"p99\": 100}}\n\n";
+    // Keys of different types are different groups.
+    log += "{\"service\": null}\n{\"service\": \"null\"}\n";
+    log += "{\"service\": 1}\n{\"service\": \"1\"}\n{\"service\": 1.0}\n";
+
+    GroupByQuery query;
+    query.group_by = {L"service"};
+    query.fields = {{L"latency", L"p99"}};
+    query.num_threads = 4;
+    Json result = GroupBy(log.data(), log.size(), query);
+    ASSERT_EQ(result.size(), 8);
+    ASSERT_EQ(result["\"svc0\""]["count"].ToDouble(), 6667.);
+    ASSERT_EQ(result["\"svc1\""]["latency.p99"]["max"].ToDouble(), 9.);
+    // Records missing the key.
+    ASSERT_EQ(result[""]["latency.p99"]["sum"].ToDouble(), 100.);
+    ASSERT_EQ(result["null"]["count"].ToDouble(), 1.);
+    ASSERT_EQ(result["\"null\""]["count"].ToDouble(), 1.);
+    ASSERT_EQ(result["1"]["count"].ToDouble(), 2.);
+    ASSERT_EQ(result["\"1\""]["count"].ToDouble(), 1.);
+
+    double total = 0.;
+    for (const auto &group: result.GetObjectRef()) {
+        total += group.second["latency.p99"]["sum"].ToDouble();
+    }
+    ASSERT_EQ(total, 20000 / 10 * 45 + 100.);
+
+    // Count-only queries merge the per-chunk counts too.
+    GroupByQuery count_query;
+    count_query.group_by = {L"service"};
+    count_query.num_threads = 4;
+    Json counts = GroupBy(log.data(), log.size(), count_query);
+    ASSERT_EQ(counts["\"svc0\""]["count"].ToDouble(), 6667.);
+    ASSERT_EQ(counts["\"svc1\""]["count"].ToDouble(), 6667.);
+    ASSERT_EQ(counts["\"svc2\""]["count"].ToDouble(), 6666.);
+
+    log += "{\"service\": \n";
+    ASSERT_THROW(GroupBy(log.data(), log.size(), query), ParseError);
+}
+
+TEST(JsonTest, JsonDump)
+{
+    Json json = Json::Parse(LR"({"b": [1, 0.1, -2.5e-8, true, null], "a": "q\"\u00e9\n", "e": {}})");
+    ASSERT_EQ(json.Dump(), 
+              "{\"a\":\"q\\\"\\u00e9\\n\",\"b\":[1,0.1,-2.5e-08,true,null],\"e\":{}}");
+    ASSERT_EQ(Json(L"q\"\u00e9\n").Dump(), "\"q\\\"\xc3\xa9\\n\"");
+    ASSERT_EQ(Json::Parse(LR"({"k": [1, {}]})").Dump(2), 
+              "{\n  \"k\": [\n    1,\n    {}\n  ]\n}");
+    std::string text = json.Dump(4);
+    ASSERT_EQ(Json::Parse(text.data(), text.size()), json);
+}
+
+
+TEST(JsonTest, JsonSelect)
+{
+    Json json = Json::Parse(LR"({"items": [{"id": 1, "a/b": {"id": 2}}, {"id": 3}], "id": 0})");
+    ASSERT_EQ(json.FindPointer(L"/items/1/id")->ToDouble(), 3.);
+    ASSERT_EQ(json.FindPointer(L"/items/0/a~1b/id")->ToDouble(), 2.);
+    ASSERT_EQ(json.FindPointer(L""), &json);
+    ASSERT_EQ(json.FindPointer(L"/items/2"), nullptr);
+    ASSERT_EQ(json.FindPointer(L"/items/01"), nullptr);
+
+    auto selected = Select(json, L"$.items[*].id");
+    ASSERT_EQ(selected.size(), 2);
+    ASSERT_EQ(selected[1]->ToDouble(), 3.);
+    ASSERT_EQ(Select(json, L"$.items[-1]['id']")[0]->ToDouble(), 3.);
+    ASSERT_EQ(Select(json, L"$..id").size(), 4);
+    ASSERT_THROW(Select(json, L"$.items[x]"), ParseError);
+}
+
+TEST(JsonTest, JsonReformat)
+{
+    std::string text = "{ \"b\" : [1.50, {} ,[ ]], \"a\":\"x \\\" , y\" }";
+    ASSERT_EQ(Minify(text.data(), text.size()), 
+              "{\"b\":[1.50,{},[]],\"a\":\"x \\\" , y\"}");
+    ASSERT_EQ(Prettify(text.data(), text.size(), 2), 
+              "{\n  \"b\": [\n    1.50,\n    {},\n    []\n  ],\n"
+              "  \"a\": \"x \\\" , y\"\n}\n");
+
+    // Feeding one byte at a time gives the same result.
+    std::string out;
+    Reformatter reformatter(2);
+    for (char c: text) reformatter.Feed(&c, 1, out);
+    reformatter.Finish(out);
+    ASSERT_EQ(out, Prettify(text.data(), text.size(), 2));
+
+    text = "{\"a\": 1}\n\n[2]\n";
+    ASSERT_EQ(Minify(text.data(), text.size()), "{\"a\":1}\n[2]");
+    text = "[1, {]";
+    ASSERT_THROW(Minify(text.data(), text.size()), ParseError);
+    text = "[\"abc]";
+    ASSERT_THROW(Minify(text.data(), text.size()), ParseError);
+
+    // The token grammar is checked, so invalid input is not silently joined.
+    for (std::string invalid: {"[1 2]", "[1,]", "[,1]", "[1,,2]", "{\"a\" 1}", 
+                               "{\"a\":}", "{\"a\":1,}", "{1:2}", "{\"a\"}", 
+                               "[1:2]", "[\"a\" \"b\"]", "[true false]", 
+                               "[tru]", "[01]", "[1.]", "[-]", "[1]x", 
+                               "[1][2]", "1,", "{\"a\":1 \"b\":2}", "[", "{\"a\""}) {
+        ASSERT_THROW(Minify(invalid.data(), invalid.size()), ParseError) 
+                << invalid;
+        // Byte by byte, so tokens are split across chunks.
+        ASSERT_THROW({
+            std::string sink;
+            Reformatter chunked(-1);
+            for (char c: invalid) chunked.Feed(&c, 1, sink);
+            chunked.Finish(sink);
+        }, ParseError) << invalid;
+    }
+    text = "[-1.5e+3, true, null] 0 \"a\"";
+    out.clear();
+    Reformatter chunked(-1);
+    for (char c: text) chunked.Feed(&c, 1, out);
+    chunked.Finish(out);
+    ASSERT_EQ(out, "[-1.5e+3,true,null]\n0\n\"a\"");
+    ASSERT_EQ(Minify(text.data(), text.size()), out);
+    ASSERT_EQ(Minify("", 0), "");
+    ASSERT_EQ(Minify(" \n", 2), "");
+}
+
+TEST(JsonTest, JsonIsValid)
+{
+    auto valid = [](const std::string &text) {
+        return IsValid(text.data(), text.size());
+    };
+    ASSERT_TRUE(valid(R"( {"a": [1, -0.5e+3, true, false, null, "\u00e9\n"], "b": {}} )"));
+    ASSERT_TRUE(valid("[[[]]]"));
+    ASSERT_TRUE(valid("\"\xc3\xa9\""));
+    ASSERT_TRUE(valid("0"));
+    ASSERT_FALSE(valid(""));
+    ASSERT_FALSE(valid("[1,]"));
+    ASSERT_FALSE(valid("{\"a\" 1}"));
+    ASSERT_FALSE(valid("{\"a\": 1,}"));
+    ASSERT_FALSE(valid("[01]"));
+    ASSERT_FALSE(valid("[1.]"));
+    ASSERT_FALSE(valid("[tru]"));
+    ASSERT_FALSE(valid("\"\\x\""));
+    ASSERT_FALSE(valid("\"a\nb\""));
+    ASSERT_FALSE(valid("\"\xc3\""));
+    // RFC 3629 boundaries: overlong forms, surrogates and code points past 
+    // U+10FFFF are rejected, their neighbours accepted.
+    ASSERT_FALSE(valid("\"\xc1\xbf\""));
+    ASSERT_FALSE(valid("\"\xe0\x9f\xbf\""));
+    ASSERT_TRUE(valid("\"\xe0\xa0\x80\""));
+    ASSERT_TRUE(valid("\"\xed\x9f\xbf\""));
+    ASSERT_FALSE(valid("\"\xed\xa0\x80\""));
+    ASSERT_FALSE(valid("\"\xed\xbf\xbf\""));
+    ASSERT_TRUE(valid("\"\xee\x80\x80\""));
+    ASSERT_FALSE(valid("\"\xf0\x8f\xbf\xbf\""));
+    ASSERT_TRUE(valid("\"\xf0\x90\x80\x80\""));
+    ASSERT_TRUE(valid("\"\xf4\x8f\xbf\xbf\""));
+    ASSERT_FALSE(valid("\"\xf4\x90\x80\x80\""));
+    ASSERT_FALSE(valid("\"\xf5\x80\x80\x80\""));
+    ASSERT_FALSE(valid("[1] [2]"));
+    ASSERT_FALSE(valid(std::string(100000, '[')));
+
+    size_t offset = 0;
+    std::string text = "{\"a\": [1, 2}";
+    ASSERT_FALSE(IsValid(text.data(), text.size(), &offset));
+    ASSERT_EQ(offset, 11);
+
+    // Nesting is limited as in Parse(), so both accept the same documents.
+    for (size_t depth: {kMaxParseDepth, kMaxParseDepth + 1}) {
+        for (bool objects: {false, true}) {
+            std::string nested;
+            for (size_t i = 1; i < depth; ++i) nested += objects ? "{\"a\":" : "[";
+            nested += objects ? "{}" : "[]";
+            nested += std::string(depth - 1, objects ? '}' : ']');
+            bool parses = true;
+            try {
+                Json::Parse(string_type(nested.begin(), nested.end()));
+            } catch (ParseError &) {
+                parses = false;
+            }
+            ASSERT_EQ(parses, depth == kMaxParseDepth);
+            ASSERT_EQ(IsValid(nested.data(), nested.size(), &offset), parses);
+        }
+    }
+    ASSERT_EQ(offset, 5 * kMaxParseDepth);
+
+    // Parse() applies the same rule to characters inside strings: only 
+    // U+0000 to U+001F must be escaped, and Dump() output parses again.
+    for (std::string text: {"[\"a\x7f\"]", "[\"a\xc2\x80\"]", "[\"a\xc2\x85\"]", 
+                            "[\"a\xc2\x9f\"]", "[\"a\x1f\"]", "[\"a\x01\"]"}) {
+        bool parses = true;
+        try {
+            Json json = Json::Parse(text.data(), text.size());
+            std::string dumped = json.Dump();
+            ASSERT_EQ(Json::Parse(dumped.data(), dumped.size()), json);
+        } catch (ParseError &) {
+            parses = false;
+        }
+        ASSERT_EQ(IsValid(text.data(), text.size()), parses);
+        ASSERT_EQ(parses, static_cast<unsigned char>(text[3]) >= 0x20);
+    }
+}
+
+TEST(JsonTest, JsonParseStream)
+{
+    // \xc3\xa9 straddles the 64 KB chunk boundary.
+    std::string text = "[\"" + std::string(kInputChunkSize - 3, 'x') + "\xc3\xa9\"]";
+    std::istringstream stream(text);
+    Json json = Json::Parse(stream);
+    ASSERT_EQ(json[0].GetStringRef().size(), kInputChunkSize - 2);
+    ASSERT_EQ(json[0].GetStringRef().back(), L'\u00e9');
+
+    std::istringstream values(
+            "{\"a\": \"}\\\"\"}\n[1, [2]] \"s\" 3\n\ntrue{\"b\": 4}\n");
+    IstreamSource source(values);
+    // A tiny chunk size forces compaction and growth of the buffer.
+    JsonStreamReader reader(source, 3);
+    std::vector<Json> results;
+    while (reader.Next(json)) results.push_back(json);
+    ASSERT_EQ(results.size(), 6);
+    ASSERT_EQ(results[0]["a"].GetStringRef(), L"}\"");
+    ASSERT_EQ(results[1][1][0].ToDouble(), 2.);
+    ASSERT_EQ(results[2].GetStringRef(), L"s");
+    ASSERT_EQ(results[3].ToDouble(), 3.);
+    ASSERT_TRUE(results[4].IsTrue());
+    ASSERT_EQ(results[5]["b"].ToDouble(), 4.);
+
+    std::istringstream truncated("[1] [2");
+    IstreamSource truncated_source(truncated);
+    JsonStreamReader truncated_reader(truncated_source);
+    ASSERT_TRUE(truncated_reader.Next(json));
+    ASSERT_THROW(truncated_reader.Next(json), ParseError);
+
+#ifdef FJSON_HAVE_POSIX_IO
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::string piped = "{\"pipe\": [1, 2, 3]}";
+    ASSERT_EQ(write(fds[1], piped.data(), piped.size()), (ssize_t)piped.size());
+    close(fds[1]);
+    FdSource fd_source(fds[0]);
+    json = Json::Parse(fd_source);
+    close(fds[0]);
+    ASSERT_EQ(json["pipe"].size(), 3);
+#endif
+}
+
+#ifdef FJSON_HAVE_ZLIB
+TEST(JsonTest, JsonGzipSource)
+{
+    std::string ndjson;
+    for (int i = 0; i < 50000; ++i) {
+        ndjson += "{\"i\": " + std::to_string(i) + ", \"s\": \"\xc3\xa9\"}\n";
+    }
+    // Two gzip members back to back, as produced by appending to a log.
+    std::string compressed;
+    for (int member = 0; member < 2; ++member) {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        ASSERT_EQ(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                               15 + 16, 8, Z_DEFAULT_STRATEGY), Z_OK);
+        std::string out(deflateBound(&stream, ndjson.size()), '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(&ndjson[0]);
+        stream.avail_in = ndjson.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = out.size();
+        ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        compressed += out;
+    }
+    ASSERT_TRUE(IsGzip(compressed.data(), compressed.size()));
+
+    for (bool background: {true, false}) {
+        MemorySource memory(compressed.data(), compressed.size());
+        GzipSource gzip(memory, background, 4096);
+        JsonStreamReader reader(gzip);
+        Json json;
+        double sum = 0.;
+        size_t count = 0;
+        while (reader.Next(json)) {
+            sum += json["i"].ToDouble();
+            ++count;
+        }
+        ASSERT_EQ(count, 100000);
+        ASSERT_EQ(sum, 2. * 49999. * 50000. / 2.);
+        ASSERT_EQ(json["s"].GetStringRef(), L"\u00e9");
+    }
+
+    // Truncated input is reported from Read() on the consuming thread.
+    MemorySource truncated(compressed.data(), compressed.size() / 4);
+    GzipSource gzip(truncated);
+    JsonStreamReader reader(gzip);
+    Json json;
+    ASSERT_THROW(while (reader.Next(json)) {}, JsonError);
+}
+#endif
+
+TEST(JsonTest, JsonLazyString)
+{
+    Json json = Json::Parse(LR"(["plain", "esc\"aped\u0041\n", "\u00e9"])");
+    // Undecoded and escape-free strings are written without re-escaping. 
+    // Only the latter are exposed, since the raw text of the former is 
+    // replaced when it is decoded.
+    ASSERT_NE(json[0].GetVerbatimString(), nullptr);
+    ASSERT_EQ(json[1].GetVerbatimString(), nullptr);
+    ASSERT_EQ(json.Dump(), "[\"plain\",\"esc\\\"aped\\u0041\\n\",\"\\u00e9\"]");
+
+    const Json &const_json = json;
+    ASSERT_EQ(const_json[1].GetStringRef(), L"esc\"apedA\n");
+    ASSERT_EQ(json[1].GetVerbatimString(), nullptr);
+    ASSERT_EQ(json.Dump(), "[\"plain\",\"esc\\\"apedA\\n\",\"\\u00e9\"]");
+    // The text written for a string changes once it is read, the value 
+    // it parses to does not (see Dump()).
+    std::string before_read = json.Dump(2);
+    ASSERT_EQ(const_json[2].GetStringRef(), L"\u00e9");
+    std::string after_read = json.Dump(2);
+    ASSERT_NE(before_read, after_read);
+    ASSERT_EQ(json[2].Dump(), "\"\xc3\xa9\"");
+    ASSERT_EQ(Json::Parse(before_read.data(), before_read.size()), 
+              Json::Parse(after_read.data(), after_read.size()));
+
+    // Mutable access drops the verbatim flag.
+    json[0].GetStringRef() += L"\"";
+    ASSERT_EQ(json[0].GetVerbatimString(), nullptr);
+    ASSERT_EQ(json[0].Dump(), "\"plain\\\"\"");
+
+    // Concurrent first access decodes once.
+    Json shared = Json::Parse(LR"("a\tb")");
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&shared]() {
+            const Json &reader = shared;
+            ASSERT_EQ(reader.GetStringRef(), L"a\tb");
+        });
+    }
+    for (auto &reader: readers) reader.join();
+
+    // Writing the raw text while another thread decodes it.
+    for (int round = 0; round < 50; ++round) {
+        Json strings = Json::Parse(LR"(["x\ty", "\u00e9\u00e9", "\\"])");
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&strings, i]() {
+                const Json &reader = strings;
+                if (i % 2) {
+                    ASSERT_EQ(reader[0].GetStringRef(), L"x\ty");
+                    ASSERT_EQ(reader[1].GetStringRef(), L"\u00e9\u00e9");
+                    ASSERT_EQ(reader[2].GetStringRef(), L"\\");
+                } else {
+                    std::string text = reader.Dump();
+                    ASSERT_TRUE(text == "[\"x\\ty\",\"\\u00e9\\u00e9\",\"\\\\\"]" || 
+                                text == "[\"x\\ty\",\"\u00e9\u00e9\",\"\\\\\"]");
+                }
+            });
+        }
+        for (auto &thread: threads) thread.join();
+    }
+    ASSERT_THROW(Json::Parse(LR"("\x")"), ParseError);
+    ASSERT_THROW(Json::Parse(LR"("\u12g4")"), ParseError);
+}
+
+TEST(JsonTest, JsonSourceLocation)
+{
+    string_type text = L"{\n  \"a\": [1,\n    true],\n  \"b\": \"x\"\n}";
+    SourceMap source_map;
+    Json json = Json::Parse(text, source_map);
+    SourceMap::Span span;
+    ASSERT_TRUE(source_map.Find(json["a"], span));
+    ASSERT_EQ(text.substr(span.begin, span.end - span.begin), L"[1,\n    true]");
+    ASSERT_TRUE(source_map.Find(json["a"][1], span));
+    SourceLocation location = GetSourceLocation(text, span.begin);
+    ASSERT_EQ(location.line, 3);
+    ASSERT_EQ(location.column, 5);
+    ASSERT_TRUE(source_map.Find(json, span));
+    ASSERT_EQ(span.end, text.size());
+    ASSERT_FALSE(source_map.Find(Json(1.), span));
+    ASSERT_EQ(source_map.size(), 5);
+
+    // A duplicate key discards the earlier value: its nodes get no spans, 
+    // even when a later node reuses their address.
+    string_type duplicates = L"{\"a\": [1, 2, 3], \"a\": 0, \"b\": [4, 5, 6]}";
+    SourceMap duplicate_map;
+    Json document = Json::Parse(duplicates, duplicate_map);
+    ASSERT_EQ(duplicate_map.size(), 6);
+    auto text_of = [&](const Json &value) {
+        SourceMap::Span value_span;
+        if (!duplicate_map.Find(value, value_span)) return string_type(L"-");
+        return duplicates.substr(value_span.begin, value_span.end - value_span.begin);
+    };
+    ASSERT_EQ(text_of(document[L"a"]), L"0");
+    ASSERT_EQ(text_of(document[L"b"]), L"[4, 5, 6]");
+    ASSERT_EQ(text_of(document[L"b"][0]), L"4");
+    ASSERT_EQ(text_of(document), duplicates);
+
+    try {
+        Json::Parse(L"[1,\n 2,\n  x]");
+        FAIL();
+    } catch (ParseError &e) {
+        ASSERT_EQ(e.GetLine(), 3);
+        ASSERT_EQ(e.GetColumn(), 3);
+    }
+}
+
+TEST(JsonTest, JsonFrozen)
+{
+    Json json = Json::Parse(L"{\"name\": \"fjson\", \"tags\": [1, true, null], "
+                            L"\"nested\": {\"z\": -2.5, \"a\": \"\\u00e9\"}}");
+    std::vector<uint64_t> storage(FrozenImageSize(json) / 8);
+    char *image = reinterpret_cast<char*>(storage.data());
+    Freeze(json, image);
+    FrozenValue root = FrozenValue::Root(image, storage.size() * 8);
+    ASSERT_TRUE(root.IsObject());
+    ASSERT_EQ(root.size(), 3);
+    FrozenValue value = root;
+    ASSERT_TRUE(root.Find(L"tags", value));
+    ASSERT_EQ(value.size(), 3);
+    ASSERT_EQ(value[0].ToDouble(), 1.);
+    ASSERT_TRUE(value[1].ToBool());
+    ASSERT_TRUE(value[2].IsNull());
+    ASSERT_THROW(value[3], JsonError);
+    ASSERT_TRUE(root.Find(L"nested", value));
+    ASSERT_TRUE(value.Find(L"a", value));
+    ASSERT_EQ(value.ToString(), L"\u00e9");
+    ASSERT_FALSE(root.Find(L"missing", value));
+    ASSERT_THROW(root.ToDouble(), IncompatibleTypeError);
+    ASSERT_EQ(root.Thaw(), json);
+    ASSERT_THROW(FrozenValue::Root("garbage garbage garbage garbage", 32), JsonError);
+
+    // Offsets, counts and lengths that point outside the image are rejected.
+    auto corrupt = [&](size_t word, uint64_t value) {
+        std::vector<uint64_t> copy(storage);
+        copy[word] = value;
+        FrozenValue root = FrozenValue::Root(reinterpret_cast<char*>(copy.data()), 
+                                             copy.size() * 8);
+        root.Thaw();
+    };
+    // The header word holding the root offset.
+    const size_t root_word = 3;
+    ASSERT_THROW(corrupt(root_word, storage.size() * 8), JsonError);
+    ASSERT_THROW(corrupt(root_word, 7), JsonError);
+    // The root object's member count, its first key offset (pointing back 
+    // at the object itself), and that key's length.
+    size_t object = storage[root_word] / 8;
+    ASSERT_THROW(corrupt(object + 1, uint64_t(1) << 60), JsonError);
+    ASSERT_THROW(corrupt(object + 2, storage[root_word]), JsonError);
+    ASSERT_THROW(corrupt(storage[object + 2] / 8 + 1, uint64_t(1) << 60), JsonError);
+    // Type words that name no type, including ones that only look valid 
+    // once truncated.
+    ASSERT_THROW(corrupt(object, 100000), JsonError);
+    ASSERT_THROW(corrupt(object, uint64_t(0x4000000000)), JsonError);
+
+#ifdef FJSON_HAVE_POSIX_IO
+    std::string name = "/fjson-test-" + std::to_string(getpid());
+    {
+        SharedDocument created = SharedDocument::Create(name, json);
+        SharedDocument opened = SharedDocument::Open(name);
+        ASSERT_EQ(opened.Root().Thaw(), json);
+        ASSERT_THROW(SharedDocument::Create(name, json), JsonError);
+    }
+    SharedDocument::Unlink(name);
+    ASSERT_THROW(SharedDocument::Open(name), JsonError);
+#endif
+}
+
+#ifdef FJSON_USE_PMR
+// Counts what is allocated through it, forwarding to the default resource.
+class CountingResource: public std::pmr::memory_resource
+{
+public:
+    size_t allocations = 0;
+    size_t outstanding = 0;
+    // Throw std::bad_alloc instead of allocating.
+    bool fail = false;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (fail) throw std::bad_alloc();
+        ++allocations;
+        ++outstanding;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        --outstanding;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+TEST(JsonTest, JsonMemoryResource)
+{
+    string_type text = L"{\"items\": [3, \"a string longer than the small buffer\", "
+                       L"{\"k\": null}, 1], \"a key longer than the small buffer\": true}";
+    CountingResource counting;
+    Json json;
+    {
+        MemoryResourceScope scope(&counting);
+        ASSERT_EQ(GetMemoryResource(), &counting);
+        json = Json::Parse(text);
+    }
+    ASSERT_EQ(GetMemoryResource(), std::pmr::get_default_resource());
+    ASSERT_GT(counting.allocations, 0);
+    ASSERT_EQ(json, Json::Parse(text));
+    auto &items = json[L"items"].GetArrayRef();
+    ASSERT_EQ(items.get_allocator().resource(), &counting);
+    size_t allocations = counting.allocations;
+    for (int i = 0; i < 8; ++i) items.push_back(Json(double(i)));
+    ASSERT_GT(counting.allocations, allocations);
+    json[L"items"].Sort();
+    ASSERT_EQ(items.front(), Json(0.));
+    json = Json();
+    ASSERT_EQ(counting.outstanding, 0);
+
+    std::pmr::monotonic_buffer_resource arena;
+    {
+        MemoryResourceScope scope(&arena);
+        json = Json::Parse(text);
+    }
+    ASSERT_EQ(json.Dump(), Json::Parse(text).Dump());
+    json = Json();
+}
+
+TEST(JsonTest, JsonTransactionFailedOperation)
+{
+    // An operation that throws is not recorded, so rolling back does not 
+    // undo a change that never happened.
+    CountingResource counting;
+    Json json;
+    {
+        MemoryResourceScope scope(&counting);
+        json = Json::Parse(L"{\"items\": [1, 2]}");
+    }
+    Json items = json[L"items"];
+    items.GetArrayRef().shrink_to_fit();
+    Transaction transaction;
+    transaction.Set(json, L"count", Json(2.));
+    counting.fail = true;
+    ASSERT_THROW(transaction.PushBack(items, Json(3.)), std::bad_alloc);
+    ASSERT_THROW(transaction.InsertAt(items, 0, Json(0.)), std::bad_alloc);
+    ASSERT_THROW(transaction.Set(json, L"added", Json(true)), std::bad_alloc);
+    counting.fail = false;
+    ASSERT_EQ(transaction.size(), 1);
+    transaction.Rollback();
+    ASSERT_EQ(json.Dump(), "{\"items\":[1,2]}");
+}
+
+TEST(JsonTest, JsonHugePageArena)
+{
+    HugePageArena arena(kHugePageSize);
+    void *p = arena.allocate(24, 8);
+    void *q = arena.allocate(100, 64);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(q) % 64, 0);
+    ASSERT_GE(static_cast<char*>(q), static_cast<char*>(p) + 24);
+    // Larger than a chunk: gets a chunk of its own.
+    ASSERT_NE(arena.allocate(3 * kHugePageSize, 16), nullptr);
+    ASSERT_EQ(arena.Capacity(), 3 * kHugePageSize + kHugePageSize);
+    arena.Reset();
+    ASSERT_EQ(arena.allocate(24, 8), p);
+
+    Json json;
+    {
+        MemoryResourceScope scope(&arena);
+        json = Json::Parse(L"[{\"a\": 1}, \"text\", [true, null]]");
+    }
+    ASSERT_EQ(json.Dump(), "[{\"a\":1},\"text\",[true,null]]");
+    json = Json();
+}
+#endif
+
+// Runs everything on the calling thread, counting ParallelFor calls.
+class CountingExecutor: public Executor
+{
+public:
+    size_t calls = 0;
+    unsigned Concurrency() const override { return 4; }
+    void ParallelFor(size_t n, const std::function<void(size_t)> &f) override
+    {
+        ++calls;
+        for (size_t i = 0; i < n; ++i) f(i);
+    }
+};
+
+TEST(JsonTest, JsonThreadPool)
+{
+    ThreadPool pool(4);
+    ASSERT_EQ(pool.Concurrency(), 4);
+    std::vector<std::atomic<int> > hits(1000);
+    pool.ParallelFor(hits.size(), [&](size_t i) {
+        // Nested loops run on the same pool without deadlocking.
+        pool.ParallelFor(3, [&](size_t) { ++hits[i]; });
+    });
+    for (auto &hit: hits) ASSERT_EQ(hit.load(), 3);
+    ASSERT_THROW(pool.ParallelFor(10, [](size_t i) {
+        if (i == 7) throw JsonError("task failed");
+    }), JsonError);
+
+    // A thread with nothing left to run sleeps until its tasks finish 
+    // instead of spinning: waiting ~250 ms for the slower task, which a 
+    // worker has taken meanwhile, costs next to no CPU time.
+    std::clock_t cpu_start = std::clock();
+    pool.ParallelFor(2, [](size_t i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(i ? 300 : 50));
+    });
+    ASSERT_LT(double(std::clock() - cpu_start) / CLOCKS_PER_SEC, 0.05);
+
+    CountingExecutor counting;
+    Executor *previous = SetExecutor(&counting);
+    ASSERT_EQ(&GetExecutor(), &counting);
+    Json json(JsonValueType::Array);
+    for (int i = 0; i < (1 << 16); ++i) json.GetArrayRef().push_back(Json(double(i % 97)));
+    json.Sort();
+    ASSERT_GT(counting.calls, 0);
+    ASSERT_EQ(json[0], Json(0.));
+    ASSERT_EQ(json[json.size() - 1], Json(96.));
+    SetExecutor(previous);
+}
+
+TEST(JsonTest, JsonDumpCached)
+{
+    Json json = Json::Parse(L"{\"config\": {\"name\": \"a long enough name for caching\", "
+                            L"\"values\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]}, "
+                            L"\"counters\": {\"hits\": 0, \"misses\": 0, \"label\": "
+                            L"\"another sufficiently long string value\"}}");
+    for (int indent: {-1, 2}) {
+        ASSERT_EQ(json.DumpCached(indent), json.Dump(indent));
+        json[L"counters"][L"hits"] = 1.;
+        ASSERT_EQ(json.DumpCached(indent), json.Dump(indent));
+        json[L"config"][L"values"].GetArrayRef().push_back(Json(13.));
+        ASSERT_EQ(json.DumpCached(indent), json.Dump(indent));
+    }
+
+    // A change made through a handle kept from earlier invalidates the 
+    // cached text of the containers around it as well.
+    json.DumpCached();
+    Json values = json[L"config"][L"values"];
+    Json config = json[L"config"];
+    json.DumpCached(2);
+    values.GetArrayRef().clear();
+    ASSERT_EQ(json.DumpCached(2), json.Dump(2));
+    ASSERT_EQ(json.DumpCached(), json.Dump());
+    values.GetArrayRef().push_back(Json(L"a value long enough to be cached by itself"));
+    ASSERT_EQ(config.DumpCached(), config.Dump());
+    ASSERT_EQ(json.DumpCached(), json.Dump());
+
+    // Strings are only seen changed when reached through their parents; 
+    // a change through a kept string handle needs ClearDumpCache().
+    Json name = json[L"config"][L"name"];
+    json.DumpCached();
+    json[L"config"][L"name"].GetStringRef() = L"a different name, long enough as well";
+    ASSERT_EQ(json.DumpCached(), json.Dump());
+    name.GetStringRef().resize(8);
+    json.ClearDumpCache();
+    ASSERT_EQ(json.DumpCached(), json.Dump());
+    ASSERT_NE(json.Dump().find("\"a differ\""), std::string::npos);
+
+    // A container shared by two documents invalidates both.
+    Json other(JsonValueType::Object);
+    other[L"shared"] = config;
+    ASSERT_EQ(other.DumpCached(), other.Dump());
+    values.GetArrayRef().clear();
+    ASSERT_EQ(other.DumpCached(), other.Dump());
+    ASSERT_EQ(json.DumpCached(), json.Dump());
+
+    // Threads filling and reading the same caches at once.
+    std::string expected = json.Dump(2);
+    json.ClearDumpCache();
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int round = 0; round < 200; ++round) {
+                if (json.DumpCached(2) != expected) ++mismatches;
+                if (round % 50 == i) json.ClearDumpCache();
+            }
+        });
+    }
+    for (auto &thread: threads) thread.join();
+    ASSERT_EQ(mismatches, 0);
+}
+
+TEST(JsonTest, JsonReparse)
+{
+    string_type text = L"{\"a\": [1, 2, {\"b\": 30}], \"c\": \"text\", \"d\": [true]}";
+    SourceMap source_map;
+    Json json = Json::Parse(text, source_map);
+    Json d = json[L"d"];
+    auto check = [&]() {
+        SourceMap expected_map;
+        ASSERT_EQ(json, Json::Parse(text, expected_map));
+        ASSERT_EQ(source_map.size(), expected_map.size());
+        SourceMap::Span span;
+        ASSERT_TRUE(source_map.Find(json[L"d"], span));
+        ASSERT_EQ(text.substr(span.begin, span.end - span.begin), L"[true]");
+    };
+
+    // 30 -> 3000: only the number is parsed again.
+    size_t offset = text.find(L"30");
+    ASSERT_EQ(Reparse(json, text, source_map, TextEdit{offset + 2, 0, L"00"}), 4);
+    ASSERT_EQ(json[L"a"][2][L"b"], Json(3000.));
+    ASSERT_EQ(json[L"d"].GetValuePtr(), d.GetValuePtr());
+    check();
+
+    // A new element changes the array, which is parsed instead.
+    offset = text.find(L"2,");
+    size_t parsed = Reparse(json, text, source_map, TextEdit{offset + 1, 0, L", 2.5"});
+    ASSERT_EQ(parsed, text.find(L"], \"c\"") + 1 - text.find(L"[1"));
+    ASSERT_EQ(json[L"a"].size(), 4);
+    check();
+
+    // Edits of keys and of the space between values go to the container.
+    offset = text.find(L"\"c\"");
+    Reparse(json, text, source_map, TextEdit{offset + 1, 1, L"key"});
+    ASSERT_EQ(json[L"key"], Json(L"text"));
+    check();
+
+    // An invalid edit leaves everything as it was.
+    string_type before = text;
+    ASSERT_THROW(Reparse(json, text, source_map, TextEdit{text.find(L"true"), 1, L""}), 
+                 ParseError);
+    ASSERT_EQ(text, before);
+    check();
+    ASSERT_THROW(Reparse(json, text, source_map, TextEdit{text.size() + 1, 0, L""}), 
+                 JsonError);
+
+    // With duplicate keys, edits inside the discarded value and inside the 
+    // values kept give the same document as a full parse.
+    const string_type duplicates = L"{\"a\": [1, 2, 3], \"a\": 0, \"b\": [4, 5, 6]}";
+    for (size_t offset = 0; offset < duplicates.size(); ++offset) {
+        if (!IsDigit(duplicates[offset])) continue;
+        string_type edited = duplicates;
+        SourceMap edited_map;
+        Json document = Json::Parse(edited, edited_map);
+        Reparse(document, edited, edited_map, TextEdit{offset, 1, L"9"});
+        ASSERT_EQ(document, Json::Parse(edited));
+        // A second edit relies on the spans left by the first.
+        Reparse(document, edited, edited_map, TextEdit{edited.size() - 3, 1, L"7"});
+        ASSERT_EQ(document, Json::Parse(edited));
+    }
+
+    // The nesting limit applies to the reparsed value at its depth, so 
+    // repeated edits cannot nest deeper than a full parse allows.
+    string_type deep = string_type(kMaxParseDepth - 1, L'[') + L"[1]" + 
+                       string_type(kMaxParseDepth - 1, L']');
+    SourceMap deep_map;
+    Json deep_json = Json::Parse(deep, deep_map);
+    ASSERT_THROW(Json::Parse(string_type(kMaxParseDepth, L'[') + L"[1]" + 
+                             string_type(kMaxParseDepth, L']')), ParseError);
+    before = deep;
+    ASSERT_THROW(Reparse(deep_json, deep, deep_map, 
+                         TextEdit{kMaxParseDepth, 1, L"[1]"}), ParseError);
+    ASSERT_EQ(deep, before);
+    Reparse(deep_json, deep, deep_map, TextEdit{kMaxParseDepth, 1, L"2"});
+    ASSERT_EQ(deep_json, Json::Parse(deep));
+}
+
+TEST(JsonTest, JsonTransaction)
+{
+    Json json = Json::Parse(L"{\"users\": [\"ann\", \"bob\"], \"count\": 2, \"meta\": {\"v\": 1}}");
+    std::string original = json.Dump();
+    Json users = json[L"users"];
+    Json meta = json[L"meta"];
+    {
+        Transaction transaction;
+        transaction.PushBack(users, Json(L"cy"));
+        transaction.Set(json, L"count", Json(3.));
+        transaction.Set(json, L"added", Json(true));
+        transaction.EraseAt(users, 0);
+        transaction.InsertAt(users, 2, Json(L"dee"));
+        transaction.Set(users, 0, Json(L"BOB"));
+        transaction.PopBack(users);
+        ASSERT_TRUE(transaction.Erase(json, L"meta"));
+        ASSERT_FALSE(transaction.Erase(json, L"missing"));
+        // Compared as values: member order in Dump() depends on the key type.
+        ASSERT_EQ(json, Json::Parse(L"{\"added\":true,\"count\":3,\"users\":[\"BOB\",\"cy\"]}"));
+        ASSERT_THROW(transaction.Set(users, 5, Json(1.)), JsonError);
+        ASSERT_THROW(transaction.Set(users, L"key", Json(1.)), IncompatibleTypeError);
+        ASSERT_EQ(transaction.size(), 8);
+        transaction.Rollback();
+        ASSERT_EQ(json.Dump(), original);
+        // The same nodes are back, not copies.
+        ASSERT_EQ(json[L"meta"].GetValuePtr(), meta.GetValuePtr());
+
+        transaction.Set(meta, L"v", Json(2.));
+        transaction.Commit();
+    }
+    ASSERT_EQ(json[L"meta"][L"v"], Json(2.));
+    {
+        // Rolled back when destroyed without Commit().
+        Transaction transaction;
+        transaction.PushBack(users, Json(L"eve"));
+    }
+    ASSERT_EQ(users.size(), 2);
+
+    // Changes and their undo reach the cached text of the containers 
+    // around the one modified.
+    Json document = Json::Parse(L"{\"team\": {\"name\": \"a name long enough to be cached\", "
+                                L"\"users\": [\"a user name long enough to be cached too\"]}}");
+    Json team_users = document[L"team"][L"users"];
+    ASSERT_EQ(document.DumpCached(), document.Dump());
+    {
+        Transaction transaction;
+        transaction.PushBack(team_users, Json(L"cy"));
+        ASSERT_EQ(document.DumpCached(), document.Dump());
+        transaction.Commit();
+    }
+    std::string committed = document.Dump();
+    ASSERT_EQ(document.DumpCached(), committed);
+    {
+        Transaction transaction;
+        transaction.EraseAt(team_users, 0);
+        ASSERT_EQ(document.DumpCached(), document.Dump());
+        transaction.Rollback();
+        ASSERT_EQ(document.DumpCached(), committed);
+    }
+}
+
+TEST(JsonTest, JsonVersionedDocument)
+{
+    VersionedDocument document(Json::Parse(
+            L"{\"config\": {\"a\": 1, \"b\": 1}, \"list\": [{\"x\": \"s\"}], \"big\": [1, 2, 3]}"));
+    VersionedDocument::Snapshot v1 = document.Read();
+    {
+        VersionedDocument::Writer writer = document.Write();
+        writer.Set(L"/config/a", Json(2.));
+        writer.Edit(L"/config")[L"b"] = Json(2.);
+        writer.Edit(L"/list/0/x").GetStringRef() += L"!";
+        writer.Set(L"/list/-", Json(true));
+        ASSERT_TRUE(writer.Erase(L"/list/0"));
+        ASSERT_FALSE(writer.Erase(L"/missing"));
+        ASSERT_THROW(writer.Edit(L"/nope/x"), JsonError);
+        // Not visible until published.
+        ASSERT_EQ(document.Read().Version(), 1);
+        ASSERT_EQ(writer.Publish(), 2);
+        writer.Set(L"/discarded", Json(1.));
+    }
+    VersionedDocument::Snapshot v2 = document.Read();
+    ASSERT_EQ(v2.Version(), 2);
+    ASSERT_EQ(v1.Root(), Json::Parse(L"{\"big\":[1,2,3],\"config\":{\"a\":1,\"b\":1},\"list\":[{\"x\":\"s\"}]}"));
+    ASSERT_EQ(v2.Root(), Json::Parse(L"{\"big\":[1,2,3],\"config\":{\"a\":2,\"b\":2},\"list\":[true]}"));
+    // Unmodified subtrees are shared between versions.
+    ASSERT_EQ(v1.Root()[L"big"].GetValuePtr(), v2.Root()[L"big"].GetValuePtr());
+    ASSERT_NE(v1.Root()[L"config"].GetValuePtr(), v2.Root()[L"config"].GetValuePtr());
+
+    // Readers always see a consistent version: "a" and "b" change together.
+    std::atomic<bool> done{false};
+    std::atomic<int> inconsistent{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                VersionedDocument::Snapshot snapshot = document.Read();
+                const Json &config = snapshot.Root()[L"config"];
+                if (config[L"a"] != config[L"b"]) ++inconsistent;
+            }
+        });
+    }
+    for (int i = 3; i < 200; ++i) {
+        VersionedDocument::Writer writer = document.Write();
+        writer.Set(L"/config/a", Json(double(i)));
+        writer.Set(L"/config/b", Json(double(i)));
+        writer.Publish();
+    }
+    done = true;
+    for (auto &reader: readers) reader.join();
+    ASSERT_EQ(inconsistent, 0);
+    ASSERT_EQ(document.Read().Root()[L"config"][L"a"], Json(199.));
+}
+
+TEST(JsonTest, JsonPrefetch)
+{
+    string_type text = L"[";
+    for (int i = 0; i < 100; ++i) {
+        if (i) text += L", ";
+        text += L"{\"id\": " + string_type(1, L'0' + i % 10) + 
+                L", \"tags\": [\"a\", \"b\"], \"nested\": {\"id\": 1}}";
+    }
+    text += L"]";
+    Json json = Json::Parse(text);
+    Json other = Json::Parse(text);
+    size_t previous = GetPrefetchDistance();
+    SetPrefetchDistance(0);
+    std::string dump = json.Dump();
+    size_t selected = Select(json, L"$..id").size();
+    for (size_t distance: {1, 4, 16, 1000}) {
+        SetPrefetchDistance(distance);
+        ASSERT_EQ(json.Dump(), dump);
+        ASSERT_EQ(json, other);
+        ASSERT_EQ(Select(json, L"$..id").size(), selected);
+    }
+    ASSERT_EQ(selected, 200u);
+    SetPrefetchDistance(previous);
+}
+
+TEST(JsonTest, JsonHostileInput)
+{
+    // Literals cut off by the end of input are rejected without reading past it.
+    for (const wchar_t *text: {L"t", L"tru", L"fals", L"nul", L"[true, fa"}) {
+        ASSERT_THROW(Json::Parse(text), ParseError);
+    }
+    ASSERT_EQ(Json::Parse(L"[false]")[0], Json(false));
+
+    string_type nested = string_type(kMaxParseDepth, L'[') + 
+                         string_type(kMaxParseDepth, L']');
+    ASSERT_EQ(Json::Parse(nested).size(), 1u);
+    string_type too_deep = L"[" + nested + L"]";
+    try {
+        Json::Parse(too_deep);
+        FAIL();
+    } catch (ParseError &e) {
+        ASSERT_EQ(e.GetOffset(), static_cast<long>(kMaxParseDepth));
+        ASSERT_NE(std::string(e.what()).find("depth"), std::string::npos);
+    }
+
+    // Errors deep inside a document still report the whole input.
+    string_type text = L"[[[{\"a\": [1, }]]]";
+    try {
+        Json::Parse(text);
+        FAIL();
+    } catch (ParseError &e) {
+        ASSERT_EQ(e.GetProcessedString(), text);
+        ASSERT_EQ(e.GetOffset(), 13);
+    }
+
+    // Numbers beyond the range of double saturate instead of throwing.
+    Json huge = Json::Parse(L"[1e400, -1e400, 1e-400]");
+    ASSERT_TRUE(std::isinf(huge[0].ToDouble()) && huge[0].ToDouble() > 0);
+    ASSERT_TRUE(std::isinf(huge[1].ToDouble()) && huge[1].ToDouble() < 0);
+    ASSERT_EQ(huge[2].ToDouble(), 0.);
+}
+
+#ifdef FJSON_TRACE
+TEST(JsonTest, JsonTrace)
+{
+    TraceCollector collector;
+    TraceCollector *previous = SetTraceCollector(&collector);
+    std::string text = "[1.5, 2, 3, 4, 5, {\"a\": [true]}]";
+    Json json = Json::Parse(text.data(), text.size());
+    json.Dump();
+    SetTraceCollector(previous);
+    size_t recorded = collector.size();
+    Json::Parse(L"[1]");
+    ASSERT_EQ(collector.size(), recorded);
+
+    std::string out;
+    collector.Write(out);
+    Json trace = Json::Parse(out.data(), out.size());
+    std::map<string_type, int> counts;
+    for (const auto &event: trace[L"traceEvents"].GetArrayRef()) {
+        ++counts[event[L"name"].GetStringRef()];
+        ASSERT_TRUE(event[L"ts"].IsNumber());
+    }
+    ASSERT_EQ(counts[L"decode utf-8"], 1);
+    ASSERT_EQ(counts[L"parse"], 1);
+    ASSERT_EQ(counts[L"dump"], 1);
+    ASSERT_EQ(counts[L"number conversion"], 5);
+    ASSERT_EQ(counts[L"number formatting"], 5);
+    ASSERT_GT(counts[L"array growth"], 0);
+}
+#endif
+
+TEST(JsonTest, JsonObjectKey)
+{
+    std::map<ObjectKey, int, _KeyLess> keys;
+    string_type prefix = L"metrics.service.latency.p99.";
+    for (int i = 0; i < 100; ++i) keys[prefix + std::to_wstring(i).c_str()] = i;
+    keys[L"z"] = -1;
+    ASSERT_EQ(keys.size(), 101u);
+    // Shorter keys order first regardless of content.
+    ASSERT_EQ(keys.begin()->first, string_type(L"z"));
+    for (int i = 0; i < 100; ++i) {
+        string_type key = prefix + std::to_wstring(i).c_str();
+        auto iter = keys.find(_KeyProbe(key));
+        ASSERT_NE(iter, keys.end());
+        ASSERT_EQ(iter->second, i);
+        ASSERT_EQ(iter->first.hash(), ObjectKey(key).hash());
+    }
+    ASSERT_EQ(keys.find(_KeyProbe(prefix + L"100")), keys.end());
+
+    // Objects behave the same with either key order.
+    Json json(JsonValueType::Object);
+    json[L"b"] = 1.;
+    json[prefix] = 2.;
+    json[prefix] = 3.;
+    ASSERT_EQ(json.size(), 2u);
+    ASSERT_EQ(*json.Find(prefix), Json(3.));
+    ASSERT_EQ(json.Find(prefix + L"x"), nullptr);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -210,7 +1305,7 @@ int main(int argc, char **argv)
     json["test1"] = 1000.;
     std::wcout << json["test1"] << std::endl;
     std::wcout << json << std::endl;
-    std::wstring json_str = LR"({"1.": 2, "nested": {"key": "value", "ok": true}, "pi": 3.14, "test": 0.3, "test1": 1000})";
+    string_type json_str = LR"({"1.": 2, "nested": {"key": "value", "ok": true}, "pi": 3.14, "test": 0.3, "test1": 1000})";
     _ParseValue(json, json_str.begin(), json_str.end());
     std::wcout << json;
 }
\ No newline at end of file